@@ -0,0 +1,85 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tinyos.h"
+#include "bios.h"
+
+/**
+	@file bench_exec.c
+
+	@brief A benchmark for process creation.
+
+	It measures how many @c Exec + @c WaitChild pairs per second the
+	kernel performs, for a child process that returns at once. This is
+	done for a few variations of the parent:
+	- with no open files and no arguments,
+	- with open files (so that the file table is inherited),
+	- with small arguments (copied into the PTCB),
+	- with large arguments (copied into malloc'ed memory),
+	- with many children created before waiting for any of them.
+
+	Usage: bench_exec [ncores [iterations]]
+ */
+
+static int iterations = 20000;
+
+static int child(int argl, void* args)
+{
+	return 0;
+}
+
+/* Run Exec+WaitChild pairs, in batches of the given size */
+static void measure(const char* name, int argl, void* args, int batch)
+{
+	Pid_t pids[batch];
+	TimerDuration t0 = bios_clock();
+
+	for(int i=0; i<iterations; i+=batch) {
+		for(int j=0; j<batch; j++)
+			if((pids[j] = Exec(child, argl, args)) == NOPROC) {
+				fprintf(stderr, "Exec failed\n");
+				exit(1);
+			}
+		for(int j=0; j<batch; j++)
+			WaitChild(pids[j], NULL);
+	}
+
+	TimerDuration dt = bios_clock() - t0;
+	printf("%-24s %12.0f %10.2f\n", name, 1E6*iterations/dt, (double)dt/iterations);
+}
+
+static int bench(int argl, void* args)
+{
+	char small[64], large[4096];
+	memset(small, 'a', sizeof(small));
+	memset(large, 'b', sizeof(large));
+
+	printf("%-24s %12s %10s\n", "case", "spawns/sec", "usec/spawn");
+
+	measure("plain", 0, NULL, 1);
+
+	for(int i=0; i<8; i++) OpenNull();
+	measure("8 open files", 0, NULL, 1);
+
+	measure("small args", sizeof(small), small, 1);
+	measure("large args", sizeof(large), large, 1);
+	measure("batches of 100", 0, NULL, 100);
+	return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+	int ncores = (argc > 1) ? atoi(argv[1]) : 1;
+	if(argc > 2) iterations = atoi(argv[2]);
+
+	if(ncores < 1 || ncores > MAX_CORES || iterations < 100) {
+		fprintf(stderr, "usage: %s [ncores [iterations]], with iterations >= 100\n", argv[0]);
+		return 1;
+	}
+
+	boot(ncores, 0, bench, 0, NULL);
+	return 0;
+}
@@ -0,0 +1,196 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+/* The host's SCHED_IDLE policy (unused here) clashes with the SCHED_CAUSE of the kernel */
+#undef SCHED_IDLE
+
+#include "util.h"
+#include "kernel_sched.h"
+
+/**
+	@file bench_percore.c
+
+	@brief A microbenchmark for false sharing between per-core data.
+
+	Each of a number of host threads, pinned to distinct host CPUs when
+	possible, plays the role of a core and repeatedly updates the hot
+	fields of its own core control block, the way the scheduler and the
+	locking code do. This is done twice:
+	- on an array laid out as the CCBs used to be: packed, with the
+	  preemption flag of each core sharing a cache line with the
+	  current thread of the next core, and a global timeslice counter;
+	- on the real, cache-line aligned @c cctx array.
+
+	For each run, the time per iteration and (if the host allows access
+	to the performance counters) the L1 data cache misses per iteration
+	are reported. With false sharing, the misses per iteration grow
+	with the number of threads; without it, they stay near zero.
+
+	Usage: bench_percore [threads]
+ */
+
+
+/* The old layout of the CCB */
+typedef struct packed_ccb {
+	uint id;
+	TCB* current_thread;
+	TCB idle_thread;
+	sig_atomic_t preemption;
+} packed_ccb;
+
+static packed_ccb packed[MAX_CORES];
+static volatile uint32_t packed_timeslices;
+
+#define ITERATIONS 10000000L
+
+
+typedef struct worker {
+	pthread_t thread;
+	int cpu;								/* host cpu, or -1 */
+	volatile sig_atomic_t* preemption;
+	volatile uint32_t* timeslices;
+	TCB* volatile * current_thread;
+
+	long long misses;						/* -1 if not available */
+	double secs;
+} worker;
+
+
+/* Open an L1D read miss counter for the calling thread, or return -1 */
+static int open_miss_counter()
+{
+	struct perf_event_attr pe = {
+		.type = PERF_TYPE_HW_CACHE,
+		.size = sizeof(struct perf_event_attr),
+		.config = PERF_COUNT_HW_CACHE_L1D
+			| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		.disabled = 1,
+		.exclude_kernel = 1,
+		.exclude_hv = 1
+	};
+	return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+
+static double now()
+{
+	struct timespec t;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &t));
+	return t.tv_sec + 1E-9*t.tv_nsec;
+}
+
+
+static void* run_worker(void* arg)
+{
+	worker* w = arg;
+
+	if(w->cpu >= 0) {
+		cpu_set_t cpu;
+		CPU_ZERO(&cpu);
+		CPU_SET(w->cpu, &cpu);
+		CHECKRC(pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu));
+	}
+
+	int fd = open_miss_counter();
+	if(fd != -1) {
+		CHECK(ioctl(fd, PERF_EVENT_IOC_RESET, 0));
+		CHECK(ioctl(fd, PERF_EVENT_IOC_ENABLE, 0));
+	}
+
+	double t0 = now();
+	for(long i=0; i<ITERATIONS; i++) {
+		/* What a scheduler pass does to the hot fields */
+		__atomic_exchange_n(w->preemption, 0, __ATOMIC_RELAXED);
+		(*w->timeslices)++;
+		(void) *w->current_thread;
+		__atomic_exchange_n(w->preemption, 1, __ATOMIC_RELAXED);
+	}
+	w->secs = now() - t0;
+
+	w->misses = -1;
+	if(fd != -1) {
+		CHECK(ioctl(fd, PERF_EVENT_IOC_DISABLE, 0));
+		CHECK(read(fd, &w->misses, sizeof(w->misses)));
+		CHECK(close(fd));
+	}
+	return NULL;
+}
+
+
+static void run(const char* layout, int packed_layout, int nthreads, cpu_set_t* cpus)
+{
+	worker W[MAX_CORES];
+
+	int cpu = -1;
+	for(int i=0; i<nthreads; i++) {
+		/* Next host cpu, round robin */
+		do cpu = (cpu+1) % CPU_SETSIZE; while(!CPU_ISSET(cpu, cpus));
+		W[i].cpu = cpu;
+
+		if(packed_layout) {
+			W[i].preemption = & packed[i].preemption;
+			W[i].timeslices = & packed_timeslices;
+			W[i].current_thread = & packed[i].current_thread;
+		} else {
+			W[i].preemption = & cctx[i].preemption;
+			W[i].timeslices = & cctx[i].timeslices;
+			W[i].current_thread = & cctx[i].current_thread;
+		}
+	}
+
+	for(int i=0; i<nthreads; i++)
+		CHECKRC(pthread_create(&W[i].thread, NULL, run_worker, &W[i]));
+
+	double secs = 0.0;
+	long long misses = 0;
+	for(int i=0; i<nthreads; i++) {
+		CHECKRC(pthread_join(W[i].thread, NULL));
+		secs += W[i].secs;
+		if(W[i].misses < 0 || misses < 0) misses = -1;
+		else misses += W[i].misses;
+	}
+
+	printf("%-8s %8d %10.2f", layout, nthreads, 1E9*secs/(nthreads*ITERATIONS));
+	if(misses >= 0)
+		printf(" %16.3f\n", (double)misses/(nthreads*ITERATIONS));
+	else
+		printf(" %16s\n", "n/a");
+}
+
+
+int main(int argc, char** argv)
+{
+	cpu_set_t cpus;
+	CHECK(sched_getaffinity(0, sizeof(cpus), &cpus));
+	int ncpus = CPU_COUNT(&cpus);
+
+	int maxthreads = (argc > 1) ? atoi(argv[1]) : (ncpus < 4 ? 4 : ncpus);
+	if(maxthreads < 2 || maxthreads > MAX_CORES) {
+		fprintf(stderr, "usage: %s [threads], with 2 <= threads <= %d\n", argv[0], MAX_CORES);
+		return 1;
+	}
+
+	if(ncpus < 2)
+		printf("Only %d host cpu: threads share it, and no cache lines can bounce.\n", ncpus);
+	int probe = open_miss_counter();
+	if(probe == -1)
+		printf("Performance counters are not available, reporting time only.\n");
+	else
+		CHECK(close(probe));
+
+	printf("%-8s %8s %10s %16s\n", "layout", "threads", "ns/iter", "L1D misses/iter");
+	for(int n=1; n<=maxthreads; n*=2) {
+		run("packed", 1, n, &cpus);
+		run("aligned", 0, n, &cpus);
+	}
+	return 0;
+}
@@ -0,0 +1,109 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "tinyos.h"
+#include "bios.h"
+
+/**
+	@file bench_terminal.c
+
+	@brief A benchmark for the throughput of terminals.
+
+	It starts a @c terminal program on serial port 0, with its stdin
+	reading from /dev/zero and its stdout writing to /dev/null, and
+	measures the bytes per second that pass
+	- from the kernel to the terminal, over @c con0, and
+	- from the terminal to the kernel, over @c kbd0.
+
+	The fifos must exist (see @c make @c fifos).
+
+	Usage: bench_terminal [megabytes [terminal-program]]
+ */
+
+static size_t total = 16 << 20;
+
+#define CHUNK 65536
+
+static void report(const char* name, TimerDuration dt)
+{
+	printf("%-12s %12.1f MB/s %10.3f sec\n", name, (double)total/dt, dt/1E6);
+}
+
+static int bench(int argl, void* args)
+{
+	static char buf[CHUNK];
+	memset(buf, 'x', CHUNK);
+
+	printf("%-12s %17s %14s\n", "direction", "throughput", "time");
+
+	/* Close waits until the terminal has taken everything */
+	Fid_t fid = OpenTerminal(0);
+	TimerDuration t0 = bios_clock();
+	for(size_t n=0; n < total; ) {
+		int rc = Write(fid, buf, CHUNK);
+		if(rc <= 0) { fprintf(stderr, "Write failed\n"); return 1; }
+		n += rc;
+	}
+	Close(fid);
+	report("con", bios_clock() - t0);
+
+	fid = OpenTerminal(0);
+	t0 = bios_clock();
+	for(size_t n=0; n < total; ) {
+		int rc = Read(fid, buf, CHUNK);
+		if(rc <= 0) { fprintf(stderr, "Read failed\n"); return 1; }
+		n += rc;
+	}
+	report("kbd", bios_clock() - t0);
+	Close(fid);
+
+	return 0;
+}
+
+
+/* Start the terminal before booting, since booting waits for it */
+static pid_t start_terminal(const char* prog)
+{
+	pid_t pid = fork();
+	if(pid == 0) {
+		int in = open("/dev/zero", O_RDONLY);
+		int out = open("/dev/null", O_WRONLY);
+		if(in == -1 || out == -1 || dup2(in, 0) == -1 || dup2(out, 1) == -1) {
+			perror("redirecting the terminal");
+			_exit(1);
+		}
+		execl(prog, prog, "0", NULL);
+		perror(prog);
+		_exit(1);
+	}
+	if(pid == -1) {
+		perror("fork");
+		exit(1);
+	}
+	return pid;
+}
+
+
+int main(int argc, char** argv)
+{
+	if(argc > 1) total = (size_t)atoi(argv[1]) << 20;
+	const char* prog = (argc > 2) ? argv[2] : "./terminal";
+
+	if(argc > 3 || total == 0) {
+		fprintf(stderr, "usage: %s [megabytes [terminal-program]]\n", argv[0]);
+		return 1;
+	}
+
+	pid_t term = start_terminal(prog);
+	boot(1, 1, bench, 0, NULL);
+
+	kill(term, SIGTERM);
+	waitpid(term, NULL, 0);
+	return 0;
+}
@@ -4,11 +4,13 @@
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sched.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
@@ -16,25 +18,44 @@
 #include "util.h"
 #include "bios.h"
 
+/* Older glibc headers do not name the thread id field of sigevent */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 /*
 	Implementation of bios.h API
 
 
 	Basic idea:
 	- Each core is simulated by a pthread
-	- One POSIX timer per core thread
-	- Core threads mask all signals except for USR1.
-	- The PIC thread receives all signals and dispatches them to
-	the right core thread by raising SIGUSR1.
+	- One POSIX timer per core thread, delivering SIGALRM directly to
+	the core thread (SIGEV_THREAD_ID).
+	- Core threads mask all signals except for USR1 and ALRM.
+	- Other interrupts (ICI and serial) are raised by marking them 
+	pending and sending SIGUSR1 to the core thread.
+	- A halted core waits for either signal in sigwaitinfo().
+	- Optionally (see vm_configure()), core threads are pinned to distinct
+	host CPUs and the PIC thread to a housekeeping CPU. Each core thread
+	initializes its own Core, so that it is local to the core's NUMA node.
+	- The PIC thread only handles devices. It waits on an epoll set, 
+	containing a signalfd, a timerfd for the coarse clock and the 
+	terminal fds, and raises serial interrupts to the cores.
 
  */
 
 
 /*
 	Per-core data.
+
+	The fields are grouped by who writes them, each group on its own
+	cache lines: the fields written by other threads (to raise interrupts
+	or restart the core) do not invalidate the fields the core uses on
+	every interrupt.
  */
 typedef struct core
 {
+	/* Set at boot, read-mostly */
 	uint id;
 	interrupt_handler* bootfunc;
 	pthread_t thread;
@@ -43,17 +64,21 @@ typedef struct core
 	timer_t timer_id;
 
 	interrupt_handler* intvec[maximum_interrupt_no];
-	sig_atomic_t intpending[maximum_interrupt_no];
 
-	sig_atomic_t int_disabled;
-	sig_atomic_t halted;
-	rlnode halted_node;
-	pthread_cond_t halt_cond;
-
-	/* Statistics */
+	/* Written only by this core */
+	sig_atomic_t int_disabled __attribute__((aligned(CACHE_LINE_SIZE)));
 	int irq_count;
-	int irq_raised[maximum_interrupt_no];
 	int irq_delivered[maximum_interrupt_no];
+
+	/* Written by other threads */
+	sig_atomic_t intpending[maximum_interrupt_no] __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint serial_pending[maximum_interrupt_no];	/* bitmap of serial ports, 
+												   per serial interrupt */
+	int irq_raised[maximum_interrupt_no];
+
+	/* Written under core_halt_mutex */
+	sig_atomic_t halted __attribute__((aligned(CACHE_LINE_SIZE)));
+	rlnode halted_node;
 } Core;
 
 
@@ -66,14 +91,24 @@ static sigset_t core_signal_set;
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
-/* Uset to store the singleton set containing SIGALRM */
-static sigset_t sigalrm_set;
+/* Used to store the set of interrupt signals of a core, SIGUSR1 and SIGALRM */
+static sigset_t core_interrupt_set;
 
 /* Used to create the signalfd */
 static sigset_t signalfd_set;
 
-/* Array of Core objects, one per core */
-static Core CORE[MAX_CORES];
+/* Array of Core objects, one per core. Each is mapped on its own pages,
+   which are first touched by the core thread. */
+static Core* CORE[MAX_CORES];
+
+/* Size of the mapping of a Core */
+#define CORE_MAP_SIZE  ((sizeof(Core)+4095) & ~4095ul)
+
+/* The boot function for the core threads */
+static interrupt_handler* core_bootfunc;
+
+/* The mapping of the machine onto the host, set by vm_configure() */
+static vm_config host_config = { .pin_cores = 0, .housekeeping_cpu = -1, .realtime = 0 };
 
 /* Number of cores */
 static unsigned int ncores = 0;
@@ -93,29 +128,38 @@ static rlnode halted_list;
 /* PIC thread id */
 static pthread_t PIC_thread;
 
-/* Save the sigaction for SIGUSR1 */
-static struct sigaction USR1_saved_sigaction;
+/* The epoll set of the PIC thread */
+static int PIC_epollfd = -1;
+
+/* Save the sigactions for SIGUSR1 and SIGALRM */
+static struct sigaction USR1_saved_sigaction, ALRM_saved_sigaction;
 
-/* The sigaction for SIGUSR1 (core interrupts) */
-static struct sigaction USR1_sigaction;
+/* The sigaction for SIGUSR1 and SIGALRM (core interrupts) */
+static struct sigaction core_sigaction;
 
-/* A simulated coarse clock measuring time with a res. of 0.1 sec,
+/* A simulated coarse clock measuring time in msec,
    since "boot". Used for serial device timeouts. */
 typedef unsigned long coarse_clock_t;
 static volatile coarse_clock_t  system_clock;
 
 /* This is how fast the coarse clock is updated (in usec) */
-#define SLOW_HZ 10000
+#define SLOW_HZ 100000
+
+/* The value of CLOCK_MONOTONIC at boot, in usec. Used by bios_clock(). */
+static TimerDuration boot_clock;
 
 /* This gives a rough serial port timeout of 300 msec */
 #define SERIAL_TIMEOUT 300
 
-static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
+static void core_signal_handler(int signo, siginfo_t* si, void* ctx);
 
 
 /* PIC daemon statistics */
 static unsigned long PIC_loops, PIC_usr1_drained, PIC_usr1_queued;
 
+/* Maximum number of events returned by one epoll_wait() of the PIC */
+#define PIC_MAX_EVENTS (2*MAX_TERMINALS+5)
+
 
 /* Initialize static vars. This is called via pthread_once() */
 static pthread_once_t init_control = PTHREAD_ONCE_INIT;
@@ -124,22 +168,23 @@ static void initialize()
 	/* Create the thread-local var for core no. */
 	CHECKRC(pthread_key_create(&Core_key, NULL));
 
-	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
-	sigemptyset(& USR1_sigaction.sa_mask);
+	core_sigaction.sa_sigaction = core_signal_handler;
+	core_sigaction.sa_flags = SA_SIGINFO;
+	sigemptyset(& core_sigaction.sa_mask);
 
-	/* Create the sigmask to block all signals, except USR1 */
+	/* Create the sigmask to block all signals, except USR1 and ALRM */
 	CHECK(sigfillset(&core_signal_set));
 	CHECK(sigdelset(&core_signal_set, SIGUSR1));
+	CHECK(sigdelset(&core_signal_set, SIGALRM));
 
 	/* Create the mask for blocking SIGUSR1 */
 	CHECK(sigemptyset(&sigusr1_set));
 	CHECK(sigaddset(&sigusr1_set, SIGUSR1));
 
-	/* Create the mask for  SIGALRM */
-	CHECK(sigemptyset(&sigalrm_set));
-	CHECK(sigaddset(&sigalrm_set, SIGALRM));
-
+	/* Create the mask for blocking core interrupts */
+	CHECK(sigemptyset(&core_interrupt_set));
+	CHECK(sigaddset(&core_interrupt_set, SIGUSR1));
+	CHECK(sigaddset(&core_interrupt_set, SIGALRM));
 
 	/* Create signaldf_set */
 	CHECK(sigemptyset(&signalfd_set));
@@ -158,7 +203,7 @@ static void PIC_daemon();  /* forward def */
 */
 _Thread_local uint cpu_core_id;
 static inline Core* curr_core() {
-	return CORE+cpu_core_id;
+	return CORE[cpu_core_id];
 }
 
 
@@ -178,15 +223,33 @@ static inline void interrupt_pic_thread()
 
 /*
 	Helper pthread-startable function to launch a core thread.
+	The argument is the core id.
 */
-static void* bootfunc_wrapper(void* _core)
+static void* bootfunc_wrapper(void* _coreid)
 {
-	Core* core = (Core*)_core;
+	uint coreid = (uintptr_t)_coreid;
+
+	/* Initialize the Core, touching its pages first from this thread */
+	Core* core = CORE[coreid];
+	core->id = coreid;
+	core->bootfunc = core_bootfunc;
+	core->thread = pthread_self();
+
+	core->halted = 0;
+	rlnode_init(& core->halted_node, core);
+
+	/* Initialize Core statistics */
+	core->irq_count = 0;
+	for(uint intno=0; intno<maximum_interrupt_no;intno++) {
+		core->irq_delivered[intno] = 0;
+		core->irq_raised[intno] = 0;
+	}
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) {
 		core->intvec[i] = NULL;
 		core->intpending[i] = 0;
+		core->serial_pending[i] = 0;
 	}
 
 	/* Mark interrupts as enabled */
@@ -199,11 +262,12 @@ static void* bootfunc_wrapper(void* _core)
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
-	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
+	/* create a thread-specific timer, signaling this thread directly */
+	core->timer_sigevent.sigev_notify = SIGEV_THREAD_ID;
 	core->timer_sigevent.sigev_signo = SIGALRM;
 	core->timer_sigevent.sigev_value.sival_int = core->id;
-	CHECK(timer_create(CLOCK_REALTIME, & core->timer_sigevent, & core->timer_id));
+	core->timer_sigevent.sigev_notify_thread_id = gettid();
+	CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
@@ -230,22 +294,31 @@ static void* bootfunc_wrapper(void* _core)
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
-	return _core;
+	return _coreid;
 }
 
 
 /*
-	Raise an interrupt to a core.
+	Raise an interrupt to a core. A single SIGUSR1 both interrupts
+	a running core and wakes up a halted one.
  */
 static inline void raise_interrupt(Core* core, Interrupt intno) 
 {
-	union sigval coreval;
-	coreval.sival_ptr = NULL; /* This is to silence valgrind */
-	coreval.sival_int = core->id;
 	core->intpending[intno] = 1;
 	core->irq_raised[intno] ++;
-	CHECKRC(pthread_sigqueue(core->thread, SIGUSR1, coreval));
-	cpu_core_restart(core->id);
+	CHECKRC(pthread_kill(core->thread, SIGUSR1));
+}
+
+
+/*
+	Raise a serial interrupt to a core, marking the port that 
+	caused it in the core's pending bitmap. The bit must be set 
+	before the interrupt is raised, so that the handler always finds it.
+ */
+static inline void raise_serial_interrupt(Core* core, Interrupt intno, uint serial)
+{
+	__atomic_fetch_or(& core->serial_pending[intno], 1u << serial, __ATOMIC_RELEASE);
+	raise_interrupt(core, intno);
 }
 
 
@@ -269,12 +342,25 @@ static void dispatch_interrupts(Core* core)
 }
 
 
+/*
+	Mark an expiration of the core timer as a pending ALARM.
+ */
+static inline void core_timer_expired(Core* core)
+{
+	core->intpending[ALARM] = 1;
+	core->irq_raised[ALARM] ++;
+}
+
+
 /*
 	This is the handler run by core threads to handle interrupts.
+	SIGALRM comes from the core's own timer, SIGUSR1 from raise_interrupt().
  */
-static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
+static void core_signal_handler(int signo, siginfo_t* si, void* ctx)
 {
-	Core* core = & CORE[si->si_value.sival_int];
+	Core* core = curr_core();
+
+	if(signo==SIGALRM) core_timer_expired(core);
 
 	core->irq_count++;
 	if(core->int_disabled) return;
@@ -287,12 +373,18 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
  */
 
 
+/* Monotonic host clock, in usec */
+static inline TimerDuration get_monotonic_time()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec / 1000 + curtime.tv_sec*1000000ull;
+}
+
 /* Coarse clock */
 static coarse_clock_t get_coarse_time()
 {
-	struct timespec curtime;
-	CHECK(clock_gettime(CLOCK_REALTIME, &curtime));
-	return curtime.tv_nsec / 1000000 + curtime.tv_sec*1000;
+	return get_monotonic_time() / 1000;
 }
 
 
@@ -311,11 +403,14 @@ static coarse_clock_t get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
+	An io_device is ready if I/O operations may succeed (as reported by epoll).
 
-	A not-ready device is made ready when select() returns it as such.
+	The fd is registered edge-triggered in the epoll set of the PIC.
+	A not-ready device is made ready when epoll reports it as such.
 
-	A ready device is made not-ready on each failed attempt to do an I/O transfer.
+	A ready device is made not-ready on each failed (or short) attempt to do
+	an I/O transfer. At this point, the fd is re-armed in the epoll set, which
+	makes epoll re-check it, so that no edge is lost.
 
 	When a not-ready device becomes ready, an interrupt is raised.
  */
@@ -337,6 +432,8 @@ typedef struct io_device
 	volatile Core* int_core;		/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
 	coarse_clock_t last_int;	/* used for timeouts */
+	int pollable;				/* 0 for fds that epoll cannot watch (always ready) */
+	volatile int eof;			/* set when the last read found the end of input */
 } io_device;
 
 
@@ -349,50 +446,81 @@ static int io_ready(int fd, io_direction dir) {
 	return (pfd.revents & evt) ? 1 : 0;
 }
 
+/* The epoll events monitored for a device */
+static inline uint32_t io_events(io_device* this)
+{
+	return ((this->iodir==IODIR_RX) ? EPOLLIN : EPOLLOUT) | EPOLLET;
+}
+
+/*
+	Mark the device as not-ready and re-arm its fd in the PIC's epoll set.
+	If the fd is already ready again, epoll will report it immediately.
+ */
+static void io_device_not_ready(io_device* this)
+{
+	if(! this->pollable) return;
+	this->ready = 0;
+	struct epoll_event evt = { .events = io_events(this), .data.fd = this->fd };
+	CHECK(epoll_ctl(PIC_epollfd, EPOLL_CTL_MOD, this->fd, &evt));
+}
+
 static void io_device_init(io_device* this, int fd, io_direction iodir)
 {
 	this->fd = fd;
 	this->iodir = iodir;
-	this->int_core = &CORE[0];
+	this->int_core = CORE[0];
 	this->ready = io_ready(fd, iodir);
 	this->last_int = system_clock;
+	this->pollable = 1;
+	this->eof = 0;
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+/*
+	Transfer up to n bytes from the device into buf, with a single 
+	read(2). A short transfer marks the device as not-ready, so that
+	an interrupt is raised when more data arrives.
+ */
+static size_t io_device_read(io_device* this, char* buf, size_t n)
 {
 	assert(this->iodir == IODIR_RX);
-	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
-	assert(rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)));
+	ssize_t rc;
+	while((rc=read(this->fd, buf, n))==-1 && errno == EINTR);
+	assert(rc>=0 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)));
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
-	}
-	return rc==1;
+	/* A read of 0 bytes means the end of input, as opposed to EAGAIN */
+	this->eof = (rc==0 && n>0);
+
+	if(rc<0) rc = 0;
+	if(rc<n && this->ready)
+		io_device_not_ready(this);
+	return rc;
 }
 
 
-static int io_device_write(io_device* this, char value)
+/*
+	Transfer up to n bytes from buf to the device, with a single 
+	write(2). A short transfer marks the device as not-ready, so that
+	an interrupt is raised when the device can accept more data.
+ */
+static size_t io_device_write(io_device* this, const char* buf, size_t n)
 {
 	assert(this->iodir == IODIR_TX);
 
 	/* Try to write */
-	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
+	ssize_t rc;
+	while((rc = write(this->fd, buf, n))==-1 && errno == EINTR);
 
-	assert(rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE))); 
+	assert(rc>=0 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE))); 
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
-	} 
+	if(rc<0) rc = 0;
+	if(rc<n && this->ready)
+		io_device_not_ready(this); 
 
-	return rc==1;
+	return rc;
 }
 
 
@@ -404,12 +532,21 @@ typedef struct terminal
 	io_device con, kbd;            /* fds for terminal fifos */
 } terminal;
 
-/* The terminal table */
-static terminal TERM[MAX_TERMINALS];
+/* The terminal table; the last entry is the console */
+static terminal TERM[MAX_TERMINALS+1];
 
 /* Current number of terminals */
 static uint nterm = 0;
 
+/* Set if the console is connected */
+static int console_on = 0;
+
+/* Check that a serial port is connected */
+static inline int serial_port_on(uint serial)
+{
+	return serial < nterm || (serial == SERIAL_CONSOLE && console_on);
+}
+
 /*
 	Open the FIFOs for this terminal
  */
@@ -445,6 +582,50 @@ static int terminal_destroy(terminal* this)
 }
 
 
+/*
+	Connect the console to the standard input and output of the host.
+
+	The fds are opened anew, so that making them non-blocking does not affect
+	the host's own file descriptions. Regular files (and sockets, which cannot
+	be reopened) are duplicated instead; a regular file must share its
+	offset with the host.
+ */
+static int console_fd(int hostfd, int flags)
+{
+	struct stat st;
+	if(fstat(hostfd, &st)==-1) return -1;
+
+	int fd = -1;
+	if(! S_ISREG(st.st_mode)) {
+		char fname[32];
+		sprintf(fname, "/proc/self/fd/%d", hostfd);
+		fd = open(fname, flags);
+	}
+	if(fd==-1)
+		fd = dup(hostfd);
+	return fd;
+}
+
+static int console_init(terminal* this)
+{
+	/* Output written by the host so far goes first */
+	fflush(stdout);
+
+	int fd = console_fd(1, O_WRONLY);
+	if(fd==-1) return -1;
+	io_device_init(& this->con, fd, IODIR_TX);
+
+	fd = console_fd(0, O_RDONLY);
+	if(fd==-1) {
+		CHECK(close(this->con.fd));
+		return -1;
+	}
+	io_device_init(& this->kbd, fd, IODIR_RX);
+
+	return 0;
+}
+
+
 /*
 	Just a couple of helpers.
  */
@@ -456,25 +637,23 @@ static void close_terminal(terminal* term)
 {
 	CHECK(terminal_destroy(term));
 }
-static inline void fdset_add(fd_set* set, int fd, int* nfds)
+static inline void epoll_add(int epfd, int fd, uint32_t events)
 {
-	FD_SET(fd, set);
-	if(fd >= *nfds) *nfds = fd+1;
+	struct epoll_event evt = { .events = events, .data.fd = fd };
+	CHECK(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &evt));
 }
-
-
-static int check_terminal(terminal* term)
+/* Regular files and some devices (e.g., /dev/null) cannot be watched, but never block */
+static void epoll_add_device(int epfd, io_device* dev)
 {
-	/* poll the read side */
-	struct pollfd fds = { .fd=term->kbd.fd, .events=POLLIN };
-	int rc;
-	while( (rc=poll(&fds, 1, 0)) == -1 && errno==EINTR );
-	CHECK(rc);
-	return (fds.revents & (POLLHUP|POLLERR))==0;
+	struct epoll_event evt = { .events = io_events(dev), .data.fd = dev->fd };
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, dev->fd, &evt)==-1) {
+		CHECK_CONDITION(errno==EPERM);
+		dev->pollable = 0;
+		dev->ready = 1;
+	}
 }
 
 
-
 /* Helper for PIC_daemon */
 static void pic_drain_sigusr1(int sigusr1fd)
 {
@@ -491,15 +670,61 @@ static void pic_drain_sigusr1(int sigusr1fd)
 }
 
 
+/* Helper for PIC_daemon: make a device ready and raise its interrupt */
+static void pic_device_ready(io_device* dev, Interrupt intno, uint serial)
+{
+	dev->ready = 1;
+	dev->last_int = system_clock;
+	raise_serial_interrupt((Core*) dev->int_core, intno, serial);
+}
+
+
+/* Helper for PIC_daemon: handle an epoll event for a terminal fd */
+static void pic_terminal_event(int fd, uint32_t events)
+{
+	for(uint i=0; i<=SERIAL_CONSOLE; i++) {
+		if(! serial_port_on(i)) continue;
+		terminal* term = & TERM[i];
+
+		/* Hangups and errors are not readiness; the timeout will handle them */
+		if(fd == term->con.fd) {
+			if((events & EPOLLOUT) && !term->con.ready)
+				pic_device_ready(& term->con, SERIAL_TX_READY, i);
+			return;
+		}
+		if(fd == term->kbd.fd) {
+			if((events & EPOLLIN) && !term->kbd.ready)
+				pic_device_ready(& term->kbd, SERIAL_RX_READY, i);
+			return;
+		}
+	}
+}
+
+
+/* Helper for PIC_daemon: raise interrupts for timed-out devices */
+static void pic_check_timeouts()
+{
+	for(uint i=0; i<=SERIAL_CONSOLE; i++) {
+		if(! serial_port_on(i)) continue;
+		terminal* term = & TERM[i];
+		if((system_clock-term->con.last_int)>SERIAL_TIMEOUT) 
+			pic_device_ready(& term->con, SERIAL_TX_READY, i);
+		if((system_clock-term->kbd.last_int)>SERIAL_TIMEOUT) 
+			pic_device_ready(& term->kbd, SERIAL_RX_READY, i);
+	}
+}
+
+
 /*
 	The PIC daemon is the dispatcher on interrupts to core threads,
 	by calling raise_interrupt().
 
-	Interrupts sent include
-	(a) ALARM, when the per-core timer expires
-	(b) SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
-		io_device becomes ready.
+	Interrupts sent are SERIAL_RX_READY  &  SERIAL_TX_READY, when 
+	some io_device becomes ready, or times out. The ALARM interrupts
+	are delivered to the cores directly by their timers.
 
+	The daemon sleeps in epoll_wait() until some event arrives. The
+	coarse clock is driven by a periodic timerfd.
  */
 static void PIC_daemon(uint serialno)
 {
@@ -513,15 +738,37 @@ static void PIC_daemon(uint serialno)
 	CHECKRC(pthread_getname_np(pthread_self(), oldname, 16));
 	CHECKRC(pthread_setname_np(pthread_self(), "tinyos_vm"));
 
-	for(uint i=0; i<nterm; i++)
-		open_terminal(& TERM[i], i);
-
 	sigset_t saved_mask;
 
 	int sigusr1fd = signalfd(-1, &sigusr1_set, SFD_NONBLOCK);
 	CHECK(sigusr1fd);
-	int sigalrmfd = signalfd(-1, &sigalrm_set, SFD_NONBLOCK);
-	CHECK(sigalrmfd);
+
+	/* The coarse clock ticks every SLOW_HZ usec */
+	int clockfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	CHECK(clockfd);
+	struct itimerspec clockspec = {
+		.it_value = { .tv_sec=0, .tv_nsec=SLOW_HZ*1000l },
+		.it_interval = { .tv_sec=0, .tv_nsec=SLOW_HZ*1000l }
+	};
+	CHECK(timerfd_settime(clockfd, 0, &clockspec, NULL));
+
+	PIC_epollfd = epoll_create1(0);
+	CHECK(PIC_epollfd);
+	epoll_add(PIC_epollfd, sigusr1fd, EPOLLIN);
+	epoll_add(PIC_epollfd, clockfd, EPOLLIN);
+
+	for(uint i=0; i<nterm; i++) {
+		open_terminal(& TERM[i], i);
+		epoll_add(PIC_epollfd, TERM[i].con.fd, io_events(&TERM[i].con));
+		epoll_add(PIC_epollfd, TERM[i].kbd.fd, io_events(&TERM[i].kbd));
+	}
+
+	/* The console is optional: the host may have closed its stdin or stdout */
+	console_on = (console_init(& TERM[SERIAL_CONSOLE])==0);
+	if(console_on) {
+		epoll_add_device(PIC_epollfd, & TERM[SERIAL_CONSOLE].con);
+		epoll_add_device(PIC_epollfd, & TERM[SERIAL_CONSOLE].kbd);
+	}
 
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
 		
@@ -530,80 +777,35 @@ static void PIC_daemon(uint serialno)
 	
 	/* The PIC multiplexing loop */
 	while(__atomic_load_n(&PIC_active, __ATOMIC_ACQUIRE)) {
-		int maxfd = 0;
-		fd_set readfds, writefds;
-
-		/* Prepare to select */
-		FD_ZERO(&readfds);
-		FD_ZERO(&writefds);
-
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];
-			if(!check_terminal(term)) continue;
-			if(! term->kbd.ready) fdset_add(&readfds, term->kbd.fd, &maxfd);
-			if(! term->con.ready) fdset_add(&writefds, term->con.fd, &maxfd);
-		}
-
-		fdset_add(&readfds, sigalrmfd, &maxfd);
-		fdset_add(&readfds, sigusr1fd, &maxfd);
+		struct epoll_event events[PIC_MAX_EVENTS];
 
-		/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-		struct timeval sleeptime = { .tv_sec=0, .tv_usec = SLOW_HZ };
-		int selcode = select(maxfd, &readfds, &writefds, NULL, &sleeptime);
-
-		/* update system clock */
-		system_clock = get_coarse_time();
+		int nevents = epoll_wait(PIC_epollfd, events, PIC_MAX_EVENTS, -1);
 
 		/* process */
-		if(selcode<0) continue;
+		if(nevents<0) {
+			assert(errno==EINTR);
+			continue;
+		}
 		__atomic_fetch_add(&PIC_loops,1,__ATOMIC_RELAXED);
 
-		/* First raise ALRM as needed (timers have priority :-) */
-		if( FD_ISSET(sigalrmfd, &readfds) ) {
-			struct signalfd_siginfo sfdinfo;
-
-			while(1) {
-				int rc = read(sigalrmfd, &sfdinfo, sizeof(sfdinfo));
-				if(rc==-1) {
-					assert(errno==EAGAIN || errno==EWOULDBLOCK);
-					break;
-				}
-				assert(rc==sizeof(sfdinfo));
+		for(int e=0; e<nevents; e++) {
+			int fd = events[e].data.fd;
 
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
+			if(fd == sigusr1fd) {
+				/* Discard any USR1 signals to PIC (their purpose was to unblock PIC 
+				   from epoll_wait) */
+				pic_drain_sigusr1(sigusr1fd);
 			}
-		}
-
-		/* Discard any USR1 signals to PIC (their purpose was to unblock PIC 
-		   from select) */
-		if( FD_ISSET(sigusr1fd, &readfds) ) {
-			pic_drain_sigusr1(sigusr1fd);
-		}
-
-		/* Handle the devices */
-		for(uint i=0; i<nterm; i++) {
-
-			terminal* term = & TERM[i];
-			if( FD_ISSET(term->con.fd, &writefds) 
-				|| (system_clock-term->con.last_int)>SERIAL_TIMEOUT
-				) 
-			{
-				term->con.ready = 1;
-				term->con.last_int = system_clock;
-				Core* core = (Core*) term->con.int_core;
-				raise_interrupt(core, SERIAL_TX_READY);
+			else if(fd == clockfd) {
+				/* update system clock */
+				uint64_t ticks;
+				while(read(clockfd, &ticks, sizeof(ticks))==-1 && errno==EINTR);
+				system_clock = get_coarse_time();
+				pic_check_timeouts();
 			}
-
-
-			if( FD_ISSET(term->kbd.fd, &readfds) 
-				|| (system_clock-term->kbd.last_int)>SERIAL_TIMEOUT
-				) 
-			{
-				term->kbd.ready = 1;
-				term->kbd.last_int = system_clock;
-				Core* core = (Core*) term->kbd.int_core;
-				raise_interrupt(core, SERIAL_RX_READY);
+			else {
+				/* Handle the devices */
+				pic_terminal_event(fd, events[e].events);
 			}
 		}
 	}
@@ -613,8 +815,8 @@ static void PIC_daemon(uint serialno)
 
 	/* Close signal fds */
 	pic_drain_sigusr1(sigusr1fd);
-	CHECK(close(sigalrmfd));
 	CHECK(close(sigusr1fd));
+	CHECK(close(clockfd));
 
 	/* Restore sigmask */
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
@@ -623,6 +825,12 @@ static void PIC_daemon(uint serialno)
 	for(uint i=0; i<nterm; i++)
 		close_terminal(& TERM[i]);
 	nterm = 0;
+	if(console_on)
+		close_terminal(& TERM[SERIAL_CONSOLE]);
+	console_on = 0;
+
+	CHECK(close(PIC_epollfd));
+	PIC_epollfd = -1;
 
 	/* Reset name */
 	CHECKRC(pthread_setname_np(pthread_self(), oldname));
@@ -631,6 +839,106 @@ static void PIC_daemon(uint serialno)
 
 
 
+/*****************************************
+	Host placement
+
+	When host_config.pin_cores is set, the PIC thread is pinned to the
+	housekeeping CPU and each core thread to a different CPU, out of 
+	the CPUs available to the process. If there are not enough CPUs,
+	cores share them.
+
+	SCHED_FIFO is only used when every core thread has a CPU of its
+	own. Else, a core spinning on a lock could starve the lock holder.
+ *****************************************/
+
+typedef struct host_placement {
+	int pinned;					/* threads are pinned */
+	int realtime;				/* threads use SCHED_FIFO */
+	cpu_set_t cpus;				/* the CPUs available */
+	int pic_cpu;				/* the housekeeping CPU */
+	cpu_set_t saved_pic_cpus;	/* saved affinity of the PIC thread */
+	int saved_policy;			/* saved scheduling of the PIC thread */
+	struct sched_param saved_param;
+} host_placement;
+
+
+/* Return the n-th available CPU, skipping the housekeeping CPU if possible */
+static int host_placement_cpu(host_placement* p, uint n)
+{
+	int others = CPU_COUNT(&p->cpus) - 1;
+	if(others == 0) return p->pic_cpu;
+
+	n %= others;
+	for(int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+		if(cpu == p->pic_cpu || !CPU_ISSET(cpu, &p->cpus)) continue;
+		if(n-- == 0) return cpu;
+	}
+	assert(0);
+	return -1;
+}
+
+static void host_placement_init(host_placement* p, uint cores)
+{
+	p->pinned = host_config.pin_cores;
+	CHECK(sched_getaffinity(0, sizeof(cpu_set_t), &p->saved_pic_cpus));
+	p->cpus = p->saved_pic_cpus;
+
+	p->pic_cpu = host_config.housekeeping_cpu;
+	if(p->pic_cpu < 0 || p->pic_cpu >= CPU_SETSIZE || !CPU_ISSET(p->pic_cpu, &p->cpus)) {
+		for(p->pic_cpu = 0; !CPU_ISSET(p->pic_cpu, &p->cpus); p->pic_cpu++);
+	}
+
+	p->realtime = host_config.realtime && p->pinned && CPU_COUNT(&p->cpus) > cores;
+	if(host_config.realtime && !p->realtime)
+		fprintf(stderr, "vm_boot: not enough pinned host CPUs for SCHED_FIFO, ignoring it\n");
+}
+
+static void host_placement_apply_pic(host_placement* p)
+{
+	if(p->pinned) {
+		cpu_set_t hk;
+		CPU_ZERO(&hk);
+		CPU_SET(p->pic_cpu, &hk);
+		CHECKRC(pthread_setaffinity_np(pthread_self(), sizeof(hk), &hk));
+	}
+	if(p->realtime) {
+		CHECKRC(pthread_getschedparam(pthread_self(), &p->saved_policy, &p->saved_param));
+		/* The PIC runs above the cores, so that it is never delayed by them */
+		struct sched_param param = { .sched_priority = sched_get_priority_min(SCHED_FIFO)+1 };
+		int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if(rc) {
+			fprintf(stderr, "vm_boot: cannot use SCHED_FIFO: %s\n", strerror(rc));
+			p->realtime = 0;
+		}
+	}
+}
+
+static void host_placement_core_attr(host_placement* p, uint core, pthread_attr_t* attr)
+{
+	if(p->pinned) {
+		cpu_set_t cpu;
+		CPU_ZERO(&cpu);
+		CPU_SET(host_placement_cpu(p, core), &cpu);
+		CHECKRC(pthread_attr_setaffinity_np(attr, sizeof(cpu), &cpu));
+	}
+	if(p->realtime) {
+		struct sched_param param = { .sched_priority = sched_get_priority_min(SCHED_FIFO) };
+		CHECKRC(pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED));
+		CHECKRC(pthread_attr_setschedpolicy(attr, SCHED_FIFO));
+		CHECKRC(pthread_attr_setschedparam(attr, &param));
+	}
+}
+
+static void host_placement_restore_pic(host_placement* p)
+{
+	if(p->realtime)
+		CHECKRC(pthread_setschedparam(pthread_self(), p->saved_policy, &p->saved_param));
+	if(p->pinned)
+		CHECKRC(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &p->saved_pic_cpus));
+}
+
+
+
 /*****************************************
 	Public API
  *****************************************/
@@ -649,14 +957,16 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	/* This is called only once in the life of the process. */
 	CHECKRC(pthread_once(&init_control, initialize));
 
-	/* Install signal handler for SIGUSR1 */
-	CHECK(sigaction(SIGUSR1, &USR1_sigaction, &USR1_saved_sigaction));
+	/* Install signal handlers for SIGUSR1 and SIGALRM */
+	CHECK(sigaction(SIGUSR1, &core_sigaction, &USR1_saved_sigaction));
+	CHECK(sigaction(SIGALRM, &core_sigaction, &ALRM_saved_sigaction));
 
 	/* Set pic_active to 1 */
 	PIC_thread = pthread_self();
 	PIC_active = 1;	
 
-	/* Initialize system_clock */
+	/* Initialize the clocks */
+	boot_clock = get_monotonic_time();
 	system_clock = get_coarse_time();
 
 	/* Initialize the barriers */
@@ -666,29 +976,30 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	/* Initialize the halted list */
 	rlnode_init(&halted_list, NULL);
 
+	/* Map the PIC and the cores onto the host */
+	host_placement place;
+	host_placement_init(&place, cores);
+	host_placement_apply_pic(&place);
+
 	/* Launch the core threads */
 	ncores = cores;
+	core_bootfunc = bootfunc;
+	pthread_t core_thread[MAX_CORES];
 	for(uint c=0; c < cores; c++) {
-		/* Initialize Core */
-		CORE[c].bootfunc = bootfunc;
-		CORE[c].id = c;
-
-		pthread_cond_init(& CORE[c].halt_cond, NULL);
-		CORE[c].halted = 0;
-		rlnode_init(& CORE[c].halted_node, &CORE[c]);
-
-		/* Initialize Core statistics */
-		CORE[c].irq_count = 0;
-		for(uint intno=0; intno<maximum_interrupt_no;intno++) {
-			CORE[c].irq_delivered[intno] = 0;
-			CORE[c].irq_raised[intno] = 0;
-		}
+		/* Map the Core, it will be initialized by its thread */
+		CORE[c] = mmap(NULL, CORE_MAP_SIZE, PROT_READ|PROT_WRITE, 
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		CHECK((CORE[c]==MAP_FAILED) ? -1 : 0);
 
 		/* Create the core thread */
-		CHECKRC(pthread_create(& CORE[c].thread, NULL, bootfunc_wrapper, &CORE[c]));
+		pthread_attr_t attr;
+		CHECKRC(pthread_attr_init(&attr));
+		host_placement_core_attr(&place, c, &attr);
+		CHECKRC(pthread_create(& core_thread[c], &attr, bootfunc_wrapper, (void*)(uintptr_t)c));
+		CHECKRC(pthread_attr_destroy(&attr));
 		char thread_name[16];
 		CHECK(snprintf(thread_name,16,"core-%d",c));
-		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
+		CHECKRC(pthread_setname_np(core_thread[c], thread_name));
 	}
 
 	/* Initialize PIC statistics */
@@ -699,15 +1010,19 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 
 	/* Wait for threads to finish */
 	for(uint c=0; c<cores; c++) {
-		CHECKRC(pthread_join(CORE[c].thread, NULL));
+		CHECKRC(pthread_join(core_thread[c], NULL));
 	}
 
+	/* Restore the PIC thread */
+	host_placement_restore_pic(&place);
+
 	/* Destroy the core barrier */
 	pthread_barrier_destroy(& system_barrier);
 	pthread_barrier_destroy(& core_barrier);
 
 	/* Restore signal mask before VM execution */
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
+	CHECK(sigaction(SIGALRM, &ALRM_saved_sigaction, NULL));
 
 	/* Delete the Core table */
 	ncores = 0;
@@ -718,12 +1033,28 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 		PIC_loops, PIC_usr1_queued, PIC_usr1_drained);
 	for(uint c=0;c<cores;c++) {
 		fprintf(stderr,"Core %3d: irq_count=%6d. deliv(raised):\t",
-			c, CORE[c].irq_count);
+			c, CORE[c]->irq_count);
 		for(uint i=0;i<maximum_interrupt_no;i++) 
-			fprintf(stderr," %d(%d)",CORE[c].irq_delivered[i], CORE[c].irq_raised[i]);
+			fprintf(stderr," %d(%d)",CORE[c]->irq_delivered[i], CORE[c]->irq_raised[i]);
 		fprintf(stderr,"\n");
 	}
 #endif
+
+	/* Unmap the Cores */
+	for(uint c=0; c<cores; c++) {
+		CHECK(munmap(CORE[c], CORE_MAP_SIZE));
+		CORE[c] = NULL;
+	}
+}
+
+
+void vm_configure(const vm_config* config)
+{
+	CHECK_CONDITION(ncores==0);
+	if(config == NULL) 
+		host_config = (vm_config){ .pin_cores = 0, .housekeeping_cpu = -1, .realtime = 0 };
+	else
+		host_config = *config;
 }
 
 
@@ -734,18 +1065,30 @@ uint cpu_cores()
 
 void cpu_core_halt()
 {
-	/* unmask signals and call sigsuspend */
+	/* mask the interrupt signals and wait for one of them */
 	Core* core = curr_core();
 	assert(! core->int_disabled);
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_interrupt_set, NULL));
 	pthread_mutex_lock(& core_halt_mutex);
 	core->halted = 1;
 	rlist_push_front(&halted_list, & core->halted_node);
-	while(core->halted)
-		pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
-	assert(! core->halted);
 	pthread_mutex_unlock(& core_halt_mutex);
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+
+	siginfo_t si;
+	int signo;
+	while((signo = sigwaitinfo(&core_interrupt_set, &si))==-1) 
+		assert(errno==EINTR);
+	core->irq_count++;
+	if(signo==SIGALRM) core_timer_expired(core);
+
+	/* We may have been woken by an interrupt, rather than a restart */
+	pthread_mutex_lock(& core_halt_mutex);
+	if(core->halted) {
+		core->halted = 0;
+		rlist_remove(& core->halted_node);
+	}
+	pthread_mutex_unlock(& core_halt_mutex);
+	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &core_interrupt_set, NULL));
 	dispatch_interrupts(core);
 }
 
@@ -754,14 +1097,14 @@ static inline void core_restart(Core* core)
 	if(core->halted) {
 		core->halted = 0;
 		rlist_remove(& core->halted_node);
-		pthread_cond_signal(& core->halt_cond);
+		CHECKRC(pthread_kill(core->thread, SIGUSR1));
 	}	
 }
 
 void cpu_core_restart(uint c)
 {
 	pthread_mutex_lock(& core_halt_mutex);
-	core_restart(CORE+c);
+	core_restart(CORE[c]);
 	pthread_mutex_unlock(& core_halt_mutex);	
 }
 
@@ -778,7 +1121,7 @@ void cpu_core_restart_all()
 {
 	pthread_mutex_lock(& core_halt_mutex);
 	for(uint c=0; c<ncores; c++)
-		core_restart(CORE+c);
+		core_restart(CORE[c]);
 	pthread_mutex_unlock(& core_halt_mutex);	
 }
 
@@ -790,7 +1133,7 @@ void cpu_core_barrier_sync()
 void cpu_ici(uint core)
 {
 	assert(core < ncores);
-	raise_interrupt(& CORE[core], ICI);
+	raise_interrupt(CORE[core], ICI);
 }
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
@@ -803,7 +1146,7 @@ void cpu_disable_interrupts()
 {
 	Core* core = curr_core();
 	if(! core->int_disabled) {
-		CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+		CHECKRC(pthread_sigmask(SIG_BLOCK, &core_interrupt_set, NULL));
 		core->int_disabled = 1;
 	}
 }
@@ -813,7 +1156,7 @@ void cpu_enable_interrupts()
 	Core* core = curr_core();
 	if(core->int_disabled) {        
 		core->int_disabled = 0;
-		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));      
+		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &core_interrupt_set, NULL));      
 		dispatch_interrupts(curr_core());
 	}
 }
@@ -872,9 +1215,13 @@ TimerDuration bios_cancel_timer()
 }
 
 
+/*
+	Read directly from the host's CLOCK_MONOTONIC (via the vDSO), so 
+	this needs no locking and works on any core.
+ */
 TimerDuration bios_clock()
 {
-	return system_clock * 1000ul;
+	return get_monotonic_time() - boot_clock;
 }	
 
 
@@ -885,17 +1232,55 @@ uint bios_serial_ports()
 }
 
 
+/*
+	Return 1 if the console is connected.
+ */
+int bios_serial_console()
+{
+	return console_on;
+}
+
+
+/*
+	Return 1 if the last read from serial port 'serial' found the end of its input.
+ */
+int bios_serial_eof(uint serial)
+{
+	assert(serial_port_on(serial));
+	return TERM[serial].kbd.eof;
+}
+
+
+/*
+	Return 1 if a read from serial port 'serial' would return data or 
+	the end of input. Nothing is consumed.
+ */
+int bios_serial_rx_ready(uint serial)
+{
+	assert(serial_port_on(serial));
+	io_device* kbd = & TERM[serial].kbd;
+	if(! kbd->pollable) return 1;
+
+	struct pollfd pfd = { .fd = kbd->fd, .events = POLLIN };
+	CHECK(poll(&pfd, 1, 0));
+
+	/* Only the console reports the end of input */
+	if(serial == SERIAL_CONSOLE && (pfd.revents & POLLHUP)) return 1;
+	return (pfd.revents & POLLIN) ? 1 : 0;
+}
+
+
 /*
 	Make interrupts of type 'intno' for serial port port 'serial' be sent
 	to 'core'.  By default, initially all interrupts are sent to core 0.
  */
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 {
-	assert(serial < nterm);
+	assert(serial_port_on(serial));
 	assert(intno==SERIAL_RX_READY || intno==SERIAL_TX_READY);
 	assert(coreid < ncores);
 
-	Core* core = & CORE[coreid];
+	Core* core = CORE[coreid];
 
 	if(intno==SERIAL_RX_READY)
 		TERM[serial].kbd.int_core = core;
@@ -904,13 +1289,24 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 }
 
 
+/*
+	Return and clear the bitmap of serial ports that raised 'intno'
+	to the current core.
+ */
+uint bios_serial_pending(Interrupt intno)
+{
+	assert(intno==SERIAL_RX_READY || intno==SERIAL_TX_READY);
+	return __atomic_exchange_n(& curr_core()->serial_pending[intno], 0, __ATOMIC_ACQUIRE);
+}
+
+
 /*
 	Try to read a byte from serial port 'serial' and store it into the location
 	pointed by 'ptr'.  If the operation succeds, 1 is returned. If not, 0 is returned.
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return io_device_read(& TERM[serial].kbd, ptr, 1);
 }
 
 
@@ -920,7 +1316,25 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
-	return io_device_write(& TERM[serial].con, value);
+	return io_device_write(& TERM[serial].con, &value, 1);
 }
 
 
+/*
+	Try to read up to 'n' bytes from serial port 'serial' into 'buf'.
+	Return the number of bytes read.
+ */
+size_t bios_read_serial_n(uint serial, char* buf, size_t n)
+{
+	return io_device_read(& TERM[serial].kbd, buf, n);
+}
+
+
+/*
+	Try to write up to 'n' bytes from 'buf' to serial port 'serial'.
+	Return the number of bytes written.
+ */
+size_t bios_write_serial_n(uint serial, const char* buf, size_t n)
+{
+	return io_device_write(& TERM[serial].con, buf, n);
+}
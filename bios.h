@@ -61,12 +61,16 @@
 	it with some time interval. When the timer expires, the ALARM interrupt is raised 
 	for the core.
 
+	There is also a monotonic clock, with microsecond resolution, which can be read 
+	by any core via @c bios_clock().
+
 	Serial ports
 	------------- 
 
 	The virtual machine has a number of serial ports connected to terminals.
 
-	Each serial port/terminal can support reading and writing of single bytes.
+	Each serial port/terminal can support reading and writing of single bytes,
+	or of blocks of bytes.
 	The reads return keyboard input, whereas the writes send characters to display
 	on the screen.
 
@@ -98,6 +102,17 @@
 	Also, each interrupt is sent if the serial device timeouts (is inactive for
 	about 300 msec).
 
+	Besides the terminals, there is a serial port numbered @c SERIAL_CONSOLE,
+	the console, which is connected to the standard input and output of the
+	host process, if they are open. The console works like the other serial 
+	ports, except that its input may end (e.g., when the standard input is a
+	file); then, @c bios_serial_eof() returns 1.
+
+	Each core keeps, for each of the two serial interrupts, a bitmap of the
+	serial ports that raised it. An interrupt handler can retrieve (and clear)
+	this bitmap by calling @c bios_serial_pending(), so that it only needs to
+	service the ports that actually became ready.
+
  */
 
 
@@ -132,6 +147,16 @@ typedef enum Interrupt
 /** @brief Maximum number of terminals for a virtual machine. */
 #define MAX_TERMINALS 4
 
+/** @brief The serial port of the console. */
+#define SERIAL_CONSOLE MAX_TERMINALS
+
+/** 
+	@brief The size of a cache line, in bytes. 
+
+	Per-core data is aligned to this, so that cores do not share cache lines.
+ */
+#define CACHE_LINE_SIZE 64
+
 /**
 	@brief Boot a CPU with the given number of cores and boot function.
 
@@ -159,6 +184,41 @@ typedef enum Interrupt
 void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno);
 
 
+/**
+	@brief Options for mapping the virtual machine onto the host.
+
+	@see vm_configure
+ */
+typedef struct vm_config {
+	int pin_cores;			/**< If nonzero, pin each core thread to a distinct host CPU,
+								and the interrupt controller to the housekeeping CPU. */
+	int housekeeping_cpu;	/**< The host CPU for the interrupt controller, or -1 to
+								use the first host CPU available to the process. */
+	int realtime;			/**< If nonzero, run the core threads under SCHED_FIFO. 
+								This is only done when @c pin_cores is set and every
+								core gets a host CPU of its own, and if the process is 
+								allowed to. */
+} vm_config;
+
+
+/**
+	@brief Configure how subsequent calls to @c vm_boot() map the machine onto the host.
+
+	By default, threads are not pinned and use the default host scheduling;
+	the host may then migrate them between host CPUs at will. Pinning 
+	removes much of the run-to-run variance of timing measurements, when
+	the host has enough CPUs.
+
+	Regardless of the configuration, the data of each core is allocated
+	by the core's own thread, so that it is local to the core's NUMA node.
+
+	This must not be called while the machine is running.
+
+	@param config the new configuration, or NULL to restore the default.
+ */
+void vm_configure(const vm_config* config);
+
+
 /**
 	@brief Contains the id of the current core.
  */
@@ -299,10 +359,11 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx);
 /** 
 	@brief Reset the core timer to the specified interval.
 
-	The interval for the timer is given in microseconds, but the 
-	accuracy of the alarm is much coarser, to the order of 10 msec
-	(that is, 10,000 microseconds). After the interval expires, the
-	core receives an ALARM interrupt.
+	The interval for the timer is given in microseconds. The timer
+	runs on the same monotonic clock as @c bios_clock(), but the ALARM
+	interrupt is delivered with some latency, which depends on the load 
+	of the host.  After the interval expires, the core receives an 
+	ALARM interrupt.
 
 	This function can be called even if the timer is already activated;
 	in this case, the previous timer countdown is canceled and the timer resets
@@ -330,13 +391,13 @@ TimerDuration bios_cancel_timer();
 /**
 	@brief Get the current time from the hardware clock.
 
-	This function returns a real-time clock value, in usec.
-	The value of the clock is 10 times the number of seconds since
-	the epoch. 
+	This function returns the value of a monotonic clock, in usec.
+	The value of the clock is the time elapsed since the VM booted.
+	The clock is not affected by changes to the real-time clock of
+	the host.
 
-	The resolution of the clock is very low, currently 
-	around 100 msec. Therefore, it is inappropriate for any type of
-	precise timing.
+	The resolution of the clock is 1 usec. It can be read from any core
+	without any locking.
  */
 TimerDuration bios_clock();
 
@@ -351,6 +412,32 @@ TimerDuration bios_clock();
  */
 uint bios_serial_ports();
 
+/**
+	@brief Check if the console is connected.
+
+	@returns 1 if serial port @c SERIAL_CONSOLE can be used, else 0.
+ */
+int bios_serial_console();
+
+/**
+	@brief Check for the end of input of a serial port.
+
+	@param serial the serial port
+	@returns 1 if the last read from @c serial found the end of its input, else 0.
+		Reads may return data again later (e.g., on a host terminal, after an
+		end-of-file character).
+ */
+int bios_serial_eof(uint serial);
+
+/**
+	@brief Check if a read from a serial port would succeed, without reading.
+
+	@param serial the serial port
+	@returns 1 if a read from @c serial would return data, or find the end 
+		of its input, else 0.
+ */
+int bios_serial_rx_ready(uint serial);
+
 /**
 	@brief Assign a core to interrupts from a specific serial device.
 
@@ -359,7 +446,7 @@ uint bios_serial_ports();
 
 	@param serial the serial device whose interrupt is assigned, it must be
 	         greater of equal to 
-	         @c 0 and less than @c bios_serial_ports().
+	         @c 0 and less than @c bios_serial_ports(), or @c SERIAL_CONSOLE.
 	@param intno the interrupt to assign (one of @c SERIAL_RX_READY and 
 			@c SERIAL_TX_READY)
 	@param core th 
@@ -367,6 +454,25 @@ uint bios_serial_ports();
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 
 
+/**
+	@brief Get the serial ports that raised an interrupt on this core.
+
+	Return a bitmap of the serial ports which raised interrupt @c intno
+	to the current core since the last call. Bit @f$ i @f$ is set if serial
+	port @f$ i @f$ raised the interrupt. The bitmap of the core is cleared
+	by this call.
+
+	This call is meant to be made from inside the interrupt handler of
+	@c intno. Note that an interrupt may be delivered with an empty bitmap, 
+	if the ports were already retrieved by a previous call.
+
+	@param intno the interrupt (one of @c SERIAL_RX_READY and 
+			@c SERIAL_TX_READY)
+	@returns a bitmap of serial ports
+ */
+uint bios_serial_pending(Interrupt intno);
+
+
 /**
 	@brief Read a byte from a serial port.
 
@@ -401,4 +507,42 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Read a block of bytes from a serial port.
+
+	Try to read up to @c n bytes from serial port @c serial into the buffer
+	@c buf. The number of bytes actually read is returned; this is 0 if 
+	the operation does not succeed, just like a failed @c bios_read_serial.
+
+	If fewer than @c n bytes are read, a @c SERIAL_RX_READY interrupt will
+	be raised when more data is ready to be received.
+
+	@param serial the serial device to read from
+	@param buf the buffer in which to store the read bytes
+	@param n the maximum number of bytes to read
+	@return the number of bytes read
+	@see bios_read_serial
+ */
+size_t bios_read_serial_n(uint serial, char* buf, size_t n);
+
+
+/**
+	@brief Write a block of bytes to a serial port.
+
+	Try to write up to @c n bytes from buffer @c buf to serial port @c serial.
+	The number of bytes actually written is returned; this is 0 if the 
+	operation does not succeed, just like a failed @c bios_write_serial.
+
+	If fewer than @c n bytes are written, a @c SERIAL_TX_READY interrupt will
+	be raised when the device is ready to accept more data.
+
+	@param serial the serial device to write to
+	@param buf the bytes to send to the serial device
+	@param n the number of bytes in @c buf
+	@return the number of bytes written
+	@see bios_write_serial
+ */
+size_t bios_write_serial_n(uint serial, const char* buf, size_t n);
+
+
 #endif
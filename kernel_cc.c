@@ -109,7 +109,7 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @param mx The mutex to be unlocked as the thread sleeps.
   @param cv The condition variable to sleep on.
   @param cause A cause provided to the kernel scheduler.
-  @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
+  @param deadline The time to wake up, or @c NO_TIMEOUT to sleep for ever.
 
   @returns 1 if this thread was woken up by signal/broadcast, 0 otherwise
 
@@ -117,7 +117,7 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @see Cond_Broadcast
   */
 static int cv_wait(Mutex* mutex, CondVar* cv, 
-		enum SCHED_CAUSE cause, TimerDuration timeout)
+		enum SCHED_CAUSE cause, TimerDuration deadline)
 {
 	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0 };
 	rlnode_init(& waiter.node, &waiter);
@@ -133,7 +133,7 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 
 	/* Now atomically release mutex and sleep */
 	Mutex_Unlock(mutex);
-	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
+	sleep_releasing_until(STOPPED, &(cv->waitset_lock), cause, deadline);
 
 	/* Woke up, we must check wether we were signaled, and tidy up */
 	Mutex_Lock(&(cv->waitset_lock));
@@ -180,7 +180,7 @@ int Cond_Wait(Mutex* mutex, CondVar* cv)
 int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 {
 	/* We have to translate timeout from msec to usec */
-	return cv_wait(mutex, cv, SCHED_USER, timeout*1000ul);
+	return cv_wait(mutex, cv, SCHED_USER, timeout_deadline(timeout*1000ul));
 }
 
 
@@ -270,14 +270,14 @@ void kernel_unlock()
 }
 
 int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
-	const char* wchan_name, TimerDuration timeout)
+	const char* wchan_name, TimerDuration deadline)
 {
 	/* Atomically release kernel semaphore */
 	Mutex_Lock(& kernel_mutex);
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);	
 
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
+	int ret = cv_wait(&kernel_mutex, cv, cause, deadline);
 
 	/* Reacquire kernel semaphore */
 	while(kernel_sem<=0)
@@ -49,15 +49,21 @@ void kernel_unlock();
 
 /**
 	@brief Wait on a condition variable using the kernel lock.
+
+	The wait ends at the latest at @c deadline, which is a time
+	returned by @c bios_clock(), or @c NO_TIMEOUT.
 	@returns 1 if signalled, 0 if not
+	@see timeout_deadline
   */
 int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
-	const char* wchan, TimerDuration timeout);
+	const char* wchan, TimerDuration deadline);
 
 #define kernel_wait(cv, cause) \
 	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
 #define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+	kernel_wait_wchan((cv),(cause),__FUNCTION__, timeout_deadline(timeout))
+#define kernel_wait_until(cv, cause, deadline) \
+	kernel_wait_wchan((cv),(cause),__FUNCTION__, (deadline))
 
 /**
 	@brief Signal a kernel condition to one waiter.
@@ -0,0 +1,357 @@
+
+#include <assert.h>
+#include <string.h>
+
+#include "tinyos.h"
+#include "kernel_channel.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+
+
+/*
+  The slab allocator.
+
+  Class c holds buffers of MSG_MIN_BUFFER << c bytes, header included.
+  Buffers are carved out of chunks of at least SLAB_CHUNK bytes, and are
+  never returned to malloc until the kernel shuts down. All of this is
+  protected by the kernel lock.
+ */
+
+#define MSG_MIN_BUFFER 64
+#define SLAB_CHUNK (64*1024)
+
+/* The smallest class with room for MAX_MSG_SIZE plus a header */
+#define MSG_CLASSES 12
+
+typedef struct slab_chunk {
+  struct slab_chunk* next;
+  char pad[8];              /* Keep the buffers 16-byte aligned */
+} slab_chunk;
+
+static msg_header* slab_free[MSG_CLASSES];
+static slab_chunk* slab_chunks;
+
+
+static void slab_grow(unsigned int cls)
+{
+  size_t bsize = (size_t)MSG_MIN_BUFFER << cls;
+  size_t nbufs = (bsize >= SLAB_CHUNK) ? 1 : SLAB_CHUNK / bsize;
+
+  slab_chunk* chunk = xmalloc(sizeof(slab_chunk) + nbufs*bsize);
+  chunk->next = slab_chunks;
+  slab_chunks = chunk;
+
+  char* buf = (char*)(chunk+1);
+  for(size_t i=0; i<nbufs; i++, buf += bsize) {
+    msg_header* m = (msg_header*) buf;
+    m->cls = cls;
+    m->next = slab_free[cls];
+    slab_free[cls] = m;
+  }
+}
+
+static msg_header* msg_alloc(unsigned int size)
+{
+  if(size > MAX_MSG_SIZE) return NULL;
+
+  unsigned int cls = 0;
+  while(((size_t)MSG_MIN_BUFFER << cls) < size + sizeof(msg_header)) cls++;
+  assert(cls < MSG_CLASSES);
+
+  if(slab_free[cls] == NULL)
+    slab_grow(cls);
+
+  msg_header* m = slab_free[cls];
+  slab_free[cls] = m->next;
+  m->size = size;
+  m->magic = MSG_MAGIC;
+  return m;
+}
+
+static void msg_free(msg_header* m)
+{
+  m->magic = 0;
+  m->next = slab_free[m->cls];
+  slab_free[m->cls] = m;
+}
+
+/* Messages are passed to user code as the address after the header */
+static inline void* msg_data(msg_header* m) { return m+1; }
+
+/* Return the header of a message owned by the process, or NULL */
+static inline msg_header* msg_of(const void* msg)
+{
+  msg_header* m = ((msg_header*) msg) - 1;
+  return (msg != NULL && m->magic == MSG_MAGIC) ? m : NULL;
+}
+
+/* The header of a message checked by SendBatch */
+static inline msg_header* msg_of_queued(void* msg)
+{
+  return ((msg_header*) msg) - 1;
+}
+
+void finalize_channels()
+{
+  while(slab_chunks) {
+    slab_chunk* chunk = slab_chunks;
+    slab_chunks = chunk->next;
+    free(chunk);
+  }
+  memset(slab_free, 0, sizeof(slab_free));
+}
+
+
+void* sys_MsgAlloc(unsigned int size)
+{
+  msg_header* m = msg_alloc(size);
+  return m ? msg_data(m) : NULL;
+}
+
+void sys_MsgFree(void* msg)
+{
+  msg_header* m = msg_of(msg);
+  if(m) msg_free(m);
+}
+
+/* This only reads the header, so it is not a system call */
+unsigned int MsgSize(const void* msg)
+{
+  msg_header* m = msg_of(msg);
+  return m ? m->size : 0;
+}
+
+
+/*
+  The channel ring.
+ */
+
+static void channel_push(ChannelCB* ch, msg_header* m)
+{
+  m->magic = MSG_QUEUED;
+  ch->ring[(ch->head + ch->count) % ch->capacity] = m;
+  ch->count++;
+}
+
+static msg_header* channel_pop(ChannelCB* ch)
+{
+  msg_header* m = ch->ring[ch->head];
+  ch->head = (ch->head + 1) % ch->capacity;
+  ch->count--;
+  m->magic = MSG_MAGIC;
+  return m;
+}
+
+/* Wait until a message can be sent. Return 0 if the reader has closed. */
+static int wait_for_space(ChannelCB* ch)
+{
+  while(ch->count == ch->capacity && ch->reader_open)
+    kernel_wait(& ch->has_space, SCHED_PIPE);
+  return ch->reader_open;
+}
+
+/* Wait until a message can be received. Return 0 at end of data. */
+static int wait_for_msgs(ChannelCB* ch)
+{
+  while(ch->count == 0 && ch->writer_open)
+    kernel_wait(& ch->has_msgs, SCHED_PIPE);
+  return ch->count > 0;
+}
+
+static void channel_destroy(ChannelCB* ch)
+{
+  while(ch->count > 0)
+    msg_free(channel_pop(ch));
+  free(ch->ring);
+  free(ch);
+}
+
+
+/*
+  Stream operations of the two ends.
+ */
+
+static int channel_read(void* this, char* buf, unsigned int size)
+{
+  ChannelCB* ch = this;
+
+  if(! wait_for_msgs(ch))
+    return 0;
+
+  msg_header* m = ch->ring[ch->head];
+  if(m->size > size)
+    return -1;
+
+  channel_pop(ch);
+  memcpy(buf, msg_data(m), m->size);
+  int ret = m->size;
+  msg_free(m);
+
+  kernel_broadcast(& ch->has_space);
+  stream_notify();
+  return ret;
+}
+
+static int channel_write(void* this, const char* buf, unsigned int size)
+{
+  ChannelCB* ch = this;
+
+  if(size > MAX_MSG_SIZE || ! wait_for_space(ch))
+    return -1;
+
+  msg_header* m = msg_alloc(size);
+  memcpy(msg_data(m), buf, size);
+  channel_push(ch, m);
+
+  kernel_broadcast(& ch->has_msgs);
+  stream_notify();
+  return size;
+}
+
+static int channel_reader_close(void* this)
+{
+  ChannelCB* ch = this;
+  ch->reader_open = 0;
+  if(ch->writer_open) {
+    kernel_broadcast(& ch->has_space);
+    stream_notify();
+  }
+  else
+    channel_destroy(ch);
+  return 0;
+}
+
+static int channel_writer_close(void* this)
+{
+  ChannelCB* ch = this;
+  ch->writer_open = 0;
+  if(ch->reader_open) {
+    kernel_broadcast(& ch->has_msgs);
+    stream_notify();
+  }
+  else
+    channel_destroy(ch);
+  return 0;
+}
+
+static int channel_poll(void* this, int events)
+{
+  ChannelCB* ch = this;
+  int revents = 0;
+
+  if(ch->count > 0 || !ch->writer_open)
+    revents |= POLL_READ;
+  if(ch->count < ch->capacity || !ch->reader_open)
+    revents |= POLL_WRITE;
+
+  return revents & events;
+}
+
+static file_ops channel_reader_ops = {
+  .Open = NULL,
+  .Read = channel_read,
+  .Write = NULL,
+  .Close = channel_reader_close,
+  .Poll = channel_poll
+};
+
+static file_ops channel_writer_ops = {
+  .Open = NULL,
+  .Read = NULL,
+  .Write = channel_write,
+  .Close = channel_writer_close,
+  .Poll = channel_poll
+};
+
+
+int sys_Channel(pipe_t* ends, unsigned int capacity)
+{
+  FCB* files[2];
+
+  if(capacity == 0 || ends == NULL)
+    return -1;
+
+  if(!FCB_reserve(2, (Fid_t*)ends, files))
+    return -1;
+
+  ChannelCB* ch = xmalloc(sizeof(ChannelCB));
+  ch->ring = xmalloc(capacity * sizeof(msg_header*));
+  ch->capacity = capacity;
+  ch->head = 0;
+  ch->count = 0;
+  ch->reader_open = 1;
+  ch->writer_open = 1;
+  ch->has_msgs = COND_INIT;
+  ch->has_space = COND_INIT;
+
+  files[0]->streamobj = ch;
+  files[0]->streamfunc = &channel_reader_ops;
+
+  files[1]->streamobj = ch;
+  files[1]->streamfunc = &channel_writer_ops;
+
+  return 0;
+}
+
+
+int sys_SendBatch(Fid_t fid, void** msgs, unsigned int n)
+{
+  FCB* fcb = get_fcb(fid);
+  if(fcb == NULL || fcb->streamfunc != &channel_writer_ops || msgs == NULL)
+    return -1;
+
+  /* Check the messages first, so that a bad one sends nothing. Each one
+     is marked queued as it is checked, so that a repeated one fails. */
+  for(unsigned int i=0; i<n; i++) {
+    msg_header* m = msg_of(msgs[i]);
+    if(m == NULL) {
+      while(i-- > 0) msg_of_queued(msgs[i])->magic = MSG_MAGIC;
+      return -1;
+    }
+    m->magic = MSG_QUEUED;
+  }
+
+  if(n == 0) return 0;
+
+  ChannelCB* ch = fcb->streamobj;
+  FCB_incref(fcb);
+
+  int sent = -1;
+  if(wait_for_space(ch)) {
+    for(sent = 0; sent < n && ch->count < ch->capacity; sent++)
+      channel_push(ch, msg_of_queued(msgs[sent]));
+    kernel_broadcast(& ch->has_msgs);
+    stream_notify();
+  }
+
+  /* The caller keeps the messages that were not sent */
+  for(unsigned int i = (sent < 0) ? 0 : sent; i < n; i++)
+    msg_of_queued(msgs[i])->magic = MSG_MAGIC;
+
+  FCB_decref(fcb);
+  return sent;
+}
+
+
+int sys_RecvBatch(Fid_t fid, void** msgs, unsigned int n)
+{
+  FCB* fcb = get_fcb(fid);
+  if(fcb == NULL || fcb->streamfunc != &channel_reader_ops || msgs == NULL)
+    return -1;
+
+  if(n == 0) return 0;
+
+  ChannelCB* ch = fcb->streamobj;
+  FCB_incref(fcb);
+
+  int received = 0;
+  if(wait_for_msgs(ch)) {
+    for(; received < n && ch->count > 0; received++)
+      msgs[received] = msg_data(channel_pop(ch));
+    kernel_broadcast(& ch->has_space);
+    stream_notify();
+  }
+
+  FCB_decref(fcb);
+  return received;
+}
@@ -0,0 +1,67 @@
+#ifndef __KERNEL_CHANNEL_H
+#define __KERNEL_CHANNEL_H
+
+/**
+  @file kernel_channel.h
+  @brief TinyOS kernel: Message channels.
+
+  @defgroup channels Channels
+  @ingroup kernel
+  @brief Message channels.
+
+  A channel is a bounded ring of message pointers. Messages live in
+  buffers of a slab allocator with power-of-2 size classes. Each buffer
+  has a small header before the message, which records the size and
+  class of the message. Sending and receiving move buffers in and out
+  of the ring, so messages sent by @c SendBatch and received by
+  @c RecvBatch are never copied.
+
+  @{
+*/
+
+#include "tinyos.h"
+#include "kernel_sched.h"
+
+
+/** @brief The header of a message buffer. */
+typedef struct msg_header
+{
+  unsigned int size;          /**< The size of the message */
+  unsigned short cls;         /**< The size class of the buffer */
+  unsigned short magic;       /**< @c MSG_MAGIC or @c MSG_QUEUED while allocated */
+  struct msg_header* next;    /**< Next free buffer of the class */
+} msg_header;
+
+/** @brief A mark of messages owned by a process, to catch bad pointers. */
+#define MSG_MAGIC 0x4d53
+
+/** @brief A mark of messages queued in a channel, which no process owns. */
+#define MSG_QUEUED 0x4d51
+
+
+/** @brief Channel control block. */
+typedef struct channel_control_block
+{
+  msg_header** ring;          /**< The queued messages */
+  unsigned int capacity;      /**< The size of @c ring */
+  unsigned int head;          /**< The index of the oldest message */
+  unsigned int count;         /**< The number of queued messages */
+
+  int reader_open;            /**< Set while the read end is open */
+  int writer_open;            /**< Set while the write end is open */
+
+  CondVar has_msgs;           /**< Signalled when messages are sent, or the writer closes */
+  CondVar has_space;          /**< Signalled when messages are received, or the reader closes */
+} ChannelCB;
+
+
+/**
+  @brief Release the slab memory of messages.
+
+  This is called after the VM has shut down.
+*/
+void finalize_channels();
+
+/** @} */
+
+#endif
@@ -66,13 +66,28 @@ static file_ops nulldev_fops = {
 void serial_rx_handler();
 void serial_tx_handler();
 
+/* Size of the transmit ring of each serial device */
+#define SERIAL_TX_BUFFER_SIZE 4096
+
+/* How long (msec) close waits for the device to accept more data */
+#define SERIAL_CLOSE_TIMEOUT 500
+
 typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  uint rx_core;         /* the core receiving SERIAL_RX_READY */
+  int rx_eof;           /* reads return 0 at the end of input (console only) */
+
+  /* The transmit ring, protected by spinlock */
+  char tx_buffer[SERIAL_TX_BUFFER_SIZE];
+  uint tx_head;         /* next byte to send to the device */
+  uint tx_count;        /* number of bytes in the ring */
+  CondVar tx_space;     /* signalled, with spinlock held, when the ring is drained */
 } serial_dcb_t;
 
-serial_dcb_t serial_dcb[MAX_TERMINALS];
+/* The last one is the console */
+serial_dcb_t serial_dcb[MAX_TERMINALS+1];
 
 
 
@@ -85,16 +100,35 @@ void serial_rx_handler()
   int pre = preempt_off;
 
   /* 
-    We do not know which terminal is
-    ready, so we must signal them all !
+    Signal only the terminals which became ready
    */
-  for(int i=0;i<bios_serial_ports();i++) {
-    serial_dcb_t* dcb = &serial_dcb[i];
-    Cond_Broadcast(&dcb->rx_ready);
+  uint ports = bios_serial_pending(SERIAL_RX_READY);
+  while(ports) {
+    int i = __builtin_ctz(ports);
+    ports &= ports-1;
+    Cond_Broadcast(&serial_dcb[i].rx_ready);
   }
+  stream_notify();
   if(pre) preempt_on;
 }
 
+/*
+  Route the SERIAL_RX_READY interrupts of the device to a core that
+  the current thread may run on, so that the reader is woken up locally.
+ */
+static void serial_rx_follow_reader(serial_dcb_t* dcb)
+{
+  TCB* reader = CURTHREAD;
+  if(core_allowed(reader, dcb->rx_core)) return;
+
+  for(uint c=0; c<cpu_cores(); c++) 
+    if(core_allowed(reader, c)) {
+      dcb->rx_core = c;
+      bios_serial_interrupt_core(dcb->devno, SERIAL_RX_READY, c);
+      return;
+    }
+}
+
 /*
   Read from the device, sleeping if needed.
  */
@@ -104,20 +138,13 @@ int serial_read(void* dev, char *buf, unsigned int size)
 
   preempt_off;            /* Stop preemption */
 
-  uint count =  0;
+  serial_rx_follow_reader(dcb);
 
-  while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
-    
-    if (valid) {
-      count++;
-    }
-    else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
-    }
-    else
-      break;
-  }
+  /* Each attempt transfers everything the device has, up to size */
+  uint count;
+  while((count = bios_read_serial_n(dcb->devno, buf, size))==0 && size>0
+        && !(dcb->rx_eof && bios_serial_eof(dcb->devno)))
+    kernel_wait(&dcb->rx_ready, SCHED_IO);
 
   preempt_on;           /* Restart preemption */
 
@@ -126,48 +153,160 @@ int serial_read(void* dev, char *buf, unsigned int size)
 
 
 /*
-  A polling driver for serial writes
-  */
+  Interrupt-driven driver for serial-device writes.
+
+  Writers copy their data into the transmit ring of the device and 
+  return. The ring is drained into the device by the writers themselves 
+  and by the SERIAL_TX_READY handler, whenever the device accepts data.
+ */
+
+/*
+  Send as much of the transmit ring as the device will accept.
+
+  *** MUST BE CALLED WITH dcb->spinlock HELD AND PREEMPTION OFF ***
+ */
+static void serial_tx_drain(serial_dcb_t* dcb)
+{
+  while(dcb->tx_count > 0) {
+    /* The contiguous part of the ring, starting at tx_head */
+    uint len = SERIAL_TX_BUFFER_SIZE - dcb->tx_head;
+    if(len > dcb->tx_count) len = dcb->tx_count;
+
+    uint sent = bios_write_serial_n(dcb->devno, &dcb->tx_buffer[dcb->tx_head], len);
+    dcb->tx_head = (dcb->tx_head + sent) % SERIAL_TX_BUFFER_SIZE;
+    dcb->tx_count -= sent;
+
+    if(sent < len) break;
+  }
+}
 
 /* Interrupt driver */
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  int pre = preempt_off;
+
+  uint ports = bios_serial_pending(SERIAL_TX_READY);
+  while(ports) {
+    int i = __builtin_ctz(ports);
+    ports &= ports-1;
+
+    serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(&dcb->spinlock);
+    serial_tx_drain(dcb);
+    if(dcb->tx_count < SERIAL_TX_BUFFER_SIZE)
+      Cond_Broadcast(&dcb->tx_space);
+    Mutex_Unlock(&dcb->spinlock);
+  }
+  stream_notify();
+  if(pre) preempt_on;
+}
+
+/*
+  Wait on tx_space, with the kernel lock released. The handler broadcasts
+  with dcb->spinlock held, so the caller's check of the ring and this 
+  wait are one critical section, and no broadcast is missed. 
+  Return 0 if the timeout (msec, 0 for none) expired.
+
+  *** MUST BE CALLED WITH dcb->spinlock HELD AND PREEMPTION OFF ***
+ */
+static int serial_tx_wait(serial_dcb_t* dcb, timeout_t timeout)
+{
+  kernel_unlock();
+  int signalled = (timeout == 0) 
+    ? Cond_Wait(&dcb->spinlock, &dcb->tx_space)
+    : Cond_TimedWait(&dcb->spinlock, &dcb->tx_space, timeout);
+
+  /* Reacquire the locks in order, kernel lock first */
+  Mutex_Unlock(&dcb->spinlock);
+  kernel_lock();
+  Mutex_Lock(&dcb->spinlock);
+  return signalled;
 }
 
 /* 
   Write call 
-  This is currently a polling driver.
+  Copy the data into the transmit ring, sleeping only while the ring is full.
 */
 int serial_write(void* dev, const char* buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
-  unsigned int count = 0;
-  while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
+  preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
-    if(success) {
+  unsigned int count = 0;
+  while(1) {
+    /* Append to the ring */
+    while(count < size && dcb->tx_count < SERIAL_TX_BUFFER_SIZE) {
+      uint tail = (dcb->tx_head + dcb->tx_count) % SERIAL_TX_BUFFER_SIZE;
+      dcb->tx_buffer[tail] = buf[count];
+      dcb->tx_count++;
       count++;
-    } 
-    else if(count==0)
-    {
-      yield(SCHED_IO);
     }
-    else
-      break;
+
+    /* Start the transmission */
+    serial_tx_drain(dcb);
+    if(count == size) break;
+
+    if(dcb->tx_count == SERIAL_TX_BUFFER_SIZE)
+      serial_tx_wait(dcb, 0);
   }
 
+  Mutex_Unlock(&dcb->spinlock);
+  preempt_on;           /* Restart preemption */
+
   return count;  
 }
 
 
+/*
+  Close call
+  Wait until the transmit ring is drained, so that no output is lost.
+  If the device accepts nothing for SERIAL_CLOSE_TIMEOUT, its peer is 
+  presumed gone, and the rest of the ring is dropped.
+*/
 int serial_close(void* dev) 
 {
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+
+  serial_tx_drain(dcb);
+  while(dcb->tx_count > 0) {
+    uint pending = dcb->tx_count;
+    if(! serial_tx_wait(dcb, SERIAL_CLOSE_TIMEOUT) && dcb->tx_count == pending) {
+      dcb->tx_head = (dcb->tx_head + dcb->tx_count) % SERIAL_TX_BUFFER_SIZE;
+      dcb->tx_count = 0;
+    }
+    serial_tx_drain(dcb);
+  }
+
+  Mutex_Unlock(&dcb->spinlock);
+  preempt_on;
   return 0;
 }
 
 
+/*
+  Poll call
+  Reads are ready when the device has data, writes when the ring has space.
+  The interrupt handlers call stream_notify().
+*/
+int serial_poll(void* dev, int events)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  int revents = 0;
+
+  if((events & POLL_READ) && bios_serial_rx_ready(dcb->devno))
+    revents |= POLL_READ;
+  if((events & POLL_WRITE) && dcb->tx_count < SERIAL_TX_BUFFER_SIZE)
+    revents |= POLL_WRITE;
+
+  return revents;
+}
+
+
 void* serial_open(uint term)
 {
   assert(term<bios_serial_ports());
@@ -180,7 +319,26 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Close = serial_close,
+  .Poll = serial_poll
+};
+
+
+/*
+  The console is a serial port of the BIOS, so it uses the same driver.
+ */
+void* console_open(uint minor)
+{
+  assert(bios_serial_console());
+  return & serial_dcb[SERIAL_CONSOLE];
+}
+
+static file_ops console_fops = {
+  .Open = console_open,
+  .Read = serial_read,
+  .Write = serial_write,
+  .Close = serial_close,
+  .Poll = serial_poll
 };
 
 
@@ -206,13 +364,26 @@ void initialize_devices()
   devtable[DEV_SERIAL].devnum = bios_serial_ports();
   devtable[DEV_SERIAL].dev_fops = serial_fops;
 
-  /* Initialize the serial devices */
-  for(int i=0; i<bios_serial_ports(); i++) {
+  devtable[DEV_CONSOLE].type = DEV_CONSOLE;
+  devtable[DEV_CONSOLE].devnum = bios_serial_console();
+  devtable[DEV_CONSOLE].dev_fops = console_fops;
+
+  /* Initialize the serial devices, including the console */
+  for(int i=0; i<=SERIAL_CONSOLE; i++) {
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
+    serial_dcb[i].rx_core = 0;
+    serial_dcb[i].rx_eof = (i == SERIAL_CONSOLE);
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].tx_head = 0;
+    serial_dcb[i].tx_count = 0;
+    serial_dcb[i].tx_space = COND_INIT;
   }
+}
+
 
+void initialize_device_interrupts()
+{
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
   cpu_interrupt_handler(SERIAL_TX_READY, serial_tx_handler);
 }
@@ -233,4 +404,11 @@ uint device_no(Device_type major)
   return devtable[major].devnum;
 }
 
+Device_type device_type(file_ops* ops)
+{
+  for(int major=0; major<DEV_MAX; major++)
+    if(ops == &devtable[major].dev_fops) return major;
+  return DEV_MAX;
+}
+
 
@@ -92,6 +92,16 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief Poll operation.
+
+      Return the subset of @c events (@c POLL_READ, @c POLL_WRITE) for which
+      a @c Read or @c Write would not block. This function must not block.
+      Stream objects that provide it must call @c stream_notify() when 
+      their readiness may have changed. If it is NULL, the stream never
+      blocks, so it is always ready.
+     */
+    int (*Poll)(void* this, int events);
 } file_ops;
 
 
@@ -104,6 +114,7 @@ typedef struct file_operations {
 typedef enum { 
 	DEV_NULL,    /**< Null device */
 	DEV_SERIAL,  /**< Serial device */
+	DEV_CONSOLE, /**< The console, on the standard input and output of the host */
 	DEV_MAX      /**< placeholder for maximum device number */
 }  Device_type;
 
@@ -133,6 +144,14 @@ typedef struct device_control_block
  */
 void initialize_devices();
 
+/** 
+  @brief Install the device interrupt handlers on the current core.
+
+  This function is called at kernel startup on every core, so that
+  device interrupts can be routed to any core.
+ */
+void initialize_device_interrupts();
+
 
 /**
   @brief Open a device.
@@ -153,6 +172,15 @@ int device_open(Device_type major, uint minor, void** obj, file_ops** ops);
   */
 uint device_no(Device_type major);
 
+/**
+  @brief Get the major number of a device stream.
+
+  This function returns the major number of the devices whose streams
+  use the given @c file_ops record, or @c DEV_MAX if the record does not
+  belong to a device.
+  */
+Device_type device_type(file_ops* ops);
+
 /** @} */
 
 #endif
@@ -3,12 +3,18 @@
 #include <valgrind/valgrind.h>
 #endif
 
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "bios.h"
 #include "tinyos.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_trace.h"
+#include "kernel_channel.h"
+#include "kernel_shm.h"
 
 
 
@@ -38,6 +44,7 @@ void boot_tinyos_kernel()
     initialize_processes();
     initialize_devices();
     initialize_files();
+    initialize_shm();
     initialize_scheduler();
 
     /* The boot task is executed normally! */
@@ -45,6 +52,12 @@ void boot_tinyos_kernel()
       FATAL("The init process does not have PID==1");
   }
 
+  /* Every core can handle device interrupts */
+  initialize_device_interrupts();
+
+  /* Every core writes its own trace ring */
+  initialize_sched_trace();
+
   cpu_core_barrier_sync();
 
 #ifndef NVALGRIND
@@ -65,7 +78,21 @@ void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
   boot_rec.argl = argl;
   boot_rec.args = args;
 
+  /* If requested, trace the scheduler into a file */
+  const char* trace_file = getenv("TINYOS_SCHED_TRACE");
+  if(trace_file)
+    sched_trace_enable(SCHED_TRACE_EVENTS);
+
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+  finalize_processes();
+  finalize_channels();
+
+  if(trace_file) {
+    if(sched_trace_dump(trace_file) == -1)
+      perror("Writing the scheduler trace");
+    sched_trace_disable();
+  }
 }
 
 
@@ -0,0 +1,229 @@
+
+#include <assert.h>
+
+#include "tinyos.h"
+#include "kernel_cc.h"
+#include "kernel_proc.h"
+#include "kernel_streams.h"
+#include "kernel_ioring.h"
+
+/*
+  Submission rings.
+
+  Every function here is called with the kernel lock held, except for
+  the worker threads, which take it themselves.
+ */
+
+
+/* Return true if an operation would not block */
+static int io_ready(io_sqe* sqe)
+{
+  int events;
+  switch(sqe->op) {
+    case IO_READ:
+    case IO_ACCEPT:
+      events = POLL_READ; break;
+    case IO_WRITE:
+      events = POLL_WRITE; break;
+    case IO_CONNECT:
+      return 0;
+    default:
+      return 1;
+  }
+
+  /* Bad fids fail at once; streams without Poll never block */
+  FCB* fcb = get_fcb(sqe->fid);
+  if(fcb == NULL || fcb->streamfunc->Poll == NULL) return 1;
+  return fcb->streamfunc->Poll(fcb->streamobj, events) != 0;
+}
+
+
+static int io_execute(io_sqe* sqe)
+{
+  switch(sqe->op) {
+    case IO_NOP: return 0;
+    case IO_READ: return sys_Read(sqe->fid, sqe->buf, sqe->size);
+    case IO_WRITE: return sys_Write(sqe->fid, sqe->buf, sqe->size);
+    case IO_CLOSE: return sys_Close(sqe->fid);
+    case IO_ACCEPT: return sys_Accept(sqe->fid);
+    case IO_CONNECT: return sys_Connect(sqe->fid, sqe->port, sqe->timeout);
+    default: return -1;
+  }
+}
+
+
+/* Post a completion. There is always room for it, see sys_IoRingEnter. */
+static void io_complete(IoRingCB* r, io_sqe* sqe, int result)
+{
+  io_ring* ring = & r->ring;
+  io_cqe* cqe = & ring->cq[ring->cq_tail & (2*ring->entries - 1)];
+  cqe->user_data = sqe->user_data;
+  cqe->result = result;
+  __atomic_store_n(& ring->cq_tail, ring->cq_tail + 1, __ATOMIC_RELEASE);
+
+  r->inflight--;
+  kernel_broadcast(& r->completed);
+}
+
+
+/* The function of the worker threads */
+static int io_worker(int argl, void* args)
+{
+  IoRingCB* r = args;
+
+  kernel_lock();
+  for(;;) {
+    if(! is_rlist_empty(& r->pending)) {
+      IoRequest* req = rlist_pop_front(& r->pending)->obj;
+
+      /* Wait on the streams, not inside the operation, so that a shutdown
+         can cancel it. A Connect is bounded by its own timeout. */
+      while(! r->shutdown && req->sqe.op != IO_CONNECT && ! io_ready(& req->sqe))
+        stream_wait(NO_TIMEOUT);
+
+      io_complete(r, & req->sqe, r->shutdown ? -1 : io_execute(& req->sqe));
+      rlist_push_front(& r->free, & req->node);
+    }
+    else if(r->shutdown)
+      break;
+    else {
+      r->idle++;
+      kernel_wait(& r->work, SCHED_IO);
+      r->idle--;
+    }
+  }
+  kernel_unlock();
+
+  return 0;
+}
+
+
+/* Hand an operation over to a worker, starting one if all are busy */
+static void io_queue(IoRingCB* r, io_sqe* sqe)
+{
+  IoRequest* req;
+  if(! is_rlist_empty(& r->free))
+    req = rlist_pop_front(& r->free)->obj;
+  else {
+    req = xmalloc(sizeof(IoRequest));
+    rlnode_init(& req->node, req);
+  }
+  req->sqe = *sqe;
+  rlist_push_back(& r->pending, & req->node);
+
+  if(r->idle > 0)
+    kernel_signal(& r->work);
+  else if(r->workers < IORING_MAX_WORKERS) {
+    Tid_t tid = sys_CreateThread(io_worker, 0, r);
+    if(tid != NOTHREAD)
+      r->worker[r->workers++] = tid;
+  }
+}
+
+
+io_ring* sys_IoRingSetup(unsigned int entries)
+{
+  PCB* pcb = CURPROC;
+  if(entries == 0 || entries > MAX_IORING_ENTRIES || pcb->ioring != NULL)
+    return NULL;
+
+  unsigned int size = 1;
+  while(size < entries) size <<= 1;
+
+  IoRingCB* r = xmalloc(sizeof(IoRingCB));
+  r->ring.entries = size;
+  r->ring.sq_head = r->ring.sq_tail = 0;
+  r->ring.cq_head = r->ring.cq_tail = 0;
+  r->ring.sq = xmalloc(size * sizeof(io_sqe));
+  r->ring.cq = xmalloc(2 * size * sizeof(io_cqe));
+  r->inflight = 0;
+  rlnode_init(& r->pending, NULL);
+  rlnode_init(& r->free, NULL);
+  r->workers = 0;
+  r->idle = 0;
+  r->shutdown = 0;
+  r->work = COND_INIT;
+  r->completed = COND_INIT;
+
+  pcb->ioring = r;
+  return & r->ring;
+}
+
+
+/* The number of completions posted and not yet taken by the process */
+static inline unsigned int io_completions(io_ring* ring)
+{
+  return ring->cq_tail - __atomic_load_n(& ring->cq_head, __ATOMIC_ACQUIRE);
+}
+
+int sys_IoRingEnter(unsigned int min_complete, timeout_t timeout)
+{
+  IoRingCB* r = CURPROC->ioring;
+  if(r == NULL)
+    return -1;
+
+  io_ring* ring = & r->ring;
+  unsigned int sq_tail = __atomic_load_n(& ring->sq_tail, __ATOMIC_ACQUIRE);
+
+  /* Submit, as long as every operation has room for its completion */
+  int submitted = 0;
+  while(ring->sq_head != sq_tail
+        && io_completions(ring) + r->inflight < 2*ring->entries) {
+    io_sqe* sqe = & ring->sq[ring->sq_head & (ring->entries - 1)];
+    r->inflight++;
+    if(io_ready(sqe))
+      io_complete(r, sqe, io_execute(sqe));
+    else
+      io_queue(r, sqe);
+    __atomic_store_n(& ring->sq_head, ring->sq_head + 1, __ATOMIC_RELEASE);
+    submitted++;
+  }
+
+  /* Wait for completions, while more may come */
+  TimerDuration deadline = (timeout == POLL_FOREVER) 
+    ? NO_TIMEOUT : bios_clock() + 1000ul*timeout;
+
+  while(io_completions(ring) < min_complete && r->inflight > 0 
+        && bios_clock() < deadline)
+    kernel_wait_until(& r->completed, SCHED_IO, deadline);
+
+  return submitted;
+}
+
+
+void shutdown_ioring(PCB* pcb)
+{
+  IoRingCB* r = pcb->ioring;
+  if(r == NULL) return;
+
+  while(! is_rlist_empty(& r->pending)) {
+    IoRequest* req = rlist_pop_front(& r->pending)->obj;
+    io_complete(r, & req->sqe, -1);
+    rlist_push_front(& r->free, & req->node);
+  }
+
+  /* Wake the workers, both idle and waiting on their streams */
+  r->shutdown = 1;
+  kernel_broadcast(& r->work);
+  stream_notify();
+
+  for(unsigned int w=0; w < r->workers; w++)
+    sys_ThreadJoin(r->worker[w], NULL);
+  r->workers = 0;
+}
+
+
+void free_ioring(PCB* pcb)
+{
+  IoRingCB* r = pcb->ioring;
+  if(r == NULL) return;
+
+  assert(r->workers == 0);
+  while(! is_rlist_empty(& r->free))
+    free(rlist_pop_front(& r->free)->obj);
+
+  free(r->ring.sq);
+  free(r->ring.cq);
+  free(r);
+  pcb->ioring = NULL;
+}
@@ -0,0 +1,80 @@
+#ifndef __KERNEL_IORING_H
+#define __KERNEL_IORING_H
+
+/**
+  @file kernel_ioring.h
+  @brief TinyOS kernel: Submission rings.
+
+  @defgroup ioring Submission rings
+  @ingroup kernel
+  @brief Submission rings.
+
+  Each process may have a submission ring, created by @c IoRingSetup.
+  A call to @c IoRingEnter takes the kernel lock once for all the
+  operations it submits. An operation whose stream is ready is executed
+  at once; the others are queued for the workers of the ring, which are
+  threads of the process, created on demand up to @c IORING_MAX_WORKERS.
+  A worker executes one operation at a time, and posts its completion.
+  It waits for the stream of the operation to become ready, as @c Poll
+  does, so that the operation can be cancelled when the process exits.
+
+  All ring data are protected by the kernel lock, except for the counters
+  of the queues, which are shared with the process and accessed atomically.
+
+  @{
+*/
+
+#include "tinyos.h"
+#include "kernel_sched.h"
+
+
+/** @brief The maximum number of workers of a ring. */
+#define IORING_MAX_WORKERS 16
+
+
+/** @brief A queued operation. */
+typedef struct io_request
+{
+  io_sqe sqe;                 /**< A copy of the submission */
+  rlnode node;                /**< Node for the pending or the free list */
+} IoRequest;
+
+
+/** @brief Submission ring control block. */
+typedef struct io_ring_control_block
+{
+  io_ring ring;               /**< The part shared with the process */
+  unsigned int inflight;      /**< Operations submitted, but not completed */
+
+  rlnode pending;             /**< Operations waiting for a worker */
+  rlnode free;                /**< Unused IoRequests */
+
+  Tid_t worker[IORING_MAX_WORKERS];  /**< The workers */
+  unsigned int workers;       /**< The number of workers */
+  unsigned int idle;          /**< The number of workers waiting for work */
+  int shutdown;               /**< Set when the workers should exit */
+
+  CondVar work;               /**< Idle workers wait here */
+  CondVar completed;          /**< Signalled when a completion is posted */
+} IoRingCB;
+
+
+/**
+  @brief Stop the submission ring of a process.
+
+  This is called when the process exits, before the ring is freed.
+  Every operation not yet completed fails with -1, the workers exit,
+  and the caller joins them.
+*/
+void shutdown_ioring(PCB* pcb);
+
+/**
+  @brief Free the submission ring of a process.
+
+  This is called after @c shutdown_ioring.
+*/
+void free_ioring(PCB* pcb);
+
+/** @} */
+
+#endif
@@ -46,6 +46,7 @@ int pipe_read (void* this, char *buf, unsigned int size)
 		pipe->read_p = read_p;
     pipe->available_space += bytes_read;
 		Cond_Broadcast(&pipe->hasSpace);
+		stream_notify();
 		return bytes_read;
 	}
 	else
@@ -64,6 +65,7 @@ int reader_close (void* this)
 			pipe->reader_closed = 1;
 			// Wake potentially sleeping threads.
 			Cond_Broadcast(&pipe->hasSpace);
+			stream_notify();
 		  	writer_close(this);
 			free(pipe);
 		}
@@ -117,6 +119,7 @@ int pipe_write (void* this, const char* buf, unsigned int size)
     pipe->available_space -= bytes_writen;
 		// Wake up any sleeping readers.
 		Cond_Broadcast(&pipe->hasData);
+		stream_notify();
 		return bytes_writen;
 	}
 	else
@@ -135,6 +138,7 @@ int writer_close (void* this)
 			pipe->writer_closed = 1;
 			// Wake any potentially sleeping threads.
 			Cond_Broadcast(&pipe->hasData);
+			stream_notify();
 		}
 		return 0;
 	}
@@ -142,12 +146,29 @@ int writer_close (void* this)
 	return -1;
 }
 
+int pipe_poll(void* this, int events)
+{
+	PipeCB* pipe = (PipeCB*) this;
+	int revents = 0;
+
+	// Data or EOF to read.
+	if (pipe->available_space < BUFF_SIZE || pipe->writer_closed)
+		revents |= POLL_READ;
+
+	// Space to write, or an error.
+	if (pipe->available_space > 0 || pipe->reader_closed)
+		revents |= POLL_WRITE;
+
+	return revents & events;
+}
+
 // For all our reader fcb needs.
 static file_ops reader_ops = {
   .Open = NULL,
   .Read = pipe_read,
   .Write = NULL,
-  .Close = reader_close
+  .Close = reader_close,
+  .Poll = pipe_poll
 };
 
 // For all our writer fcb needs.
@@ -155,7 +176,8 @@ static file_ops writer_ops = {
   .Open = NULL,
   .Read = NULL,
   .Write = pipe_write,
-  .Close = writer_close
+  .Close = writer_close,
+  .Poll = pipe_poll
 };
 
 // Allocate and initialize a PipeCB.
@@ -81,6 +81,18 @@ int reader_close (void* this);
 */
 int writer_close (void* this);
 
+/**
+  @brief Poll a pipe.
+
+	This function will report if a read or a write 
+	on the pipe would block.
+
+  @param this pointer to PipeCB 
+  @param events the events to check, @c POLL_READ and/or @c POLL_WRITE
+  @returns the subset of @c events that would not block.
+*/
+int pipe_poll (void* this, int events);
+
 /**
   @brief Allocate and initialize a PipeCB.
 
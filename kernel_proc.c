@@ -1,8 +1,11 @@
 
 #include <assert.h>
+#include <limits.h>
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_streams.h"
+#include "kernel_tasks.h"
+#include "kernel_ioring.h"
 
 /* 
  The process table and related system calls:
@@ -14,18 +17,46 @@
 
  */
 
-/* The process table */
-PCB PT[MAX_PROC];
+/* 
+  The process table.
+
+  PCBs are allocated on demand, in chunks of PCB_CHUNK. A PID consists
+  of the slot of its PCB in the table (the low bits) and a generation
+  (the high bits), which advances every time the PCB is released. Thus,
+  a PID is not reused until its slot has been reused many times, and
+  a stale PID never finds the PCB of a newer process.
+
+  Free PCBs are reused in FIFO order, to spread reuse over the slots.
+ */
+#define PCB_CHUNK 256
+#define PCB_CHUNKS (MAX_PROC/PCB_CHUNK)
+_Static_assert((MAX_PROC & (MAX_PROC-1)) == 0, "MAX_PROC must be a power of 2");
+_Static_assert(MAX_PROC % PCB_CHUNK == 0, "MAX_PROC must be a multiple of PCB_CHUNK");
+
+#define PID_SLOT(pid) ((unsigned int)(pid) & (MAX_PROC-1))
+#define PID_NEXT_GENERATION(pid) ((Pid_t)(((unsigned int)(pid) + MAX_PROC) & INT_MAX))
+
+static PCB* PT[PCB_CHUNKS];
+static unsigned int pcb_chunks;    /* Allocated chunks */
 unsigned int process_count;
 
+/* The used (ALIVE or ZOMBIE) PCBs, in order of creation */
+static rlnode live_list;
+
 PCB* get_pcb(Pid_t pid)
 {
-  return PT[pid].pstate==FREE ? NULL : &PT[pid];
+  if(pid < 0) return NULL;
+
+  PCB* chunk = PT[PID_SLOT(pid) / PCB_CHUNK];
+  if(chunk == NULL) return NULL;
+
+  PCB* pcb = & chunk[PID_SLOT(pid) % PCB_CHUNK];
+  return (pcb->pstate==FREE || pcb->pid != pid) ? NULL : pcb;
 }
 
 Pid_t get_pid(PCB* pcb)
 {
-  return pcb==NULL ? NOPROC : pcb-PT;
+  return pcb==NULL ? NOPROC : pcb->pid;
 }
 
 /* Initialize a PCB */
@@ -33,38 +64,55 @@ static inline void initialize_PCB(PCB* pcb)
 {
   pcb->pstate = FREE;
 
-  for(int i=0;i<MAX_FILEID;i++)
-    pcb->FIDT[i] = NULL;
+  pcb->fidt = NULL;
 
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
+  rlnode_init(& pcb->live_node, pcb);
   rlnode_init(& pcb->children_node, pcb);
   rlnode_init(& pcb->exited_node, pcb);
   rlnode_init(& pcb->ptcb_list, NULL);
+  rlnode_init(& pcb->ptcb_free, NULL);
   pcb->child_exit = COND_INIT;
-  pcb->thread_mx = MUTEX_INIT;
+  pcb->threads_exited = COND_INIT;
 }
 
 
+/* The free list is threaded through the parent field */
 static PCB* pcb_freelist;
+static PCB* pcb_freelist_tail;
 
-void initialize_processes()
+static void pcb_freelist_push(PCB* pcb)
 {
-  /* initialize the PCBs */
-  for(Pid_t p=0; p<MAX_PROC; p++) {
-    initialize_PCB(&PT[p]);
-  }
+  pcb->parent = NULL;
+  if(pcb_freelist == NULL)
+    pcb_freelist = pcb;
+  else
+    pcb_freelist_tail->parent = pcb;
+  pcb_freelist_tail = pcb;
+}
 
-  /* use the parent field to build a free list */
-  PCB* pcbiter;
-  pcb_freelist = NULL;
-  for(pcbiter = PT+MAX_PROC; pcbiter!=PT; ) {
-    --pcbiter;
-    pcbiter->parent = pcb_freelist;
-    pcb_freelist = pcbiter;
+/* Add a new chunk of PCBs to the table and the free list */
+static void allocate_pcb_chunk()
+{
+  PCB* chunk = xmalloc(PCB_CHUNK*sizeof(PCB));
+  for(unsigned int i=0; i<PCB_CHUNK; i++) {
+    initialize_PCB(&chunk[i]);
+    chunk[i].pid = pcb_chunks*PCB_CHUNK + i;
+    pcb_freelist_push(&chunk[i]);
   }
+  PT[pcb_chunks++] = chunk;
+}
+
+void initialize_processes()
+{
+  pcb_freelist = pcb_freelist_tail = NULL;
+  pcb_chunks = 0;
+  for(unsigned int c=0; c<PCB_CHUNKS; c++)
+    PT[c] = NULL;
 
   process_count = 0;
+  rlnode_init(& live_list, NULL);
 
   /* Execute a null "idle" process */
   if(Exec(NULL,0,NULL)!=0)
@@ -79,10 +127,18 @@ PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
+  if(pcb_freelist == NULL && pcb_chunks < PCB_CHUNKS)
+    allocate_pcb_chunk();
+
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
+    memset(& pcb->usage, 0, sizeof(cpu_usage));
+    pcb->executor = NULL;
+    pcb->ioring = NULL;
+    pcb->exit_handler_count = 0;
+    rlist_push_back(& live_list, & pcb->live_node);
     process_count++;
   }
 
@@ -95,12 +151,30 @@ PCB* acquire_PCB()
 void release_PCB(PCB* pcb)
 {
   pcb->pstate = FREE;
-  pcb->parent = pcb_freelist;
-  pcb_freelist = pcb;
+  pcb->pid = PID_NEXT_GENERATION(pcb->pid);
+  rlist_remove(& pcb->live_node);
+  pcb_freelist_push(pcb);
   process_count--;
 }
 
 
+void finalize_processes()
+{
+  /* Only the scheduler process is left */
+  while(! is_rlist_empty(& live_list)) {
+    PCB* pcb = rlist_pop_front(& live_list)->pcb;
+    if(pcb) free(pcb->fidt);
+  }
+
+  for(unsigned int c=0; c<pcb_chunks; c++) {
+    free(PT[c]);
+    PT[c] = NULL;
+  }
+  pcb_chunks = 0;
+  pcb_freelist = pcb_freelist_tail = NULL;
+}
+
+
 /*
  *
  * Process creation
@@ -141,6 +215,8 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
     newproc->parent = NULL;
+    newproc->affinity = ALL_CORES;
+    newproc->fidt = FIDT_create();
   }
   else
   {
@@ -151,12 +227,11 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
-    /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+    /* Inherit the default affinity */
+    newproc->affinity = curproc->affinity;
+
+    /* Inherit file streams from parent, copy-on-write */
+    newproc->fidt = FIDT_share(curproc->fidt);
   }
 
   /* Creates new PTCB for main thread and pushes the ptcb node
@@ -180,7 +255,8 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   /* Copy the arguments to new storage, owned by the new process */
   ptcb->argl = argl;
   if(args!=NULL) {
-    ptcb->args = malloc(argl);
+    /* Small arguments are stored in the PTCB */
+    ptcb->args = (argl <= PTCB_INLINE_ARGS) ? ptcb->inline_args : xmalloc(argl);
     memcpy(ptcb->args, args, argl);
   }
   else
@@ -198,6 +274,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     */
     newproc->main_thread->thread = spawn_thread(newproc, start_main_thread);
     newproc->thread_count = 1;
+    newproc->live_threads = 0;
 
     //@TODO REMOVE
     //fprintf(stderr,"I spawned main thread thread!\n" );
@@ -229,6 +306,16 @@ Pid_t sys_GetPPid()
 }
 
 
+int sys_AtExit(void (*handler)(void))
+{
+  PCB* pcb = CURPROC;
+  if(handler == NULL || pcb->exit_handler_count == MAX_EXIT_HANDLERS)
+    return -1;
+  pcb->exit_handlers[pcb->exit_handler_count++] = handler;
+  return 0;
+}
+
+
 static void cleanup_zombie(PCB* pcb, int* status)
 {
   if(status != NULL)
@@ -245,7 +332,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 {
 
   /* Legality checks */
-  if((cpid<0) || (cpid>=MAX_PROC)) {
+  if(cpid<0) {
     cpid = NOPROC;
     goto finish;
   }
@@ -317,21 +404,38 @@ void sys_Exit(int exitval)
     while(sys_WaitChild(NOPROC,NULL)!=NOPROC);
   }
 
+  /* A direct call to Exit skips ThreadExit, so release the thread's data here */
+  run_tls_destructors();
+
   PCB *curproc = CURPROC;  /* cache for efficiency */
 
+  /* The handlers may do I/O, so they run before the files are closed */
+  while(curproc->exit_handler_count > 0) {
+    void (*handler)(void) = curproc->exit_handlers[--curproc->exit_handler_count];
+    kernel_unlock();
+    handler();
+    kernel_lock();
+  }
+
+  release_tls_keys(curproc);
+
+  /* The pool and ring workers use the files, so they go first */
+  shutdown_executor(curproc);
+  shutdown_ioring(curproc);
+  free_executor(curproc);
+  free_ioring(curproc);
+
   /* Do all the other cleanup we want here, close files etc. */
-  if(curproc->main_thread->args) {
-    free(curproc->main_thread->args);
-    curproc->main_thread->args = NULL;
+  PTCB* main_thread = curproc->main_thread;
+  if(main_thread->args) {
+    if(main_thread->args != main_thread->inline_args)
+      free(main_thread->args);
+    main_thread->args = NULL;
   }
 
   /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
-  }
+  FIDT_release(curproc->fidt);
+  curproc->fidt = NULL;
 
   /* Reparent any children of the exiting process to the 
      initial task */
@@ -371,41 +475,73 @@ void sys_Exit(int exitval)
 
 /* ------------------------------ Open Info ------------------------------ */
 
+/*
+  Fill in the info of a process.
+*/
+static void get_procinfo(PCB* pcb, procinfo* info)
+{
+  memset(info, 0, sizeof(procinfo));
+  info->pid = get_pid(pcb);
+  info->ppid = get_pid(pcb->parent);
+  info->alive = (pcb->pstate == ALIVE);
+  info->thread_count = pcb->thread_count;
+  get_cpu_usage(pcb, &info->usage);
+
+  /* Zombies have released their main thread */
+  PTCB* main_thread = pcb->main_thread;
+  if(main_thread) {
+    info->main_task = main_thread->main_task;
+    info->argl = main_thread->argl;
+    if(main_thread->args)
+      memcpy(info->args, main_thread->args,
+        (main_thread->argl < PROCINFO_MAX_ARGS_SIZE) ? main_thread->argl : PROCINFO_MAX_ARGS_SIZE);
+  }
+}
+
 /*
   file_ops Close();
 */
 static int info_close(void* this)
 {
   InfoCB* info = this;
-  // just free all memory
-  free(info->info_table);
+  rlist_remove(& info->cursor);
+  rlist_remove(& info->end);
   free(info);
   return 0;
 }
 
 /*
   file_ops Read();
+
+  Return as many whole procinfo records as fit into the buffer.
 */
 static int info_read(void* this, char *buf, unsigned int size)
 {
   InfoCB* info = this;
 
-  // not sure of this one. Maybe >= ? as long as we can fit the struct ...
-  if (size != sizeof(procinfo))
+  if (size < sizeof(procinfo))
     return -1;
 
-  if (info->index != -1)
+  unsigned int count = 0;
+  rlnode* node = info->cursor.next;
+  while (node != & info->end && (count+1)*sizeof(procinfo) <= size)
   {
-    memcpy(buf, &(info->info_table[info->index]), size);
-    info->index--;
-    return size;
-  }
-  else
-  {
-    // EOF
-    return 0;
+    /* Skip the markers of other streams */
+    if (node->pcb != NULL)
+    {
+      procinfo pinfo;
+      get_procinfo(node->pcb, &pinfo);
+      memcpy(buf + count*sizeof(procinfo), &pinfo, sizeof(procinfo));
+      count++;
+    }
+    node = node->next;
   }
-  
+
+  /* Place the cursor before the next unreported node */
+  rlist_remove(& info->cursor);
+  rlist_push_back(node, & info->cursor);
+
+  return count*sizeof(procinfo);
 }
 
 static file_ops info_ops = {
@@ -425,56 +561,17 @@ Fid_t sys_OpenInfo()
     // there are no file pointers left
     return NOFILE;
   }
-  
-  uint32_t cur_count = process_count;
-
-  InfoCB* info = (InfoCB*)malloc(sizeof(InfoCB));
-  if (!info)
-  {
-    fprintf(stderr, "FATAL: Could not allocate enough memory\n");
-    return NOFILE;
-  }
-  memset(info, 0, sizeof(InfoCB));
-
-  procinfo* info_table = (procinfo*)malloc(sizeof(procinfo)*cur_count);
-  if (!info_table)
-  {
-    fprintf(stderr, "FATAL: Could not allocate enough memory\n");
-    return NOFILE;
-  }
-  memset(info_table, 0, sizeof(procinfo)*cur_count);
 
-  int index = 0;
+  InfoCB* info = (InfoCB*)xmalloc(sizeof(InfoCB));
+  rlnode_init(& info->cursor, NULL);
+  rlnode_init(& info->end, NULL);
 
-  // This loop might run for a very long time!
-  for (int i = 0; i < MAX_PROC; ++i)
-  {
-    // We have all PCB that we can fit or a Process exited and we should stop.
-    if (index == cur_count || index > process_count)
-    {
-      break;
-    }
-
-    PCB proc = PT[i];
-    if (proc.pstate != FREE)
-    {
-      info_table[index].pid = i;
-      info_table[index].ppid = (!proc.parent) ? 0 : (proc.parent - PT);
-      info_table[index].alive = (proc.pstate == ALIVE);
-      info_table[index].thread_count = proc.thread_count;
-      info_table[index].main_task = proc.main_thread->main_task;
-      info_table[index].argl = proc.main_thread->argl;
-      memcpy(info_table[index].args, proc.main_thread->args, info_table[index].argl);
-      index++;
-    }
-  }
-
-  info->info_table = info_table;
-  info->index = index;
+  /* Mark the current processes */
+  rlist_push_front(& live_list, & info->cursor);
+  rlist_push_back(& live_list, & info->end);
 
   (*fcb)->streamobj = info;
   (*fcb)->streamfunc = &info_ops;
 
   return stream;
 }
-
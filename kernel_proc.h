@@ -37,6 +37,7 @@ typedef enum pid_state_e {
  */
 typedef struct process_control_block {
   pid_state  pstate;      /**< The pid state for this PCB */
+  Pid_t pid;              /**< The pid of this PCB, or its next pid while FREE */
 
   PCB* parent;            /**< Parent's pcb. */
   
@@ -47,15 +48,24 @@ typedef struct process_control_block {
   rlnode children_list;   /**< List of children */
   rlnode exited_list;     /**< List of exited children */
 
+  rlnode live_node;       /**< Intrusive node for the list of used PCBs */
   rlnode children_node;   /**< Intrusive node for @c children_list */
   rlnode exited_node;     /**< Intrusive node for @c exited_list */
   CondVar child_exit;     /**< Condition variable for @c WaitChild */
 
-  FCB* FIDT[MAX_FILEID];  /**< The fileid table of the process */
+  FIDT* fidt;             /**< The fileid table of the process, maybe shared */
 
-  rlnode ptcb_list;       /**< List of PTCBs */
+  rlnode ptcb_list;       /**< List of PTCBs of threads other than the main, not yet joined */
+  rlnode ptcb_free;       /**< PTCBs for reuse */
   uint64_t thread_count;       /**< Total number of threads. */
-  Mutex thread_mx;
+  unsigned int live_threads;   /**< Threads other than the main, not yet exited */
+  CondVar threads_exited; /**< Signalled when @c live_threads becomes 0 */
+  cpu_mask_t affinity;    /**< Default affinity of new threads */
+  cpu_usage usage;        /**< CPU usage of all threads, kept by the scheduler */
+  struct task_executor* executor;  /**< The task pool, or NULL */
+  struct io_ring_control_block* ioring;  /**< The submission ring, or NULL */
+  void (*exit_handlers[MAX_EXIT_HANDLERS])(void);  /**< Functions registered by @c AtExit */
+  unsigned int exit_handler_count;  /**< The number of @c exit_handlers */
 
 } PCB;
 
@@ -67,6 +77,14 @@ typedef struct process_control_block {
 */
 void initialize_processes();
 
+/**
+  @brief Release the process table.
+
+  This function is called after the VM has shut down, to free the 
+  memory of the process table.
+*/
+void finalize_processes();
+
 /**
   @brief Get the PCB for a PID.
 
@@ -91,18 +109,30 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/** @brief The size of arguments of Exec that are stored inside the PTCB, without malloc. */
+#define PTCB_INLINE_ARGS 128
+
 /**
   @brief Process Thread Control Block.
+
+  The PTCB of a thread outlives its TCB: after the thread exits, it keeps the
+  exit value until the thread is joined, or until the process exits. Then, it
+  is kept by the process for reuse by later threads.
+
+  A @c Tid_t is the address of the PTCB, tagged with the generation of the
+  PTCB, which changes whenever the PTCB is released. Thus, the tid of a joined
+  or exited detached thread is invalid, even after its PTCB is reused 
+  (until the generation wraps around, after @c TID_GENERATIONS reuses).
  */
 typedef struct  p_thread_control_block
 {
   PCB* owner_pcb;         /**< Owner PCB*/
   rlnode pthread;         /**< Node for intrusive list*/
   
-  TCB* thread;
+  TCB* thread;            /**< The thread, or NULL after it exits */
   int exitval;            /**< The exit value */
+  int exited;             /**< Set when the thread has exited */
 
-  CondVar waiting;        /**< Condition variable to wake sleeping threads so that they can be joined*/
   CondVar thread_join;    /**< Condition variable for @c ThreadJoin */
   int waiting_threads;    /**< Number of threads waiting on this thread*/
   int detached;           /**< If = 0 then thread is joinable */
@@ -110,30 +140,80 @@ typedef struct  p_thread_control_block
   Task main_task;         /**< The thread's function */
   int argl;               /**< The thread's argument length */
   void* args;             /**< The thread's argument string */
+  char inline_args[PTCB_INLINE_ARGS];  /**< Storage for small copied arguments of a main thread */
 
+  unsigned int gen;       /**< The generation, kept across reuse */
 }PTCB;
 
+/** @brief The bits of a @c Tid_t below the generation tag. */
+#define TID_GEN_SHIFT 48
+
+/** @brief The number of distinct generations of a PTCB. */
+#define TID_GENERATIONS (1u << (64-TID_GEN_SHIFT))
+
+_Static_assert(sizeof(Tid_t) == 8, "Tid_t must have room for a generation tag");
+
+/** @brief Return the tid of a PTCB. */
+static inline Tid_t get_tid(PTCB* ptcb)
+{
+  return (Tid_t) ptcb | ((Tid_t) ptcb->gen << TID_GEN_SHIFT);
+}
+
+/** 
+  @brief Return the PTCB of a tid, or NULL if the tid is stale or @c NOTHREAD. 
+
+  The PTCB is only checked for its generation, so the tid must have been
+  a valid tid of some thread.
+*/
+static inline PTCB* get_ptcb(Tid_t tid)
+{
+  PTCB* ptcb = (PTCB*) (tid & (((Tid_t)1 << TID_GEN_SHIFT) - 1));
+  return (ptcb != NULL && ptcb->gen == (tid >> TID_GEN_SHIFT)) ? ptcb : NULL;
+}
+
 
 /**
   @brief Acquire PTCB.
 
-  This function returns a PTCB struct with its members initialized and 
-  pushes its rlnode in PCB's ptcb_list 
+  This function returns a PTCB struct with its members initialized,
+  reusing a PTCB of the process if possible.
 */
 PTCB* Create_PTCB(PCB* pcb);
 
+/**
+  @brief Call the thread-local storage destructors of the current thread.
+
+  This is called when a thread exits, by @c ThreadExit or @c Exit.
+*/
+void run_tls_destructors();
+
+/**
+  @brief Free the thread-local storage keys allocated by a process.
+
+  This is called when the process exits, after the destructors of its
+  last thread have run. Global keys are not affected.
+*/
+void release_tls_keys(PCB* pcb);
+
 /* ------------------------------ Open Info ------------------------------ */
 
 /**
   @brief Info Control Block.
 
-  This struct has all the date needed for OpenInfo()/sysinfo
+  This struct has all the data needed for OpenInfo()/sysinfo
   and acts as the streamobj for the associated stream.
+
+  The stream does not copy the process table. Instead, it places two
+  marker nodes into the list of used PCBs: the processes between them
+  are the processes that existed when the stream was opened. Each read
+  reports the processes after @c cursor and moves it forward. Processes
+  that are released in the meantime simply leave the list, and new
+  processes are added after @c end. Marker nodes have a NULL @c pcb.
  */
 typedef struct info_control_block
 {
-  procinfo * info_table;  /**< A dynamic array with all the procinfo structs that were created during OpenInfo()*/
-  uint32_t index;         /**< The index of next element to be drawn from array*/
+  rlnode cursor;          /**< Marker before the next process to report */
+  rlnode end;             /**< Marker after the last process to report */
 } InfoCB;
 
 /** @} */
@@ -2,11 +2,13 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "tinyos.h"
 #include "kernel_cc.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_trace.h"
 
 #ifndef NVALGRIND
 #include <valgrind/valgrind.h>
@@ -47,9 +49,6 @@
 volatile unsigned int active_threads = 0;
 Mutex active_threads_spinlock = MUTEX_INIT;
 
-/* Time slice counter*/
-uint32_t timeslices = 0;
-
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE  (1<<12)
 
@@ -103,6 +102,53 @@ void* allocate_thread(size_t size)
 #endif
 
 
+/*
+  Each core keeps the memory of a few exited threads, to reuse it for
+  new threads without going to the allocator. Since a core only touches
+  its own pool, with preemption off, no locking is needed.
+ */
+#define THREAD_POOL_SIZE 16
+
+static void* pool_allocate_thread()
+{
+  int oldpre = preempt_off;
+  CCB* core = & CURCORE;
+  void* ptr = core->thread_pool;
+  if(ptr) {
+    core->thread_pool = *(void**)ptr;
+    core->thread_pool_size--;
+  }
+  if(oldpre) preempt_on;
+
+  return ptr ? ptr : allocate_thread(THREAD_SIZE);
+}
+
+/* This is called with preemption off */
+static void pool_free_thread(void* ptr)
+{
+  CCB* core = & CURCORE;
+  if(core->thread_pool_size < THREAD_POOL_SIZE) {
+    *(void**)ptr = core->thread_pool;
+    core->thread_pool = ptr;
+    core->thread_pool_size++;
+  }
+  else
+    free_thread(ptr, THREAD_SIZE);
+}
+
+/* Return the pool of the current core to the allocator */
+static void pool_drain()
+{
+  CCB* core = & CURCORE;
+  while(core->thread_pool) {
+    void* ptr = core->thread_pool;
+    core->thread_pool = *(void**)ptr;
+    free_thread(ptr, THREAD_SIZE);
+  }
+  core->thread_pool_size = 0;
+}
+
+
 
 /*
   This is the function that is used to start normal threads.
@@ -126,13 +172,17 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
+/* The serial number of the last thread, starting at 1 */
+static uint64_t thread_serial = 0;
+
 TCB* spawn_thread(PCB* pcb, void (*func)())
 {
   /* The allocated thread size must be a multiple of page size */
-  TCB* tcb = (TCB*) allocate_thread(THREAD_SIZE);
+  TCB* tcb = (TCB*) pool_allocate_thread();
 
   /* Set the owner */
   tcb->owner_pcb = pcb;
+  tcb->serial = __atomic_add_fetch(& thread_serial, 1, __ATOMIC_RELAXED);
 
   /* Initialize the other attributes */
   tcb->type = NORMAL_THREAD;
@@ -142,7 +192,10 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
   tcb->wakeup_time = NO_TIMEOUT;
   tcb->priority = 0;
   tcb->mutex_contention = 0;
+  tcb->affinity = pcb->affinity;
   rlnode_init(& tcb->sched_node, tcb);  /* Intrusive list node */
+  memset(& tcb->usage, 0, sizeof(cpu_usage));
+  memset(tcb->tls_gen, 0, sizeof(tcb->tls_gen));  /* All values are NULL */
 
 
   /* Compute the stack segment address and size */
@@ -174,7 +227,7 @@ void release_TCB(TCB* tcb)
   VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);    
 #endif
 
-  free_thread(tcb, THREAD_SIZE);
+  pool_free_thread(tcb);
 
   Mutex_Lock(&active_threads_spinlock);
   active_threads--;
@@ -209,6 +262,7 @@ CCB cctx[MAX_CORES];
 */
 
 #define MFQ_QUEUES 15
+_Static_assert(MFQ_QUEUES == PROCINFO_PRIORITY_LEVELS, "cpu_usage must have a slot per MFQ level");
 
 #define MFQ_TIMESLICES 5
 
@@ -227,7 +281,8 @@ void yield_handler()
 /* Interrupt handle for inter-core interrupts */
 void ici_handler() 
 {
-  /* noop for now... */
+  /* Some other core made ready a thread that should preempt ours */
+  yield(SCHED_PREEMPT);
 }
 
 
@@ -236,13 +291,12 @@ void ici_handler()
 
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+static void sched_register_timeout(TCB* tcb, TimerDuration deadline)
 {
-  if(timeout!=NO_TIMEOUT){
+  if(deadline!=NO_TIMEOUT){
 
   	/* set the wakeup time */
-  	TimerDuration curtime = bios_clock();
-  	tcb->wakeup_time = (timeout==NO_TIMEOUT) ? NO_TIMEOUT : curtime+timeout;
+  	tcb->wakeup_time = deadline;
 
   	/* add to the TIMEOUT_LIST in sorted order */
   	rlnode* n = TIMEOUT_LIST.next;
@@ -255,6 +309,47 @@ static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 }
 
 
+/*
+  Notify the cores that tcb became ready. Only the cores in the affinity
+  of tcb are considered. If one of them is idle, restart it. Else, if tcb 
+  has higher priority than the thread running on one of them, send an ICI 
+  to the core running the lowest-priority thread, so that it reschedules.
+
+  An idle core that was restarted, but has not yet scheduled, is skipped,
+  so that a burst of wakeups restarts as many distinct cores.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_notify_cores(TCB* tcb)
+{
+  int victim = -1;
+  uint32_t lowest = tcb->priority;
+
+  for(uint c=0; c<cpu_cores(); c++) {
+    if(! core_allowed(tcb, c)) continue;
+
+    TCB* running = cctx[c].current_thread;
+
+    /* A core not yet in the scheduler counts as idle */
+    if(running==NULL || running->type == IDLE_THREAD) {
+      if(cctx[c].restart_pending) continue;
+      cctx[c].restart_pending = 1;
+      cpu_core_restart(c);
+      return;
+    }
+
+    /* Larger values mean lower priority */
+    if(running->priority > lowest) {
+      lowest = running->priority;
+      victim = c;
+    }
+  }
+
+  if(victim >= 0)
+    cpu_ici(victim);
+}
+
+
 /*
   Add TCB to the end of the scheduler list.
 
@@ -265,8 +360,8 @@ static void sched_queue_add(TCB* tcb)
   /* Insert at the end of the scheduling list */
   rlist_push_back(& SCHED[tcb->priority], & tcb->sched_node);
 
-  /* Restart possibly halted cores */
-  cpu_core_restart_one();
+  /* Restart a halted core, or preempt a lower-priority thread */
+  sched_notify_cores(tcb);
 }
 
 
@@ -289,6 +384,7 @@ static void sched_make_ready(TCB* tcb)
 
 	/* Mark as ready */
 	tcb->state = READY;
+	tcb->ready_since = bios_clock();
 
 	/* Possibly add to the scheduler queue */
 	if(tcb->phase == CTX_CLEAN) 
@@ -297,8 +393,8 @@ static void sched_make_ready(TCB* tcb)
 
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Remove the first thread of the scheduler lists that may run on
+  this core, and return it. Return NULL if there is none.
 
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
@@ -311,15 +407,17 @@ static TCB* sched_queue_select()
   		TCB* tcb = TIMEOUT_LIST.next->tcb;
   		if(tcb->wakeup_time > curtime)
   			break;
+  		sched_trace(SCHED_EV_TIMEOUT, tcb, 0, 0);
   		sched_make_ready(tcb);
   }
 
-  /* Get the head of the SCHED list */
+  /* Get the first thread of the highest-priority list, skipping other cores' threads */
   for (int i = 0; i < MFQ_QUEUES; ++i)
   {
-    if (!is_rlist_empty(& SCHED[i]))
+    for (rlnode* n = SCHED[i].next; n != &SCHED[i]; n = n->next)
     {
-      return rlist_pop_front(&SCHED[i])->tcb;
+      if (core_allowed(n->tcb, cpu_core_id))
+        return rlist_remove(n)->tcb;
     }
   }
 
@@ -328,6 +426,7 @@ static TCB* sched_queue_select()
 
 static void sched_boost()
 {
+  uint32_t moved = 0;
 	for (int i = 0; i < MFQ_QUEUES - 1; ++i)
   {
     if (!is_rlist_empty(&SCHED[i+1]))
@@ -335,10 +434,75 @@ static void sched_boost()
       rlnode* sel = rlist_pop_front(&SCHED[i+1]);
       sel->tcb->priority--;
       rlist_push_back(&SCHED[i], sel);
+      sched_trace(SCHED_EV_PRIORITY, sel->tcb, 0, i+1);
+      moved++;
     }
   }
+  sched_trace(SCHED_EV_BOOST, NULL, 0, moved);
 }
 
+/*
+  CPU accounting. Each update goes to both the thread and its process.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static inline void sched_account_run(TCB* tcb, TimerDuration now)
+{
+  TimerDuration dt = now - tcb->run_since;
+  tcb->usage.run_time += dt;
+  tcb->usage.level_time[tcb->priority] += dt;
+  tcb->owner_pcb->usage.run_time += dt;
+  tcb->owner_pcb->usage.level_time[tcb->priority] += dt;
+}
+
+static inline void sched_account_wait(TCB* tcb, TimerDuration now)
+{
+  TimerDuration dt = now - tcb->ready_since;
+  tcb->usage.wait_time += dt;
+  tcb->owner_pcb->usage.wait_time += dt;
+}
+
+static inline void sched_account_switch(TCB* tcb, enum SCHED_CAUSE cause)
+{
+  if(cause == SCHED_QUANTUM || cause == SCHED_PREEMPT) {
+    tcb->usage.involuntary_switches++;
+    tcb->owner_pcb->usage.involuntary_switches++;
+  } else {
+    tcb->usage.voluntary_switches++;
+    tcb->owner_pcb->usage.voluntary_switches++;
+  }
+}
+
+
+void get_cpu_usage(PCB* pcb, cpu_usage* usage)
+{
+  int oldpre = preempt_off;
+  Mutex_Lock(& sched_spinlock);
+  *usage = pcb->usage;
+  Mutex_Unlock(& sched_spinlock);
+  if(oldpre) preempt_on;
+}
+
+
+/*
+  Change the affinity of a thread.
+ */
+void set_thread_affinity(TCB* tcb, cpu_mask_t mask)
+{
+  int oldpre = preempt_off;
+  Mutex_Lock(& sched_spinlock);
+
+  tcb->affinity = mask;
+
+  /* A queued thread may now be runnable only on other cores */
+  if(tcb->state == READY && tcb->phase == CTX_CLEAN)
+    sched_notify_cores(tcb);
+
+  Mutex_Unlock(& sched_spinlock);
+  if(oldpre) preempt_on;
+}
+
+
 /*
   Make the process ready. 
  */
@@ -353,6 +517,7 @@ int wakeup(TCB* tcb)
 	Mutex_Lock(& sched_spinlock);
 
 	if(tcb->state==STOPPED || tcb->state==INIT) {
+		sched_trace(SCHED_EV_WAKEUP, tcb, 0, 0);
 		sched_make_ready(tcb);
 		ret = 1;		
 	}
@@ -371,6 +536,15 @@ int wakeup(TCB* tcb)
   Atomically put the current process to sleep, after unlocking mx.
  */
 void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+  sleep_releasing_until(state, mx, cause, timeout_deadline(timeout));
+}
+
+
+/*
+  Atomically put the current process to sleep until a deadline, after unlocking mx.
+ */
+void sleep_releasing_until(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration deadline)
 {
   assert(state==STOPPED || state==EXITED);
 
@@ -386,10 +560,11 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
 
   /* mark the thread as stopped or exited */
   tcb->state = state;
+  sched_trace(SCHED_EV_SLEEP, tcb, cause, deadline != NO_TIMEOUT);
 
   /* register the timeout (if any) for the sleeping thread */
   if(state!=EXITED) 
-  	sched_register_timeout(tcb, timeout);
+  	sched_register_timeout(tcb, deadline);
 
   /* Release mx */
   if(mx!=NULL) Mutex_Unlock(mx);
@@ -421,6 +596,13 @@ void yield(enum SCHED_CAUSE cause)
 
   Mutex_Lock(& sched_spinlock);
 
+  uint32_t old_priority = current->priority;
+
+  /* Charge the timeslice, at the level it ran */
+  TimerDuration now = bios_clock();
+  if(current->type != IDLE_THREAD)
+    sched_account_run(current, now);
+
   /* Restore fairness*/
   if (current->mutex_contention && cause != SCHED_MUTEX)
   {
@@ -460,10 +642,15 @@ void yield(enum SCHED_CAUSE cause)
   	break;
   }
 
+  sched_trace(cause==SCHED_MUTEX ? SCHED_EV_MUTEX : SCHED_EV_YIELD, current, cause, 0);
+  if(current->priority != old_priority)
+    sched_trace(SCHED_EV_PRIORITY, current, cause, old_priority);
+
   switch(current->state)
   {
     case RUNNING:
       current->state = READY;
+      current->ready_since = now;
     case READY: /* We were awakened before we managed to sleep! */
       current_ready = 1;
       break;
@@ -477,23 +664,31 @@ void yield(enum SCHED_CAUSE cause)
       assert(0);  /* It should not be READY or EXITED ! */
   }
 
-  if (timeslices >= MFQ_TIMESLICES)
+  /* Each core counts its own timeslices. Summed over the cores, this is
+     one boost per MFQ_TIMESLICES timeslices, as with a global counter */
+  if (CURCORE.timeslices >= MFQ_TIMESLICES)
   {
-  	timeslices = 0;
+  	CURCORE.timeslices = 0;
   	sched_boost();
   }
 
   /* Get next */
   TCB* next = sched_queue_select();
 
+  /* This core has seen the queue, so the next wakeup may restart it */
+  CURCORE.restart_pending = 0;
+
   /* Maybe there was nothing ready in the scheduler queue ? */
   if(next==NULL) {
-    if(current_ready)
+    if(current_ready && core_allowed(current, cpu_core_id))
       next = current;
     else
       next = & CURCORE.idle_thread;
   }
 
+  if(current != next && current->type != IDLE_THREAD)
+    sched_account_switch(current, cause);
+
   /* ok, link the current and next TCB, for the gain phase */
   current->next = next;
   next->prev = current;
@@ -513,6 +708,25 @@ void yield(enum SCHED_CAUSE cause)
 }
 
 
+/*
+  Return the timer interval for an idle core. The core must wake up
+  in time for the earliest deadline in the TIMEOUT_LIST.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static TimerDuration sched_idle_timer(TimerDuration quantum)
+{
+  if(is_rlist_empty(&TIMEOUT_LIST))
+    return quantum;
+
+  TimerDuration deadline = TIMEOUT_LIST.next->tcb->wakeup_time;
+  TimerDuration curtime = bios_clock();
+  if(deadline <= curtime)
+    return 1;   /* 0 would cancel the timer */
+  return (deadline-curtime < quantum) ? deadline-curtime : quantum;
+}
+
+
 /*
   This function must be called at the beginning of each new timeslice.
   This is done mostly from inside yield(). 
@@ -532,7 +746,7 @@ void gain(int preempt)
   //@TODO REMOVE
   //fprintf(stderr, "in Gain \n" );
   // Next timeslice
-  timeslices++;
+  CURCORE.timeslices++;
 
   /* Mark current state */
   TCB* current = CURTHREAD; 
@@ -541,7 +755,15 @@ void gain(int preempt)
   current->state = RUNNING;
   current->phase = CTX_DIRTY;
 
+  if(current->type != IDLE_THREAD) {
+    TimerDuration now = bios_clock();
+    sched_account_wait(current, now);
+    current->run_since = now;
+  }
+
   if(current != prev) {
+    sched_trace(SCHED_EV_SWITCH, current, 0, 0);
+
   	/* Take care of the previous thread */
     prev->phase = CTX_CLEAN;
     switch(prev->state) 
@@ -561,13 +783,18 @@ void gain(int preempt)
     }
   }
 
+  /* Compute a 1-quantum alarm */
+  TimerDuration quantum = QUANTUM*(current->priority+1);
+  if(current->type == IDLE_THREAD)
+    quantum = sched_idle_timer(quantum);
+
   Mutex_Unlock(& sched_spinlock);
 
   /* Reset preemption as needed */
   if(preempt) preempt_on;
 
-  /* Set a 1-quantum alarm */
-  bios_set_timer(QUANTUM*(current->priority+1));
+  /* Set the alarm */
+  bios_set_timer(quantum);
 }
 
 
@@ -608,14 +835,18 @@ void run_scheduler()
 
   /* Initialize current CCB */
   curcore->id = cpu_core_id;
+  curcore->timeslices = 0;
+  curcore->restart_pending = 0;
 
   curcore->current_thread = & curcore->idle_thread;
 
   curcore->idle_thread.owner_pcb = get_pcb(0);
+  curcore->idle_thread.serial = __atomic_add_fetch(& thread_serial, 1, __ATOMIC_RELAXED);
   curcore->idle_thread.type = IDLE_THREAD;
   curcore->idle_thread.state = RUNNING;
   curcore->idle_thread.phase = CTX_DIRTY;
   curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+  curcore->idle_thread.affinity = 1u << curcore->id;
   rlnode_init(& curcore->idle_thread.sched_node, & curcore->idle_thread);
 
   /* Initialize interrupt handler */
@@ -630,6 +861,7 @@ void run_scheduler()
   assert(CURTHREAD == &CURCORE.idle_thread);
   cpu_interrupt_handler(ALARM, NULL);
   cpu_interrupt_handler(ICI, NULL);
+  pool_drain();
 }
 
 
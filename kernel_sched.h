@@ -21,6 +21,8 @@
   @{
 */
 
+#include <signal.h>
+
 #include "util.h"
 #include "bios.h"
 #include "tinyos.h"
@@ -74,7 +76,8 @@ enum SCHED_CAUSE {
   SCHED_PIPE,     /**< Sleep at a pipe or socket */
   SCHED_POLL,     /**< The thread is polling a device */
   SCHED_IDLE,     /**< The idle thread called yield */
-  SCHED_USER      /**< User-space code called yield */
+  SCHED_USER,     /**< User-space code called yield */
+  SCHED_PREEMPT   /**< A higher-priority thread became ready (via ICI) */
 };
 
 
@@ -89,6 +92,7 @@ typedef struct thread_control_block
 {
   PCB* owner_pcb;       /**< This is null for a free TCB */
   PTCB* owner_ptcb;     /**< node to thread's ptcb */
+  uint64_t serial;      /**< A number of the thread, unlike its TCB never reused */
 
   cpu_context_t context;     /**< The thread context */
 
@@ -104,6 +108,8 @@ typedef struct thread_control_block
   uint8_t mutex_contention;
   uint32_t prev_priority;
 
+  cpu_mask_t affinity;     /**< The cores this thread may run on */
+
   void (*thread_func)();   /**< The function executed by this thread */
 
   TimerDuration wakeup_time; /**< The time this thread will be woken up by the scheduler */
@@ -111,6 +117,13 @@ typedef struct thread_control_block
 
   struct thread_control_block * prev;  /**< previous context */
   struct thread_control_block * next;  /**< next context */
+
+  cpu_usage usage;            /**< CPU accounting, updated with @c sched_spinlock held */
+  TimerDuration ready_since;  /**< When the thread last became ready */
+  TimerDuration run_since;    /**< When the thread last started a timeslice */
+
+  void* tls[MAX_TLS_KEYS];              /**< Thread-local values, by key */
+  unsigned int tls_gen[MAX_TLS_KEYS];   /**< The key generation of each value; stale values read as NULL */
   
 } TCB;
 
@@ -132,13 +145,19 @@ typedef struct thread_control_block
   Per-core info in memory (basically scheduler-related)
  */
 typedef struct core_control_block {
-  uint id;                    /**< The core id */
-
+  /* Hot: used at every pass through the scheduler and the locking code */
   TCB* current_thread;        /**< Points to the thread currently owning the core */
-  TCB idle_thread;            /**< Used by the scheduler to handle the core's idle thread */
   sig_atomic_t preemption;    /**< Marks preemption, used by the locking code */
+  uint32_t timeslices;        /**< Timeslices started on this core since its last boost */
+  uint id;                    /**< The core id */
+  int restart_pending;        /**< Set when the core is restarted for a ready thread, cleared when it next schedules */
 
-} CCB;
+  /* Cold */
+  TCB idle_thread __attribute__((aligned(CACHE_LINE_SIZE))); /**< Used by the scheduler to handle the core's idle thread */
+  void* thread_pool;          /**< Memory of exited threads kept for reuse, linked through its first word */
+  uint thread_pool_size;      /**< The number of blocks in @c thread_pool */
+
+} __attribute__((aligned(CACHE_LINE_SIZE))) CCB;
  
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -167,9 +186,34 @@ extern CCB cctx[MAX_CORES];
 
 /**
   @brief A timeout constant, denoting no timeout for sleep.
+
+  This is also used as a deadline, denoting no deadline.
 */
 #define NO_TIMEOUT ((TimerDuration)-1)
 
+/**
+  @brief Convert a timeout to a deadline.
+
+  A deadline is an absolute time, as returned by @c bios_clock().
+  The conversion maps @c NO_TIMEOUT to @c NO_TIMEOUT.
+
+  @param timeout the timeout in microseconds, or @c NO_TIMEOUT
+  @returns the deadline corresponding to the timeout, starting now
+*/
+static inline TimerDuration timeout_deadline(TimerDuration timeout)
+{
+  return (timeout==NO_TIMEOUT) ? NO_TIMEOUT : bios_clock()+timeout;
+}
+
+
+/**
+  @brief Check if a thread may run on a core.
+*/
+static inline int core_allowed(TCB* tcb, uint core)
+{
+  return (tcb->affinity >> core) & 1;
+}
+
 
 /**
   @brief Create a new thread.
@@ -178,9 +222,21 @@ extern CCB cctx[MAX_CORES];
 	The thread will belong to process @c pcb and execute @c func.
   Note that, the new thread is returned in the @c INIT state.
   The caller must use @c wakeup() to start it.
+  The affinity of the new thread is the default affinity of @c pcb.
 */
 TCB* spawn_thread(PCB* pcb, void (*func)());
 
+/**
+  @brief Change the set of cores a thread may run on.
+
+  If the thread is @c READY, some core that it may run on is notified.
+  A running thread moves at its next pass through the scheduler.
+
+  @param tcb the thread
+  @param mask the new affinity
+*/
+void set_thread_affinity(TCB* tcb, cpu_mask_t mask);
+
 /**
   @brief Wakeup a blocked thread.
 
@@ -226,6 +282,26 @@ int wakeup(TCB* tcb);
    */
 void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
+/** 
+  @brief Block the current thread, until a deadline.
+
+  This call is the same as @c sleep_releasing(), but the timeout is given as
+  an absolute @c deadline on the @c bios_clock(), or @c NO_TIMEOUT. This is useful
+  when a thread may sleep several times for the same timeout.
+
+  If the deadline is in the future, and no core is busy, the thread is woken up close
+  to the deadline (with a resolution of a few microseconds). Else, it is woken up
+  when some core enters the scheduler after the deadline.
+
+  @param newstate the new state for the thread
+  @param mx the mutex to unlock.
+  @param cause the cause of the sleep
+  @param deadline the time to wake up, or @c NO_TIMEOUT 
+  @see sleep_releasing
+  @see timeout_deadline
+*/
+void sleep_releasing_until(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration deadline);
+
 /**
   @brief Give up the CPU.
 
@@ -235,6 +311,17 @@ void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, T
  */
 void yield(enum SCHED_CAUSE cause);
 
+/**
+  @brief Read the CPU usage of a process.
+
+  The usage is copied atomically with respect to the scheduler. It
+  includes the usage of all threads of the process, live or exited.
+
+  @param pcb the process
+  @param usage the location to store the usage into
+*/
+void get_cpu_usage(PCB* pcb, cpu_usage* usage);
+
 /**
   @brief Enter the scheduler.
 
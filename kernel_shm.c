@@ -0,0 +1,124 @@
+
+#include <string.h>
+
+#include "tinyos.h"
+#include "kernel_shm.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+
+
+/* The table of segments, protected by the kernel lock */
+static rlnode shm_table;
+
+void initialize_shm()
+{
+  rlnode_init(& shm_table, NULL);
+}
+
+
+static ShmCB* shm_lookup(const char* name)
+{
+  for(rlnode* n = shm_table.next; n != & shm_table; n = n->next) {
+    ShmCB* shm = n->obj;
+    if(strcmp(shm->name, name) == 0) return shm;
+  }
+  return NULL;
+}
+
+
+/* Closing the last stream of a segment releases it */
+static int shm_close(void* this)
+{
+  ShmCB* shm = this;
+  if(--shm->refcount == 0) {
+    rlist_remove(& shm->node);
+    free(shm->mem);
+    free(shm);
+  }
+  return 0;
+}
+
+static file_ops shm_ops = {
+  .Open = NULL,
+  .Read = NULL,
+  .Write = NULL,
+  .Close = shm_close
+};
+
+
+Fid_t sys_ShmOpen(const char* name, unsigned int size)
+{
+  if(name == NULL || name[0] == '\0' || strlen(name) > MAX_SHM_NAME)
+    return NOFILE;
+
+  ShmCB* shm = shm_lookup(name);
+  if(shm == NULL ? size == 0 : size > shm->mem->size)
+    return NOFILE;
+
+  Fid_t fid;
+  FCB* fcb;
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  if(shm == NULL) {
+    shm = xmalloc(sizeof(ShmCB));
+    strcpy(shm->name, name);
+    shm->refcount = 0;
+    shm->mem = xmalloc(sizeof(shm_header) + size);
+    memset(shm->mem, 0, sizeof(shm_header) + size);
+    shm->mem->size = size;
+    rlnode_init(& shm->node, shm);
+    rlist_push_back(& shm_table, & shm->node);
+  }
+
+  shm->refcount++;
+  fcb->streamobj = shm;
+  fcb->streamfunc = &shm_ops;
+  return fid;
+}
+
+
+static ShmCB* get_shm(Fid_t fid)
+{
+  FCB* fcb = get_fcb(fid);
+  return (fcb != NULL && fcb->streamfunc == &shm_ops) ? fcb->streamobj : NULL;
+}
+
+void* sys_ShmMap(Fid_t fid)
+{
+  ShmCB* shm = get_shm(fid);
+  return shm ? shm->mem + 1 : NULL;
+}
+
+int sys_ShmClose(Fid_t fid)
+{
+  return get_shm(fid) ? sys_Close(fid) : -1;
+}
+
+
+/*
+  These only touch the memory of the segment, so they are not system
+  calls. ShmAlloc is a bump-pointer allocator: it claims memory by a
+  compare-and-swap on the top of the segment.
+ */
+
+#define SHM_ALIGN 16
+
+unsigned int ShmSize(void* shm)
+{
+  return ((shm_header*) shm - 1)->size;
+}
+
+void* ShmAlloc(void* shm, unsigned int size)
+{
+  shm_header* h = (shm_header*) shm - 1;
+  unsigned long need = ((unsigned long)size + SHM_ALIGN - 1) & ~(unsigned long)(SHM_ALIGN - 1);
+
+  unsigned long top = __atomic_load_n(& h->top, __ATOMIC_RELAXED);
+  do {
+    if(need > h->size - top) return NULL;
+  } while(! __atomic_compare_exchange_n(& h->top, &top, top + need, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  return (char*) shm + top;
+}
@@ -0,0 +1,54 @@
+#ifndef __KERNEL_SHM_H
+#define __KERNEL_SHM_H
+
+/**
+  @file kernel_shm.h
+  @brief TinyOS kernel: Shared memory segments.
+
+  @defgroup shm Shared memory
+  @ingroup kernel
+  @brief Shared memory segments.
+
+  All processes run in the same address space, so a segment is simply a
+  block of memory with a name. The kernel keeps a table of the segments
+  by name, and counts the streams that refer to each one.
+
+  The memory of a segment starts with a header, which is used by the
+  allocator of @c ShmAlloc. The address returned by @c ShmMap is right
+  after the header.
+
+  @{
+*/
+
+#include "tinyos.h"
+#include "util.h"
+
+
+/** @brief The header of the memory of a segment. */
+typedef struct shm_header
+{
+  unsigned long top;      /**< The offset of the free memory, changed atomically */
+  unsigned long size;     /**< The size of the segment, without the header */
+} shm_header;
+
+
+/** @brief Shared memory control block. */
+typedef struct shm_control_block
+{
+  char name[MAX_SHM_NAME+1];  /**< The name of the segment */
+  unsigned int refcount;      /**< The number of streams of the segment */
+  shm_header* mem;            /**< The memory of the segment */
+  rlnode node;                /**< Node for the table of segments */
+} ShmCB;
+
+
+/**
+  @brief Initialize the table of shared memory segments.
+
+  This function is called during kernel initialization.
+*/
+void initialize_shm();
+
+/** @} */
+
+#endif
@@ -172,11 +172,45 @@ int socket_close(void* this)
 	return -1;
 }
 
+/*
+	file_ops Poll();
+*/
+int socket_poll(void* this, int events)
+{
+	SCB* scb = (SCB*)this;
+
+	if (scb->type == LISTENER)
+	{
+		/*
+			Accept would not block.
+		*/
+		if (!is_rlist_empty(& scb->socket.req_queue))
+			return events & POLL_READ;
+		return 0;
+	}
+
+	if (scb->type == PEER && scb->socket.peer)
+	{
+		int revents = 0;
+		if (events & POLL_READ)
+			revents |= scb->socket.receive ? pipe_poll(scb->socket.receive, POLL_READ) : POLL_READ;
+		if (events & POLL_WRITE)
+			revents |= scb->socket.send ? pipe_poll(scb->socket.send, POLL_WRITE) : POLL_WRITE;
+		return revents;
+	}
+
+	/*
+		Any I/O fails at once.
+	*/
+	return events;
+}
+
 static file_ops socket_ops = {
   .Open = NULL,
   .Read = socket_read,
   .Write = socket_write,
-  .Close = socket_close
+  .Close = socket_close,
+  .Poll = socket_poll
 };
 
 /*
@@ -436,6 +470,7 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	rlist_push_back(& lsocket->socket.req_queue, &conn_struct->node);
 	/* Wake up listener. */
 	Cond_Signal(& lsocket->socket.reqs_cv);
+	stream_notify();
 
 
 	// 4. Sleep until having answer
@@ -62,15 +62,67 @@ int FCB_decref(FCB* fcb)
 
 
 
+FIDT* FIDT_create()
+{
+  FIDT* fidt = xmalloc(sizeof(FIDT));
+  fidt->refcount = 1;
+  for(int i=0; i<MAX_FILEID; i++)
+    fidt->fcb[i] = NULL;
+  return fidt;
+}
+
+
+FIDT* FIDT_share(FIDT* fidt)
+{
+  fidt->refcount++;
+  return fidt;
+}
+
+
+void FIDT_release(FIDT* fidt)
+{
+  if(--fidt->refcount > 0) return;
+
+  for(int i=0; i<MAX_FILEID; i++)
+    if(fidt->fcb[i] != NULL)
+      FCB_decref(fidt->fcb[i]);
+  free(fidt);
+}
+
+
+/*
+  Return the file table of the current process, for modification.
+  If the table is shared, give the process its own copy first.
+ */
+static FCB** writable_fidt()
+{
+  PCB* cur = CURPROC;
+  FIDT* fidt = cur->fidt;
+
+  if(fidt->refcount > 1) {
+    FIDT* copy = FIDT_create();
+    for(int i=0; i<MAX_FILEID; i++) {
+      copy->fcb[i] = fidt->fcb[i];
+      if(copy->fcb[i]) FCB_incref(copy->fcb[i]);
+    }
+    fidt->refcount--;
+    cur->fidt = fidt = copy;
+  }
+
+  return fidt->fcb;
+}
+
+
+
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 {
-    PCB* cur = CURPROC;
+    FCB** fidt = CURPROC->fidt->fcb;
     size_t f=0;
     uint i;
 
     /* Find distinct fids */
     for(i=0; i<num; i++) {
-	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
+	while(f<MAX_FILEID && fidt[f]!=NULL)
 	    f++;
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
@@ -89,8 +141,9 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	return 0;
     }
     /* Found all */
+    fidt = writable_fidt();
     for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
+	fidt[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
     }
     return 1;
@@ -100,10 +153,10 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
-    PCB* cur = CURPROC;
+    FCB** fidt = writable_fidt();
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
+	assert(fidt[fid[i]]==fcb[i]);
+	fidt[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
 }
@@ -124,7 +177,7 @@ FCB* get_fcb(Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
-  return CURPROC->FIDT[fid];
+  return CURPROC->fidt->fcb[fid];
 }
 
 
@@ -193,6 +246,65 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 }
 
 
+/*
+  Poll waits on a single condition variable, broadcast whenever some
+  stream may have become ready. This is simple, and cheap enough as
+  long as few threads poll at a time.
+ */
+static CondVar poll_cv = COND_INIT;
+static unsigned int pollers = 0;
+
+void stream_notify()
+{
+  if(pollers > 0)
+    kernel_broadcast(& poll_cv);
+}
+
+
+void stream_wait(TimerDuration deadline)
+{
+  pollers++;
+  kernel_wait_until(& poll_cv, SCHED_IO, deadline);
+  pollers--;
+}
+
+
+static int poll_fids(poll_fid* fids, unsigned int n)
+{
+  int ready = 0;
+  for(unsigned int i=0; i<n; i++) {
+    FCB* fcb = get_fcb(fids[i].fid);
+    int events = fids[i].events & (POLL_READ|POLL_WRITE);
+
+    if(fcb == NULL)
+      fids[i].revents = POLL_BADFID;
+    else if(fcb->streamfunc->Poll)
+      fids[i].revents = fcb->streamfunc->Poll(fcb->streamobj, events);
+    else
+      fids[i].revents = events;
+
+    if(fids[i].revents) ready++;
+  }
+  return ready;
+}
+
+
+int sys_Poll(poll_fid* fids, unsigned int n, timeout_t timeout)
+{
+  if(fids == NULL)
+    return -1;
+
+  TimerDuration deadline = (timeout == POLL_FOREVER) 
+    ? NO_TIMEOUT : bios_clock() + 1000ul*timeout;
+
+  int ready;
+  while((ready = poll_fids(fids, n)) == 0 && bios_clock() < deadline)
+    stream_wait(deadline);
+
+  return ready;
+}
+
+
 int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
@@ -200,7 +312,7 @@ int sys_Close(int fd)
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+    writable_fidt()[fd] = NULL;
     retcode = FCB_decref(fcb);    
   }
 
@@ -228,10 +340,12 @@ int sys_Dup2(int oldfd, int newfd)
     retcode = -1;
   }
   else if(old!=new) {
+    /* Unshare the table first, as it holds the reference to new */
+    FCB** fidt = writable_fidt();
     if(new)
       FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    fidt[newfd] = old;
   }
 
   return retcode;
@@ -281,3 +395,18 @@ Fid_t sys_OpenTerminal(unsigned int termno)
   return open_stream(DEV_SERIAL, termno);
 }
 
+
+Fid_t sys_OpenConsole()
+{
+  return open_stream(DEV_CONSOLE, 0);
+}
+
+
+int sys_IsTerminal(Fid_t fid)
+{
+  FCB* fcb = get_fcb(fid);
+  if(fcb == NULL) return 0;
+  Device_type major = device_type(fcb->streamfunc);
+  return major == DEV_SERIAL || major == DEV_CONSOLE;
+}
+
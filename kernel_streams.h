@@ -23,6 +23,10 @@
 	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve
 	and @ref FCB_unreserve.
 
+	A new process shares the file table of its parent, until either
+	process changes its table (copy-on-write). Thus, @c Exec does not
+	need to copy the table.
+
 	Streams are connected to devices by virtue of a @c file_operations
 	object, which provides pointers to device-specific implementations
 	for read, write and close.
@@ -48,6 +52,45 @@ typedef struct file_control_block
 
 
 
+/** @brief A file id table.
+
+	The table maps the file ids of a process to FCBs. It may be shared by
+	several processes, and it holds one reference to each of its FCBs, no
+	matter how many processes share it. A shared table is never modified;
+	instead, a process that changes it first makes its own copy.
+ */
+typedef struct file_id_table
+{
+  uint refcount;            /**< @brief The number of processes sharing the table. */
+  FCB* fcb[MAX_FILEID];     /**< @brief The FCB of each fid, or NULL. */
+} FIDT;
+
+
+/** @brief Create an empty file id table.
+
+	@returns a new table, with a reference count of 1.
+ */
+FIDT* FIDT_create();
+
+
+/** @brief Share a file id table with another process.
+
+	@param fidt the table to share
+	@returns @c fidt, after increasing its reference count.
+ */
+FIDT* FIDT_share(FIDT* fidt);
+
+
+/** @brief Release a process's reference to a file id table.
+
+	When the last reference is released, every FCB in the table
+	is released too, and the table is freed.
+
+	@param fidt the table to release
+ */
+void FIDT_release(FIDT* fidt);
+
+
 /** 
   @brief Initialization for files and streams.
 
@@ -128,6 +171,21 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Wake up the threads blocked in @c Poll.
+
+	Stream objects call this when they become ready for I/O. It 
+	is cheap when nobody is polling.
+ */
+void stream_notify();
+
+
+/** @brief Wait for a call to @c stream_notify, or until the deadline.
+
+	The caller re-checks its streams after this returns.
+ */
+void stream_wait(TimerDuration deadline);
+
+
 /** @} */
 
 #endif
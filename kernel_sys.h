@@ -9,25 +9,46 @@ SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
 SYSCALLV(Exit, (int exitval), (exitval))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
+SYSCALL(AtExit, int, (void (*handler)(void)), (handler))\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(SetAffinity, int, (Tid_t tid, cpu_mask_t mask), (tid, mask))\
+SYSCALL(TlsAlloc, TlsKey_t, (void (*destructor)(void*)), (destructor))\
+SYSCALL(TlsAllocGlobal, TlsKey_t, (void (*destructor)(void*)), (destructor))\
+SYSCALL(TlsFree, int, (TlsKey_t key), (key))\
+SYSCALL(SubmitTask, TaskId_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(WaitTask, int, (TaskId_t task, int* retval), (task, retval))\
+SYSCALL(WaitAll, int, (), ())\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
+SYSCALL(OpenConsole, Fid_t, (), ())\
+SYSCALL(IsTerminal, int, (Fid_t fid), (fid))\
 SYSCALL(OpenNull, Fid_t, (), ())\
 SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL(Poll, int, (poll_fid* fids, unsigned int n, timeout_t timeout), (fids, n, timeout))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(Channel, int, (pipe_t* ends, unsigned int capacity), (ends, capacity))\
+SYSCALL(MsgAlloc, void*, (unsigned int size), (size))\
+SYSCALLV(MsgFree, (void* msg), (msg))\
+SYSCALL(SendBatch, int, (Fid_t fid, void** msgs, unsigned int n), (fid, msgs, n))\
+SYSCALL(RecvBatch, int, (Fid_t fid, void** msgs, unsigned int n), (fid, msgs, n))\
+SYSCALL(ShmOpen, Fid_t, (const char* name, unsigned int size), (name, size))\
+SYSCALL(ShmMap, void*, (Fid_t fid), (fid))\
+SYSCALL(ShmClose, int, (Fid_t fid), (fid))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL(IoRingSetup, io_ring*, (unsigned int entries), (entries))\
+SYSCALL(IoRingEnter, int, (unsigned int min_complete, timeout_t timeout), (min_complete, timeout))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
 
 
@@ -0,0 +1,273 @@
+
+#include <assert.h>
+
+#include "tinyos.h"
+#include "kernel_cc.h"
+#include "kernel_proc.h"
+#include "kernel_tasks.h"
+
+/*
+  Task pools.
+
+  Every function here is called with the kernel lock held, except for
+  the worker threads, which take it themselves.
+ */
+
+
+/* Return the index of the current thread among the workers, or -1 */
+static int current_worker(Executor* ex)
+{
+  for(unsigned int w=0; w<ex->nworkers; w++)
+    if(ex->worker[w].tid == get_tid(CURPTHREAD)) return w;
+  return -1;
+}
+
+
+/*
+  Take a task for worker w: the newest of its own queue, else the
+  oldest of another queue. Return NULL if all queues are empty.
+ */
+static TaskCB* take_task(Executor* ex, int w)
+{
+  if(! is_rlist_empty(& ex->worker[w].queue))
+    return rlist_pop_back(& ex->worker[w].queue)->obj;
+
+  for(unsigned int i=1; i<ex->nworkers; i++) {
+    rlnode* victim = & ex->worker[(w+i) % ex->nworkers].queue;
+    if(! is_rlist_empty(victim))
+      return rlist_pop_front(victim)->obj;
+  }
+  return NULL;
+}
+
+
+/* Execute a task, releasing the kernel lock while it runs */
+static void run_task(Executor* ex, TaskCB* t)
+{
+  t->state = TASK_RUNNING;
+
+  kernel_unlock();
+  int retval = t->task(t->argl, t->args);
+  kernel_lock();
+
+  t->retval = retval;
+  t->state = TASK_DONE;
+  rlist_push_back(& ex->done, & t->node);
+  if(t->waiters > 0)
+    kernel_broadcast(& t->finished);
+
+  if(--ex->pending == 0)
+    kernel_broadcast(& ex->all_done);
+}
+
+
+static void release_task(Executor* ex, TaskCB* t)
+{
+  assert(t->state == TASK_DONE);
+  t->state = TASK_FREE;
+  t->gen++;
+  rlist_remove(& t->node);
+  rlist_push_front(& ex->free, & t->node);
+}
+
+
+/* The id of a task. The index is offset by one, so that no id is NOTASK. */
+static inline TaskId_t get_taskid(TaskCB* t)
+{
+  return ((TaskId_t) t->gen << TASK_GEN_SHIFT) | (t->index + 1);
+}
+
+/* Return the TaskCB of an id, or NULL if the id is not of this pool, or stale */
+static TaskCB* get_task(Executor* ex, TaskId_t id)
+{
+  TaskId_t index = (id & (((TaskId_t)1 << TASK_GEN_SHIFT) - 1)) - 1;
+  if(index >= ex->ntasks) return NULL;
+
+  TaskCB* t = ex->tasks[index];
+  return (t->gen == (unsigned int)(id >> TASK_GEN_SHIFT)) ? t : NULL;
+}
+
+
+/* The function of the worker threads */
+static int task_worker(int w, void* args)
+{
+  Executor* ex = args;
+
+  kernel_lock();
+  for(;;) {
+    TaskCB* t = take_task(ex, w);
+    if(t != NULL)
+      run_task(ex, t);
+    else if(ex->shutdown)
+      break;
+    else
+      kernel_wait(& ex->work, SCHED_USER);
+  }
+  kernel_unlock();
+
+  return 0;
+}
+
+
+static Executor* create_executor(PCB* pcb)
+{
+  Executor* ex = xmalloc(sizeof(Executor));
+  ex->nworkers = cpu_cores();
+  ex->next = 0;
+  ex->pending = 0;
+  ex->shutdown = 0;
+  ex->work = COND_INIT;
+  ex->all_done = COND_INIT;
+  rlnode_init(& ex->done, NULL);
+  rlnode_init(& ex->free, NULL);
+  ex->tasks = NULL;
+  ex->ntasks = ex->capacity = 0;
+
+  for(unsigned int w=0; w<ex->nworkers; w++)
+    rlnode_init(& ex->worker[w].queue, NULL);
+
+  /* The workers may run at once, so set up everything first */
+  pcb->executor = ex;
+  for(unsigned int w=0; w<ex->nworkers; w++)
+    ex->worker[w].tid = sys_CreateThread(task_worker, w, ex);
+
+  return ex;
+}
+
+
+void shutdown_executor(PCB* pcb)
+{
+  Executor* ex = pcb->executor;
+  if(ex == NULL) return;
+
+  ex->shutdown = 1;
+  kernel_broadcast(& ex->work);
+
+  /* A task that calls Exit cannot join its own worker */
+  for(unsigned int w=0; w<ex->nworkers; w++)
+    if(ex->worker[w].tid != get_tid(CURPTHREAD))
+      sys_ThreadJoin(ex->worker[w].tid, NULL);
+}
+
+
+void free_executor(PCB* pcb)
+{
+  Executor* ex = pcb->executor;
+  if(ex == NULL) return;
+
+  /* Tasks may be left queued or running, if a task called Exit */
+  for(unsigned int i=0; i<ex->ntasks; i++)
+    free(ex->tasks[i]);
+  free(ex->tasks);
+
+  free(ex);
+  pcb->executor = NULL;
+}
+
+
+TaskId_t sys_SubmitTask(Task task, int argl, void* args)
+{
+  if(task == NULL)
+    return NOTASK;
+
+  PCB* pcb = CURPROC;
+  Executor* ex = pcb->executor;
+  if(ex == NULL)
+    ex = create_executor(pcb);
+
+  /* Get a TaskCB */
+  TaskCB* t;
+  if(! is_rlist_empty(& ex->free))
+    t = rlist_pop_front(& ex->free)->obj;
+  else {
+    t = xmalloc(sizeof(TaskCB));
+    t->executor = ex;
+    t->gen = 0;
+    t->finished = COND_INIT;
+    rlnode_init(& t->node, t);
+
+    if(ex->ntasks == ex->capacity) {
+      ex->capacity = (ex->capacity == 0) ? 16 : 2*ex->capacity;
+      ex->tasks = xrealloc(ex->tasks, ex->capacity * sizeof(TaskCB*));
+    }
+    t->index = ex->ntasks;
+    ex->tasks[ex->ntasks++] = t;
+  }
+
+  t->state = TASK_QUEUED;
+  t->task = task;
+  t->argl = argl;
+  t->args = args;
+  t->waiters = 0;
+
+  /* Workers push to their own queue, others spread the tasks */
+  int w = current_worker(ex);
+  if(w < 0) {
+    w = ex->next;
+    ex->next = (ex->next + 1) % ex->nworkers;
+  }
+  rlist_push_back(& ex->worker[w].queue, & t->node);
+  ex->pending++;
+
+  kernel_signal(& ex->work);
+
+  return get_taskid(t);
+}
+
+
+int sys_WaitTask(TaskId_t task, int* retval)
+{
+  Executor* ex = CURPROC->executor;
+  if(ex == NULL)
+    return -1;
+
+  TaskCB* t = get_task(ex, task);
+  if(t == NULL || t->state == TASK_FREE)
+    return -1;
+
+  /* A worker helps with other tasks, instead of blocking its queue */
+  int w = current_worker(ex);
+
+  t->waiters++;
+  while(t->state != TASK_DONE) {
+    TaskCB* other = (w >= 0) ? take_task(ex, w) : NULL;
+    if(other != NULL)
+      run_task(ex, other);
+    else
+      kernel_wait(& t->finished, SCHED_USER);
+  }
+  t->waiters--;
+
+  if(retval) *retval = t->retval;
+
+  /* The last waiter releases the task */
+  if(t->waiters == 0)
+    release_task(ex, t);
+  return 0;
+}
+
+
+int sys_WaitAll()
+{
+  Executor* ex = CURPROC->executor;
+  if(ex == NULL)
+    return 0;
+
+  /* A task would wait for itself */
+  if(current_worker(ex) >= 0)
+    return -1;
+
+  while(ex->pending > 0)
+    kernel_wait(& ex->all_done, SCHED_USER);
+
+  /* Release the finished tasks that nobody waits for */
+  rlnode* node = ex->done.next;
+  while(node != & ex->done) {
+    TaskCB* t = node->obj;
+    node = node->next;
+    if(t->waiters == 0)
+      release_task(ex, t);
+  }
+
+  return 0;
+}
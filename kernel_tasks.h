@@ -0,0 +1,115 @@
+#ifndef __KERNEL_TASKS_H
+#define __KERNEL_TASKS_H
+
+/**
+  @file kernel_tasks.h
+  @brief TinyOS kernel: Task pools.
+
+  @defgroup tasks Task pools
+  @ingroup kernel
+  @brief Task pools.
+
+  Each process may have a task pool (an executor), created by its first
+  @c SubmitTask. The pool has a fixed set of worker threads, one per core,
+  which are normal threads of the process. Each worker has a queue of
+  tasks; a worker takes tasks from the back of its own queue (the newest,
+  whose data are likely in the cache) and, when it runs out, from the
+  front of the queues of other workers (the oldest).
+
+  All pool data are protected by the kernel lock. Tasks run without it.
+
+  The TaskCBs of a pool are kept in a table and reused. A task id holds
+  the index of its TaskCB and the generation of the TaskCB, which changes
+  every time the TaskCB is reused, so that a stale id is rejected.
+
+  @{
+*/
+
+#include "tinyos.h"
+#include "kernel_sched.h"
+
+
+/** @brief The state of a task. */
+typedef enum {
+  TASK_FREE,      /**< The TaskCB is unused */
+  TASK_QUEUED,    /**< The task is in a worker queue */
+  TASK_RUNNING,   /**< The task is being executed by a worker */
+  TASK_DONE       /**< The task has returned, but has not been waited for */
+} task_state;
+
+
+/** @brief Task control block. */
+typedef struct task_control_block
+{
+  struct task_executor* executor;  /**< The pool of the task */
+  task_state state;     /**< The state of the task */
+  unsigned int index;   /**< The index of the TaskCB in the table of the pool */
+  unsigned int gen;     /**< Incremented every time the TaskCB is released */
+
+  Task task;            /**< The function of the task */
+  int argl;             /**< The argument length */
+  void* args;           /**< The argument */
+  int retval;           /**< The return value, when done */
+
+  int waiters;          /**< The threads in @c WaitTask for this task */
+  CondVar finished;     /**< Signalled when the task is done */
+
+  rlnode node;          /**< Node for a worker queue, the done list or the free list */
+} TaskCB;
+
+
+/** @brief A worker of a task pool. */
+typedef struct task_worker
+{
+  Tid_t tid;            /**< The thread of the worker */
+  rlnode queue;         /**< The tasks queued for this worker, oldest first */
+} TaskWorker;
+
+
+/** @brief A task pool. */
+typedef struct task_executor
+{
+  unsigned int nworkers;        /**< The number of workers */
+  TaskWorker worker[MAX_CORES]; /**< The workers */
+  unsigned int next;            /**< The worker for the next task from a non-worker */
+
+  unsigned int pending;         /**< Tasks submitted and not yet done */
+  int shutdown;                 /**< Set when the workers should exit */
+
+  CondVar work;                 /**< Idle workers wait here */
+  CondVar all_done;             /**< Signalled when @c pending becomes 0 */
+
+  rlnode done;                  /**< Done tasks, not yet waited for */
+  rlnode free;                  /**< Unused TaskCBs */
+
+  TaskCB** tasks;               /**< All the TaskCBs, indexed by TaskCB::index */
+  unsigned int ntasks;          /**< The number of TaskCBs */
+  unsigned int capacity;        /**< The size of @c tasks */
+} Executor;
+
+
+/** @brief The position of the generation in a task id. */
+#define TASK_GEN_SHIFT 32
+
+_Static_assert(sizeof(TaskId_t) == 8, "TaskId_t must have room for a generation tag");
+
+
+/**
+  @brief Stop the task pool of a process.
+
+  This is called when the process exits. The workers execute any
+  queued tasks and exit, and the caller joins them.
+*/
+void shutdown_executor(PCB* pcb);
+
+/**
+  @brief Free the task pool of a process.
+
+  This is called after @c shutdown_executor.
+*/
+void free_executor(PCB* pcb);
+
+
+/** @} */
+
+#endif
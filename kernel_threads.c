@@ -1,8 +1,11 @@
 
+#include <assert.h>
 #include "tinyos.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
 #include "kernel_cc.h"
+#include "kernel_tasks.h"
+#include "kernel_ioring.h"
 
 void start_thread_func();
 
@@ -11,7 +14,11 @@ void start_thread_func();
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
-  PTCB* ptcb = Create_PTCB(CURPROC);
+  if(task == NULL)
+    return NOTHREAD;
+
+  PCB* pcb = CURPROC;
+  PTCB* ptcb = Create_PTCB(pcb);
 
   /* Set the thread's function */
   ptcb->main_task = task;
@@ -20,25 +27,16 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   ptcb->args = args;
 
   // Spawn thread
-  if(task != NULL)
-  { 
-    ptcb->thread = spawn_thread(CURPROC, start_thread_func);
-    ptcb->thread->owner_ptcb = ptcb;     // Link thread to its PTCB
-    
-    Mutex_Lock(&CURPROC->thread_mx);
-    rlist_push_back(& CURPROC->ptcb_list, & ptcb->pthread);     // Add PThread to parent PCB's list
-    ptcb->owner_pcb->thread_count++;
-    Mutex_Unlock(&CURPROC->thread_mx);
-
-    wakeup(ptcb->thread);         // If everything is done, wakeup the thread
-  }
-  else
-  {
-    free(ptcb);
-    return NOTHREAD;
-  }
+  ptcb->thread = spawn_thread(pcb, start_thread_func);
+  ptcb->thread->owner_ptcb = ptcb;     // Link thread to its PTCB
+
+  rlist_push_back(& pcb->ptcb_list, & ptcb->pthread);     // Add PThread to parent PCB's list
+  pcb->thread_count++;
+  pcb->live_threads++;
+
+  wakeup(ptcb->thread);         // If everything is done, wakeup the thread
 
-	return (Tid_t) ptcb->thread;    // NOT current thread.
+	return get_tid(ptcb);    // NOT current thread.
 }
 
 /**
@@ -46,7 +44,44 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
  */
 Tid_t sys_ThreadSelf()
 {
-	return (Tid_t) CURTHREAD;
+	return get_tid(CURPTHREAD);
+}
+
+/**
+  @brief Set the affinity of a thread, or the default of the process.
+  */
+int sys_SetAffinity(Tid_t tid, cpu_mask_t mask)
+{
+  /* The mask must contain some existing core */
+  cpu_mask_t cores = (cpu_cores() < 32) ? (1u << cpu_cores()) - 1 : ALL_CORES;
+  if((mask & cores) == 0)
+    return -1;
+
+  if(tid == NOTHREAD) {
+    CURPROC->affinity = mask;
+    return 0;
+  }
+
+  PTCB* ptcb = get_ptcb(tid);
+
+  // stale tid, thread not belonging to process, or exited
+  if(ptcb == NULL || ptcb->owner_pcb != CURPROC || ptcb->exited)
+    return -1;
+
+  set_thread_affinity(ptcb->thread, mask);
+  return 0;
+}
+
+/*
+  Keep an exited PTCB for reuse. A new generation makes its tid stale.
+ */
+static void release_PTCB(PCB* pcb, PTCB* ptcb)
+{
+  assert(ptcb->exited && ptcb->waiting_threads == 0);
+  ptcb->gen = (ptcb->gen + 1) % TID_GENERATIONS;
+  rlist_remove(& ptcb->pthread);
+  rlist_push_front(& pcb->ptcb_free, & ptcb->pthread);
+  pcb->thread_count--;
 }
 
 /**
@@ -54,52 +89,37 @@ Tid_t sys_ThreadSelf()
   */
 int sys_ThreadJoin(Tid_t tid, int* exitval)
 {  
-  // If thread doesn't exist.
-  if(tid == NOTHREAD)
-    return -1;
-
   // local copy for speed reasons
   PCB* process = CURPROC;
-  PTCB* ptcb = ((TCB*)tid)->owner_ptcb;
+  PTCB* ptcb = get_ptcb(tid);
   
-  // thread not belonging to proccess
-  if (((TCB*)tid)->owner_pcb != process)
-  // if (rlist_find(& process->ptcb_list, (void*)tid, (rlnode*)0))
+  // If thread doesn't exist, or not belonging to proccess
+  if (ptcb == NULL || ptcb->owner_pcb != process)
     return -1;
   
-  // can't join current or main threads
-  if ((TCB*)tid == CURTHREAD || (TCB*)tid == process->main_thread->thread)
-    return -1;
-
-  // can't join detached thread but the main thread to be able too
-  if (ptcb->detached == 1 && (TCB*)tid != process->main_thread->thread)
+  // can't join current or main threads, or detached threads
+  if (ptcb == CURPTHREAD || ptcb == process->main_thread || ptcb->detached)
     return -1;
   
+  // Wait for the thread to exit, or to be detached
   ptcb->waiting_threads++;
-  
-  // Wake up the thread so that he can join us
-  Cond_Broadcast(& ptcb->waiting);
-  kernel_wait(&ptcb->thread_join, SCHED_USER);
-  
-  // Make sure exitval is saved.
-  if(exitval != NULL)
-    *exitval = ptcb->exitval; 
-
-  // Updated counter.
+  while(!ptcb->exited && !ptcb->detached)
+    kernel_wait(&ptcb->thread_join, SCHED_USER);
   ptcb->waiting_threads--; 
 
-  if (ptcb->waiting_threads == 0)
-  {
-    Mutex_Lock(&CURPROC->thread_mx);
-    
-    process->thread_count--;
-    rlist_remove(& ptcb->pthread);
-    free(ptcb);
-
-    Mutex_Unlock(&CURPROC->thread_mx);
+  int retcode = -1;
+  if(!ptcb->detached) {
+    // Make sure exitval is saved.
+    if(exitval != NULL)
+      *exitval = ptcb->exitval; 
+    retcode = 0;
   }
 
-  return 0;
+  // The last joiner releases the PTCB
+  if (ptcb->exited && ptcb->waiting_threads == 0)
+    release_PTCB(process, ptcb);
+
+  return retcode;
 }
 
 /**
@@ -107,14 +127,10 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   */
 int sys_ThreadDetach(Tid_t tid)
 {
-  // thread doesn't exist
-  if( tid == NOTHREAD)
-    return -1;
-
-  PTCB* ptcb = ((TCB*)tid)->owner_ptcb;
+  PTCB* ptcb = get_ptcb(tid);
 
-  // thread is EXITED
-  if( ((TCB*)tid)->state == EXITED)
+  // thread doesn't exist, not belonging to process, or EXITED
+  if(ptcb == NULL || ptcb->owner_pcb != CURPROC || ptcb->exited)
     return -1;
   
   ptcb->detached = 1;
@@ -122,66 +138,175 @@ int sys_ThreadDetach(Tid_t tid)
   // Check for joined threads and wake them up
   if (ptcb->waiting_threads > 0)
   { 
-    Cond_Broadcast(& ptcb->thread_join);    // Wake up threads.
+    kernel_broadcast(& ptcb->thread_join);    // Wake up threads.
   }
 
 	return 0;
 }
 
+/*
+  Thread-local storage.
+
+  A key is allocated while its generation is odd. The value of a thread
+  for a key is valid if it was set in the current generation of the key,
+  so freeing a key discards all values at once.
+
+  A key belongs to the process that allocated it, and is freed when that
+  process exits. Global keys have no owner.
+ */
+static struct {
+  unsigned int gen;
+  void (*destructor)(void*);
+  PCB* owner;
+} tls_keys[MAX_TLS_KEYS];
+
+static TlsKey_t tls_alloc(void (*destructor)(void*), PCB* owner)
+{
+  for(TlsKey_t key=0; key<MAX_TLS_KEYS; key++)
+    if((tls_keys[key].gen & 1) == 0) {
+      tls_keys[key].destructor = destructor;
+      tls_keys[key].owner = owner;
+      __atomic_store_n(& tls_keys[key].gen, tls_keys[key].gen+1, __ATOMIC_RELEASE);
+      return key;
+    }
+  return NOTLSKEY;
+}
+
+TlsKey_t sys_TlsAlloc(void (*destructor)(void*))
+{
+  return tls_alloc(destructor, CURPROC);
+}
+
+TlsKey_t sys_TlsAllocGlobal(void (*destructor)(void*))
+{
+  return tls_alloc(destructor, NULL);
+}
+
+int sys_TlsFree(TlsKey_t key)
+{
+  if(key >= MAX_TLS_KEYS || (tls_keys[key].gen & 1) == 0)
+    return -1;
+  __atomic_store_n(& tls_keys[key].gen, tls_keys[key].gen+1, __ATOMIC_RELEASE);
+  tls_keys[key].destructor = NULL;
+  tls_keys[key].owner = NULL;
+  return 0;
+}
+
+void release_tls_keys(PCB* pcb)
+{
+  for(TlsKey_t key=0; key<MAX_TLS_KEYS; key++)
+    if((tls_keys[key].gen & 1) && tls_keys[key].owner == pcb)
+      sys_TlsFree(key);
+}
+
+/* 
+  The current thread, read without preemption, so that it does not migrate
+  between reading the core and reading its current thread. 
+ */
+static inline TCB* tls_thread()
+{
+  int preempt = preempt_off;
+  TCB* tcb = CURTHREAD;
+  if(preempt) preempt_on;
+  return tcb;
+}
+
+/* TlsGet and TlsSet only access the current thread, so they are not system calls */
+void* TlsGet(TlsKey_t key)
+{
+  if(key >= MAX_TLS_KEYS) return NULL;
+  unsigned int gen = __atomic_load_n(& tls_keys[key].gen, __ATOMIC_ACQUIRE);
+  TCB* tcb = tls_thread();
+  return ((gen & 1) && tcb->tls_gen[key] == gen) ? tcb->tls[key] : NULL;
+}
+
+int TlsSet(TlsKey_t key, void* value)
+{
+  if(key >= MAX_TLS_KEYS) return -1;
+  unsigned int gen = __atomic_load_n(& tls_keys[key].gen, __ATOMIC_ACQUIRE);
+  if((gen & 1) == 0) return -1;
+  TCB* tcb = tls_thread();
+  tcb->tls[key] = value;
+  tcb->tls_gen[key] = gen;
+  return 0;
+}
+
+/* Call the destructors of the current thread's values, without the kernel lock */
+void run_tls_destructors()
+{
+  TCB* tcb = CURTHREAD;
+  for(int iter=0; iter<TLS_DESTRUCTOR_ITERATIONS; iter++) {
+    int called = 0;
+    for(TlsKey_t key=0; key<MAX_TLS_KEYS; key++) {
+      unsigned int gen = tls_keys[key].gen;
+      void (*destructor)(void*) = tls_keys[key].destructor;
+      void* value = tcb->tls[key];
+      if((gen & 1) && tcb->tls_gen[key] == gen && value != NULL && destructor != NULL) {
+        tcb->tls[key] = NULL;
+        kernel_unlock();
+        destructor(value);
+        kernel_lock();
+        called = 1;
+      }
+    }
+    if(!called) break;
+  }
+}
+
 /**
   @brief Terminate the current thread. 
 
-  If it's the main thread, first wait all other threads to finish their Task. 
-  Then free its PTCB and finally Exit() the process.
+  If it's the main thread, first wait for all other threads to exit, 
+  then free the PTCBs of the process. The caller then calls Exit().
 
-  Otherwise, save exitval in PTCB, broadcast all threads waiting on this thread,
-  free PTCB after, set thread status as EXITED and release the kernel.
+  Otherwise, save exitval in PTCB, wake up any threads joining this thread, 
+  and set thread status as EXITED. The PTCB is kept until the thread is
+  joined, unless it is detached.
   */
 void sys_ThreadExit(int exitval)
 {
+  run_tls_destructors();
+
   // local copy for speed reasons
   PCB* pcb = CURPROC;
   PTCB* ptcb = CURPTHREAD;
 
   /* --- If main_thread --- */
-  if(CURTHREAD == pcb->main_thread->thread)
+  if(ptcb == pcb->main_thread)
   { 
-    // Wait for all threads to finish their task.
-    while(!is_rlist_empty(&pcb->ptcb_list))
-    { 
-      // Pick first thread from list.
-      PTCB* ptcb_i = pcb->ptcb_list.next->ptcb;
-      TCB* tcb_i = ptcb_i->thread;
-      
-      // Wait thread_i to finish.
-      sys_ThreadJoin( (Tid_t) tcb_i, NULL);
-    }
-    /* All threads should be exited by now */
+    // Let the task pool workers finish and exit.
+    shutdown_executor(pcb);
+    shutdown_ioring(pcb);
+
+    // Wait for all threads to exit.
+    while(pcb->live_threads > 0)
+      kernel_wait(& pcb->threads_exited, SCHED_USER);
+
+    /* All threads have exited, and none is joining: free the PTCBs */
+    while(!is_rlist_empty(& pcb->ptcb_list))
+      free(rlist_pop_front(& pcb->ptcb_list)->ptcb);
+    while(!is_rlist_empty(& pcb->ptcb_free))
+      free(rlist_pop_front(& pcb->ptcb_free)->ptcb);
+    pcb->thread_count = 1;
+
+    free_executor(pcb);
+    free_ioring(pcb);
   }
   else /* --- If NOT main_thread --- */
   { 
-    //@TODO what if the thread was detached?
-    /* Save exitval in PTCB. */
+    /* Publish the exit value */
     ptcb->exitval = exitval;
+    ptcb->exited = 1;
+    ptcb->thread = NULL;
+    CURTHREAD->owner_ptcb = NULL;
 
-    if (ptcb->detached)
-    {  
-      pcb->thread_count--;
-      rlist_remove(& ptcb->pthread);
-      free(ptcb);
-
-      // goodbye cruel world
-      kernel_sleep(EXITED, SCHED_USER);
-    }
-
-    // If noone is waiting or us lets wait for them
-    if (ptcb->waiting_threads == 0)
-    {
-      kernel_wait(&ptcb->waiting, SCHED_USER);
-    }
+    if (ptcb->waiting_threads > 0)
+      kernel_broadcast(& ptcb->thread_join);
+    else if (ptcb->detached)
+      release_PTCB(pcb, ptcb);
 
-    /* sets thread as detached while also waking up any joined threads.*/
-    sys_ThreadDetach((Tid_t) CURTHREAD);
+    if (--pcb->live_threads == 0)
+      kernel_broadcast(& pcb->threads_exited);
 
     // goodbye cruel world
     kernel_sleep(EXITED, SCHED_USER);
@@ -205,14 +330,21 @@ void start_thread_func()
 
 PTCB* Create_PTCB(PCB* pcb)
 {
-
-  PTCB* ptcb = (PTCB*)malloc(sizeof(PTCB));               // Allocate memory
-  CHECK((ptcb==NULL)?-1:0);
+  PTCB* ptcb;
+  unsigned int gen = 0;
+  if(!is_rlist_empty(& pcb->ptcb_free)) {
+    ptcb = rlist_pop_front(& pcb->ptcb_free)->ptcb;       // Reuse
+    gen = ptcb->gen;
+  }
+  else {
+    ptcb = (PTCB*)malloc(sizeof(PTCB));                   // Allocate memory
+    CHECK((ptcb==NULL)?-1:0);
+  }
   memset(ptcb, 0, sizeof(PTCB));
+  ptcb->gen = gen;
 
   ptcb->owner_pcb = pcb;
-  ptcb->waiting = COND_INIT;                              // Init CondVar
-  ptcb->thread_join = COND_INIT;                          
+  ptcb->thread_join = COND_INIT;                          // Init CondVar
 
   rlnode_init(& ptcb->pthread, ptcb);                     // Init rlNode
 
@@ -0,0 +1,114 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "kernel_trace.h"
+#include "kernel_proc.h"
+
+
+/*
+  The ring of each core. Only the owning core writes to it, so the
+  count is advanced with a release store, for the benefit of readers
+  on other host threads. Rings are kept on separate cache lines, like
+  the CCBs.
+ */
+typedef struct sched_trace_ring {
+  sched_trace_event* events;
+  uint64_t count;               /* Events ever recorded */
+} __attribute__((aligned(CACHE_LINE_SIZE))) sched_trace_ring;
+
+static sched_trace_ring trace_ring[MAX_CORES];
+
+/* The size of each ring, a power of 2, or 0 when tracing is disabled */
+static size_t trace_size = 0;
+
+int sched_trace_on = 0;
+
+
+void sched_trace_record(sched_event_type type, TCB* tcb, int cause, uint32_t arg)
+{
+  sched_trace_ring* ring = & trace_ring[cpu_core_id];
+
+  /* Not allocated yet, during boot */
+  if(ring->events == NULL) return;
+
+  uint64_t count = ring->count;
+  sched_trace_event* ev = & ring->events[count & (trace_size-1)];
+
+  ev->time = bios_clock();
+  ev->tid = tcb ? tcb->serial : 0;
+  ev->pid = (tcb && tcb->owner_pcb) ? get_pid(tcb->owner_pcb) : NOPROC;
+  ev->type = type;
+  ev->cause = cause;
+  ev->priority = tcb ? tcb->priority : 0;
+  ev->core = cpu_core_id;
+  ev->arg = arg;
+  ev->reserved = 0;
+
+  __atomic_store_n(& ring->count, count+1, __ATOMIC_RELEASE);
+}
+
+
+void sched_trace_enable(size_t events)
+{
+  sched_trace_disable();
+
+  size_t size = 1;
+  while(size < events) size <<= 1;
+  trace_size = size;
+  sched_trace_on = 1;
+}
+
+
+void initialize_sched_trace()
+{
+  if(trace_size == 0) return;
+
+  sched_trace_ring* ring = & trace_ring[cpu_core_id];
+  ring->events = xmalloc(trace_size * sizeof(sched_trace_event));
+  memset(ring->events, 0, trace_size * sizeof(sched_trace_event));
+  ring->count = 0;
+}
+
+
+void sched_trace_disable()
+{
+  sched_trace_on = 0;
+  for(int c=0; c<MAX_CORES; c++) {
+    free(trace_ring[c].events);
+    trace_ring[c].events = NULL;
+    trace_ring[c].count = 0;
+  }
+  trace_size = 0;
+}
+
+
+int sched_trace_dump(const char* filename)
+{
+  FILE* f = fopen(filename, "wb");
+  if(f == NULL) return -1;
+
+  uint32_t ncores = 0;
+  while(ncores < MAX_CORES && trace_ring[ncores].events != NULL) ncores++;
+
+  sched_trace_header hdr = { .magic = SCHED_TRACE_MAGIC, .version = SCHED_TRACE_VERSION, .ncores = ncores };
+  int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+
+  for(uint32_t c=0; ok && c<ncores; c++) {
+    sched_trace_ring* ring = & trace_ring[c];
+    uint64_t count = __atomic_load_n(& ring->count, __ATOMIC_ACQUIRE);
+
+    /* Only the last trace_size events are still in the ring */
+    uint64_t first = (count > trace_size) ? count - trace_size : 0;
+    uint64_t n = count - first;
+    ok = fwrite(&n, sizeof(n), 1, f) == 1;
+
+    for(uint64_t i=first; ok && i<count; i++)
+      ok = fwrite(& ring->events[i & (trace_size-1)], sizeof(sched_trace_event), 1, f) == 1;
+  }
+
+  if(fclose(f) != 0) ok = 0;
+  return ok ? 0 : -1;
+}
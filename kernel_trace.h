@@ -0,0 +1,144 @@
+#ifndef __KERNEL_TRACE_H
+#define __KERNEL_TRACE_H
+
+/**
+  @file kernel_trace.h
+  @brief TinyOS kernel: Scheduler tracing.
+
+  @defgroup trace Scheduler tracing
+  @ingroup kernel
+  @brief Scheduler tracing.
+
+  When tracing is enabled, the scheduler records its events (context
+  switches, wakeups, sleeps, priority changes, boosts, timeouts and
+  mutex contention) into a ring buffer per core. Each ring is written
+  only by its own core, with preemption off, so recording needs no locks.
+  When a ring is full, the oldest events are overwritten.
+
+  When tracing is disabled, each hook costs one test of a global flag.
+
+  Tracing is normally enabled by setting the environment variable
+  @c TINYOS_SCHED_TRACE to a file name. Then, @c boot() enables tracing
+  before the machine boots, and dumps the trace into the file after
+  the machine shuts down. The @c sched_trace tool converts the dump into
+  JSON for the Chrome trace viewer (chrome://tracing) or Perfetto, showing
+  a timeline for every thread.
+
+  The dump is a @c sched_trace_header, followed by, for each core, a
+  @c uint64_t count and that many @c sched_trace_event records in
+  chronological order.
+
+  @{
+*/
+
+#include <stdint.h>
+
+#include "kernel_sched.h"
+
+
+/** @brief The types of scheduler events. */
+typedef enum {
+  SCHED_EV_SWITCH,    /**< A thread started a timeslice on the core (in @c gain) */
+  SCHED_EV_YIELD,     /**< A thread entered the scheduler; @c cause is the @c SCHED_CAUSE */
+  SCHED_EV_SLEEP,     /**< A thread went to sleep; @c arg is 1 if it has a timeout */
+  SCHED_EV_WAKEUP,    /**< A thread was made ready by @c wakeup() */
+  SCHED_EV_PRIORITY,  /**< The priority of a thread changed; @c arg is the old priority */
+  SCHED_EV_BOOST,     /**< The scheduler queues were boosted; @c arg is the threads moved */
+  SCHED_EV_TIMEOUT,   /**< The timeout of a sleeping thread expired */
+  SCHED_EV_MUTEX      /**< A thread yielded on a contended mutex */
+} sched_event_type;
+
+
+/** @brief A recorded scheduler event. */
+typedef struct sched_trace_event {
+  TimerDuration time;   /**< The time of the event, by @c bios_clock() */
+  uint64_t tid;         /**< The serial number of the thread, or 0 */
+  int32_t pid;          /**< The process of the thread, or @c NOPROC */
+  uint8_t type;         /**< A @c sched_event_type */
+  uint8_t cause;        /**< A @c SCHED_CAUSE, for @c SCHED_EV_YIELD and @c SCHED_EV_SLEEP */
+  uint8_t priority;     /**< The priority of the thread, after the event */
+  uint8_t core;         /**< The core that recorded the event */
+  uint32_t arg;         /**< Depends on the type */
+  uint32_t reserved;
+} sched_trace_event;
+
+
+/** @brief The magic string of a dump. */
+#define SCHED_TRACE_MAGIC "TINYTRC"
+
+/** @brief The version of the dump format. Version 1 recorded TCB addresses as tids. */
+#define SCHED_TRACE_VERSION 2
+
+/** @brief The header of a dump. */
+typedef struct sched_trace_header {
+  char magic[8];        /**< @c SCHED_TRACE_MAGIC */
+  uint32_t version;     /**< Currently @c SCHED_TRACE_VERSION */
+  uint32_t ncores;      /**< The number of cores that follow */
+} sched_trace_header;
+
+
+/** @brief The default size of each core's ring, in events. */
+#define SCHED_TRACE_EVENTS (1<<16)
+
+
+/** @brief Nonzero when tracing is enabled. Do not modify directly. */
+extern int sched_trace_on;
+
+/**
+  @brief Record an event.
+
+  This is called via @c sched_trace(), with preemption off.
+*/
+void sched_trace_record(sched_event_type type, TCB* tcb, int cause, uint32_t arg);
+
+/**
+  @brief Record an event, if tracing is enabled.
+
+  @param type the type of event
+  @param tcb the thread of the event, or NULL
+  @param cause the cause, or 0
+  @param arg a type-specific argument
+*/
+static inline void sched_trace(sched_event_type type, TCB* tcb, int cause, uint32_t arg)
+{
+  if(__builtin_expect(sched_trace_on, 0))
+    sched_trace_record(type, tcb, cause, arg);
+}
+
+
+/**
+  @brief Enable tracing.
+
+  This must be called while the machine is not running. Any previous
+  trace is discarded.
+
+  @param events the size of each core's ring, rounded up to a power of 2
+*/
+void sched_trace_enable(size_t events);
+
+/**
+  @brief Allocate the ring of the current core.
+
+  This is called by each core at boot, so that each ring is first
+  touched by the core that writes it. If tracing is not enabled, it
+  does nothing.
+*/
+void initialize_sched_trace();
+
+/**
+  @brief Disable tracing and free the trace.
+*/
+void sched_trace_disable();
+
+/**
+  @brief Write the trace of the last run to a file.
+
+  @param filename the file to write
+  @returns 0 on success and -1 on error
+*/
+int sched_trace_dump(const char* filename);
+
+
+/** @} */
+
+#endif
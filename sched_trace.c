@@ -0,0 +1,209 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "util.h"
+#include "kernel_trace.h"
+
+/**
+	@file sched_trace.c
+
+	@brief Convert a scheduler trace into the Chrome trace format.
+
+	The input is a dump written by @c sched_trace_dump(), e.g., by running
+	a program with the environment variable @c TINYOS_SCHED_TRACE set.
+	The output is a JSON file which can be loaded into chrome://tracing
+	or https://ui.perfetto.dev.
+
+	Each tinyos process is shown as a process and each thread as a
+	thread. The intervals where a thread runs on some core are shown
+	as slices; the other scheduler events are shown as instants on the
+	timeline of their thread. Boosts are shown as global instants.
+
+	Usage: sched_trace <trace file> [<json file>]
+ */
+
+
+static const char* cause_name[] = {
+	[SCHED_QUANTUM] = "quantum",
+	[SCHED_IO] = "io",
+	[SCHED_MUTEX] = "mutex",
+	[SCHED_PIPE] = "pipe",
+	[SCHED_POLL] = "poll",
+	[SCHED_IDLE] = "idle",
+	[SCHED_USER] = "user",
+	[SCHED_PREEMPT] = "preempt"
+};
+
+static const char* event_name[] = {
+	[SCHED_EV_SWITCH] = "switch",
+	[SCHED_EV_YIELD] = "yield",
+	[SCHED_EV_SLEEP] = "sleep",
+	[SCHED_EV_WAKEUP] = "wakeup",
+	[SCHED_EV_PRIORITY] = "priority",
+	[SCHED_EV_BOOST] = "boost",
+	[SCHED_EV_TIMEOUT] = "timeout",
+	[SCHED_EV_MUTEX] = "mutex contention"
+};
+
+static const char* cause_str(int cause)
+{
+	return (cause < (int)(sizeof(cause_name)/sizeof(cause_name[0]))) ? cause_name[cause] : "?";
+}
+
+
+/*
+	Threads are identified by their serial number, which is never reused,
+	and belong to a process. Each thread gets a small id for the output.
+ */
+typedef struct thread_info {
+	uint64_t tid;
+	int32_t pid;
+} thread_info;
+
+static thread_info* threads = NULL;
+static size_t nthreads = 0, maxthreads = 0;
+
+static size_t thread_id(uint64_t tid, int32_t pid)
+{
+	for(size_t i=0; i<nthreads; i++)
+		if(threads[i].tid == tid) return i+1;
+
+	if(nthreads == maxthreads) {
+		maxthreads = maxthreads ? 2*maxthreads : 64;
+		threads = realloc(threads, maxthreads*sizeof(thread_info));
+		if(threads == NULL) FATAL("Out of memory");
+	}
+	threads[nthreads] = (thread_info){ .tid = tid, .pid = pid };
+	return ++nthreads;
+}
+
+
+static FILE* out;
+static int first_event = 1;
+
+static void begin_event()
+{
+	fputs(first_event ? "\n" : ",\n", out);
+	first_event = 0;
+}
+
+/* A running interval of a thread, except for idle threads */
+static void emit_slice(sched_trace_event* sw, TimerDuration end)
+{
+	if(sw->pid <= 0) return;
+	begin_event();
+	fprintf(out, "{\"name\":\"running\",\"ph\":\"X\",\"pid\":%d,\"tid\":%zu,"
+		"\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"args\":{\"core\":%d,\"priority\":%d}}",
+		sw->pid, thread_id(sw->tid, sw->pid), (uint64_t)sw->time, (uint64_t)(end - sw->time),
+		sw->core, sw->priority);
+}
+
+static void emit_instant(sched_trace_event* ev)
+{
+	begin_event();
+	if(ev->type == SCHED_EV_BOOST) {
+		fprintf(out, "{\"name\":\"boost\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":0,"
+			"\"ts\":%" PRIu64 ",\"args\":{\"core\":%d,\"moved\":%u}}",
+			(uint64_t)ev->time, ev->core, ev->arg);
+		return;
+	}
+
+	fprintf(out, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%zu,"
+		"\"ts\":%" PRIu64 ",\"args\":{\"core\":%d,\"priority\":%d",
+		event_name[ev->type], ev->pid, thread_id(ev->tid, ev->pid), (uint64_t)ev->time,
+		ev->core, ev->priority);
+
+	switch(ev->type) {
+		case SCHED_EV_YIELD:
+		case SCHED_EV_MUTEX:
+			fprintf(out, ",\"cause\":\"%s\"", cause_str(ev->cause));
+			break;
+		case SCHED_EV_SLEEP:
+			fprintf(out, ",\"cause\":\"%s\",\"timeout\":%s", cause_str(ev->cause),
+				ev->arg ? "true" : "false");
+			break;
+		case SCHED_EV_PRIORITY:
+			fprintf(out, ",\"old_priority\":%u", ev->arg);
+			break;
+		default:
+			break;
+	}
+	fputs("}}", out);
+}
+
+
+int main(int argc, char** argv)
+{
+	if(argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s <trace file> [<json file>]\n", argv[0]);
+		return 1;
+	}
+
+	FILE* in = fopen(argv[1], "rb");
+	if(in == NULL) { perror(argv[1]); return 1; }
+
+	sched_trace_header hdr;
+	if(fread(&hdr, sizeof(hdr), 1, in) != 1
+		|| memcmp(hdr.magic, SCHED_TRACE_MAGIC, sizeof(hdr.magic)) != 0
+		|| hdr.version != SCHED_TRACE_VERSION || hdr.ncores > MAX_CORES) {
+		fprintf(stderr, "%s: not a scheduler trace\n", argv[1]);
+		return 1;
+	}
+
+	out = stdout;
+	if(argc == 3 && (out = fopen(argv[2], "w")) == NULL) { perror(argv[2]); return 1; }
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", out);
+
+	uint64_t total = 0;
+	for(uint32_t c=0; c<hdr.ncores; c++) {
+		uint64_t n;
+		if(fread(&n, sizeof(n), 1, in) != 1) FATAL("Truncated trace");
+
+		/* The thread running on this core, since its switch event */
+		sched_trace_event running;
+		int have_running = 0;
+		TimerDuration last = 0;
+
+		for(uint64_t i=0; i<n; i++) {
+			sched_trace_event ev;
+			if(fread(&ev, sizeof(ev), 1, in) != 1) FATAL("Truncated trace");
+			last = ev.time;
+
+			if(ev.type == SCHED_EV_SWITCH) {
+				if(have_running) emit_slice(&running, ev.time);
+				running = ev;
+				have_running = 1;
+			} else if(ev.type < sizeof(event_name)/sizeof(event_name[0])) {
+				emit_instant(&ev);
+			}
+		}
+		if(have_running) emit_slice(&running, last);
+		total += n;
+	}
+	fclose(in);
+
+	/* Name the tracks */
+	for(size_t i=0; i<nthreads; i++) {
+		begin_event();
+		fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%zu,"
+			"\"args\":{\"name\":\"thread %" PRIu64 "\"}}", threads[i].pid, i+1, threads[i].tid);
+	}
+	for(size_t i=0; i<nthreads; i++) {
+		int seen = 0;
+		for(size_t j=0; j<i; j++) seen |= threads[j].pid == threads[i].pid;
+		if(seen) continue;
+		begin_event();
+		fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"args\":{\"name\":\"process %d\"}}", threads[i].pid, threads[i].pid);
+	}
+
+	fputs("\n]}\n", out);
+	if(out != stdout) fclose(out);
+
+	fprintf(stderr, "%" PRIu64 " events, %zu threads\n", total, nthreads);
+	return 0;
+}
@@ -29,7 +29,34 @@ void adjust_symposium(symposium_t* symp, int dBASE, int dGAP)
   to "burn" CPU cycles. The complexity of the routine is exponential in n.
 */
 
-int fiborand(int fmin, int fmax) { return lrand48() % (fmax-fmin+1) + fmin; }
+/* Each thread has its own random generator state, to avoid the lock of lrand48() */
+static TlsKey_t rand_key = NOTLSKEY;
+static Mutex rand_key_mx = MUTEX_INIT;
+
+static unsigned short* rand_state()
+{
+  if(rand_key == NOTLSKEY) {
+    Mutex_Lock(&rand_key_mx);
+    if(rand_key == NOTLSKEY) rand_key = TlsAllocGlobal(free);
+    Mutex_Unlock(&rand_key_mx);
+    if(rand_key == NOTLSKEY) return NULL;
+  }
+
+  unsigned short* xsubi = TlsGet(rand_key);
+  if(xsubi == NULL) {
+    xsubi = xmalloc(3*sizeof(unsigned short));
+    long seed = lrand48();
+    memcpy(xsubi, &seed, 3*sizeof(unsigned short));
+    TlsSet(rand_key, xsubi);
+  }
+  return xsubi;
+}
+
+int fiborand(int fmin, int fmax) 
+{ 
+  unsigned short* xsubi = rand_state();
+  return (xsubi ? nrand48(xsubi) : lrand48()) % (fmax-fmin+1) + fmin; 
+}
 unsigned int fibo(unsigned int n) /* Very slow routine */
 {
   if(n<2) return n;
@@ -151,20 +178,26 @@ void SymposiumTable_destroy(SymposiumTable* table)
 
 
 
-typedef struct { int i; SymposiumTable* S; } philosopher_args;
+typedef struct { int i; Fid_t shm; } philosopher_args;
 
 /* Philosopher process */
 int PhilosopherProcess(int argl, void* args)
 {
 	assert(argl == sizeof(philosopher_args));
 	philosopher_args* A = args;
-	SymposiumTable_philosopher(A->S, A->i);
+
+	/* The table is the first object of the segment */
+	SymposiumTable* S = ShmMap(A->shm);
+	assert(S != NULL);
+	SymposiumTable_philosopher(S, A->i);
 	return 0;
 }
 
 
 /*
   This process executes a "symposium" for a number of philosophers.
+  The philosophers are processes, which share the symposium table
+  through a shared memory segment.
  */
 int SymposiumOfProcesses(int argl, void* args)
 {
@@ -172,15 +205,31 @@ int SymposiumOfProcesses(int argl, void* args)
   symposium_t* symp = args;
   int N = symp->N;
 
-  /* Initialize structures */
-  SymposiumTable S;
-  SymposiumTable_init(&S, symp);
-  
-  /* Execute philosophers */
+  /* Place the table in a new segment */
+  char name[MAX_SHM_NAME+1];
+  snprintf(name, sizeof(name), "symposium.%d", GetPid());
+  unsigned int size = 4*16 + sizeof(SymposiumTable) + sizeof(symposium_t)
+    + N*(sizeof(PHIL)+sizeof(CondVar));
+  Fid_t shm = ShmOpen(name, size);
+  if(shm == NOFILE) return 1;
+
+  void* mem = ShmMap(shm);
+  SymposiumTable* S = ShmAlloc(mem, sizeof(SymposiumTable));
+  S->mx = MUTEX_INIT;
+  S->symp = ShmAlloc(mem, sizeof(symposium_t));
+  *S->symp = *symp;
+  S->state = ShmAlloc(mem, N*sizeof(PHIL));
+  S->hungry = ShmAlloc(mem, N*sizeof(CondVar));
+  for(int i=0; i<N; i++) {
+    S->state[i] = NOTHERE;
+    S->hungry[i] = COND_INIT;
+  }
+
+  /* Execute philosophers, who inherit the segment */
   for(int i=0;i<N;i++) {
     philosopher_args Args;
     Args.i = i;
-    Args.S = &S;
+    Args.shm = shm;
     Exec(PhilosopherProcess, sizeof(Args), &Args);
   }  
 
@@ -189,7 +238,7 @@ int SymposiumOfProcesses(int argl, void* args)
     WaitChild(NOPROC, NULL);
   }
 
-  SymposiumTable_destroy(&S);
+  ShmClose(shm);
   return 0;
 }
 
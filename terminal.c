@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <error.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 /* 
 	Tests that there is still input to the terminal. 
@@ -18,87 +19,178 @@ int INPUT_OPEN=1;
 
 
 int confd, kbdfd;  /* The pipe file descriptors */
+int infd, outfd;   /* Our own descriptors for stdin and stdout */
 
-/* Polling array */
-struct pollfd fds[4] = {
-	{ 0, POLLIN, 0 },
-	{ 1, POLLOUT, 0 },
-	{ 0, POLLOUT, 0 },
-	{ 0, POLLIN, 0 },
-};
-
-/* some operations on the polling  array */
-
-/* Flip/negate fd field; poll ignores negative fds */
-#define flip(i) (fds[i].fd = - fds[i].fd - 1)
-#define ready(i)  (fds[i].revents & fds[i].events)
-#define err(i)  (fds[i].revents & (POLLERR|POLLHUP))
-#define polled(i)  (fds[i].fd>=0)
-
-int state[4];  /* Last poll result */
-int errst[4];  /* Whether error was detected */
-
-/* Mnemonic macros */
-#define IN state[0]
-#define OUT state[1]
-#define KBD state[2]
-#define CON state[3]
-
-#define INERR errst[0]
-#define OUTERR errst[1]
-#define KBDERR errst[2]
-#define CONERR errst[3]
-
-/* Helper */
-void transfer_byte(int from, int to, int fromfd, int tofd)
+
+/*
+	A relay moves data from one descriptor to another, in chunks.
+
+	When splicing is possible (one of the two is a pipe), the kernel
+	moves the data directly. Else, data is read into a ring buffer
+	and written out from it, so that partial writes keep the rest.
+	All descriptors are non-blocking, so a relay never stalls the
+	other one.
+*/
+#define RELAY_BUFFER (64*1024)
+
+typedef struct relay {
+	int from, to;        /* The descriptors */
+	int splice;          /* Try splice, until it fails with EINVAL */
+	int eof;             /* Set when 'from' is at end of file */
+	int blocked;         /* Set when 'to' refused a splice */
+	size_t head, count;  /* The data in 'buf' */
+	char buf[RELAY_BUFFER];
+} relay;
+
+relay kbd, con;
+
+
+static int is_pipe(int fd)
 {
-	int rc;
-	char buf;
-	rc=read(fromfd, &buf, 1);
-	if(rc==1) rc=write(tofd, &buf, 1);
-#if EXIT_ON_STDIN_CLOSE
-	if(rc==0) { 
-		assert(fromfd==0); 
-		if(! isatty(0)) { 
-			INPUT_OPEN=0; close(0); 
+	struct stat st;
+	return fstat(fd, &st)==0 && S_ISFIFO(st.st_mode);
+}
+
+void relay_init(relay* r, int from, int to)
+{
+	r->from = from;
+	r->to = to;
+	r->splice = is_pipe(from) || is_pipe(to);
+	r->eof = 0;
+	r->blocked = 0;
+	r->head = r->count = 0;
+}
+
+/* The poll events of the two descriptors of a relay */
+int relay_in_events(relay* r)
+{
+	return (!r->eof && !r->blocked && r->count < RELAY_BUFFER) ? POLLIN : 0;
+}
+
+int relay_out_events(relay* r)
+{
+	return (r->count > 0 || r->blocked) ? POLLOUT : 0;
+}
+
+/* Nothing more to do */
+int relay_done(relay* r)
+{
+	return r->eof && r->count==0;
+}
+
+/* Write out as much of the buffer as 'to' accepts. Return -1 on error. */
+int relay_flush(relay* r)
+{
+	r->blocked = 0;
+	while(r->count > 0) {
+		size_t n = r->count;
+		if(r->head + n > RELAY_BUFFER) n = RELAY_BUFFER - r->head;
+
+		ssize_t rc = write(r->to, r->buf + r->head, n);
+		if(rc==-1) 
+			return (errno==EAGAIN || errno==EINTR) ? 0 : -1;
+
+		r->head = (r->head + rc) % RELAY_BUFFER;
+		r->count -= rc;
+	}
+	r->head = 0;
+	return 0;
+}
+
+/* Bring in data from 'from'. Return -1 on error. */
+int relay_fill(relay* r)
+{
+	ssize_t rc;
+
+	/* Splicing is only done when there is nothing buffered */
+	if(r->splice && r->count==0) {
+		rc = splice(r->from, NULL, r->to, NULL, RELAY_BUFFER, 
+			SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if(rc > 0) return 0;
+		if(rc==0) { r->eof = 1; return 0; }
+		if(errno==EINVAL) 
+			r->splice = 0;     /* Not supported here, copy instead */
+		else if(errno==EAGAIN) {
+			r->blocked = 1;    /* 'from' was ready, so 'to' is full */
+			return 0;
 		}
-		fprintf(stderr, "Stdin closed\n"); 
+		else 
+			return (errno==EINTR) ? 0 : -1;
 	}
-#endif
-	flip(from); flip(to);  /* They are not ready any more */	
+
+	size_t tail = (r->head + r->count) % RELAY_BUFFER;
+	size_t n = RELAY_BUFFER - r->count;
+	if(tail + n > RELAY_BUFFER) n = RELAY_BUFFER - tail;
+
+	rc = read(r->from, r->buf + tail, n);
+	if(rc > 0) r->count += rc;
+	else if(rc==0) r->eof = 1;
+	else if(errno!=EAGAIN && errno!=EINTR) return -1;
+	return 0;
+}
+
+
+/* Polling array */
+struct pollfd fds[4];
+
+#define IN 0
+#define OUT 1
+#define KBD 2
+#define CON 3
+
+/* Poll 'fd' for 'events', or skip it */
+static void set_poll(int i, int fd, int events)
+{
+	fds[i].fd = events ? fd : -1;
+	fds[i].events = events;
+	fds[i].revents = 0;
 }
+#define ready(i)  (fds[i].revents & (fds[i].events|POLLERR|POLLHUP))
+
 
-/* Loop transferring bytes between the streams */
+/* Loop transferring data between the streams */
 void io_loop()
 {
-	/* acquire fds */
-	fds[2].fd = kbdfd;
-	fds[3].fd = confd;
-
-	while(1) {
-		/* Poll the files */
-		poll(fds, 4, -1);
-
-		/* Update indicators */
-		for(int i=0; i<4; i++) {
-			if(polled(i)) { 
-				state[i]=ready(i);  
-				if(state[i]) flip(i);  /* Flip ready files */
-				errst[i]=err(i); 
-			}
+	relay_init(&kbd, infd, kbdfd);
+	relay_init(&con, confd, outfd);
+
+	/* The console is done when the peer closes it, and the keyboard
+	   when the peer does not read any more. */
+	while(! relay_done(&con)) {
+		set_poll(IN, infd, relay_in_events(&kbd));
+		set_poll(OUT, outfd, relay_out_events(&con));
+		set_poll(CON, confd, relay_in_events(&con));
+		/* Always poll kbdfd, to see the peer closing */
+		set_poll(KBD, kbdfd, relay_out_events(&kbd));
+		fds[KBD].fd = kbdfd;
+
+		if(poll(fds, 4, -1)==-1) {
+			if(errno==EINTR) continue;
+			error(1, errno, "poll");
 		}
-		if(errst[0]) fprintf(stderr,"Error in 0\n");
-		if(errst[1]) fprintf(stderr,"Error in 1\n");
 
-		int XKBD = IN && KBD;
-		int XCON = OUT && CON;
+		if(fds[KBD].revents & POLLERR) break;
 
-		/* Break if we have no transfers and some error */
-		if(!XKBD && !XCON && (KBDERR||CONERR)) break;
+		/* Flush first, to make room for new data */
+		if(ready(OUT) && relay_flush(&con)==-1) 
+			error(1, errno, "writing to stdout");
+		if(ready(KBD) && relay_flush(&kbd)==-1) 
+			break;
 
-		/* Do ready transfers */
-		if( XKBD ) transfer_byte(0, 2, 0, kbdfd);
-		if( XCON ) transfer_byte(3, 1, confd, 1);
+		if(ready(CON) && relay_fill(&con)==-1)
+			error(1, errno, "relaying the console");
+		if(ready(IN)) {
+			if(relay_fill(&kbd)==-1) {
+				if(errno==EPIPE) break;
+				error(1, errno, "reading from stdin");
+			}
+			if(kbd.eof) {
+#if EXIT_ON_STDIN_CLOSE
+				if(! isatty(0)) INPUT_OPEN=0;
+#endif
+				fprintf(stderr, "Stdin closed\n"); 
+			}
+		}
 	}
 
 	close(confd);
@@ -113,15 +205,40 @@ const char* connected = "\033[5;40;1;37m   *** CONNECTED ***   \033[0m\n";
 int open_pipe(const char* fname, int flags) {
 	int fd = open(fname, flags);
 	if(fd==-1) 	error(1, errno, "opening %s", fname);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 	return fd;
 }
 
+/*
+	Get a non-blocking descriptor for stdin or stdout. Setting O_NONBLOCK
+	on fd 0 or 1 would also affect the shell that started us, so the
+	file is opened anew, unless it is a regular file (whose offset
+	must be kept, and which never blocks anyway).
+*/
+int open_std(int fd, int flags)
+{
+	struct stat st;
+	int newfd = -1;
+	if(fstat(fd, &st)==-1) error(1, errno, "fstat(%d)", fd);
+	if(! S_ISREG(st.st_mode)) {
+		char fname[32];
+		sprintf(fname, "/proc/self/fd/%d", fd);
+		newfd = open(fname, flags|O_NONBLOCK);
+	}
+	if(newfd==-1) newfd = dup(fd);
+	if(newfd==-1) error(1, errno, "dup(%d)", fd);
+	return newfd;
+}
+
 void mainloop(char* arg)
 {
 	char confname[10], kbdfname[10];
 	sprintf(confname, "con%s", arg);
 	sprintf(kbdfname, "kbd%s", arg);
 
+	infd = open_std(0, O_RDONLY);
+	outfd = open_std(1, O_WRONLY);
+
 	/* We close and re-open on every disconnect, in order to
 	   sleep */
 
@@ -144,8 +261,8 @@ int main(int argc, char** argv)
 {
 	if(argc!=2 || strlen(argv[1])!=1 || argv[1][0]<'0' || argv[1][0]>'3')
 		usage();
-	//signal(SIGPIPE, SIG_IGN);
+	/* A closed peer is seen as EPIPE */
+	signal(SIGPIPE, SIG_IGN);
 	mainloop(argv[1]);
 	return -1;  /* Does not return */
 }
-
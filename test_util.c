@@ -4,7 +4,10 @@
 #include <string.h>
 #include <time.h>
 #include <setjmp.h>
+#include <unistd.h>
 #include "util.h"
+#include "tinyos.h"
+#include "kernel_trace.h"
 
 #include "unit_testing.h"
 
@@ -131,6 +134,7 @@ BARE_TEST(test_list_queue,
 		I++;
 	}
 
+	ASSERT(I==n+10);
 	ASSERT(is_rlist_empty(&L));
 
 	I = rlist_pop_back(&L);   /* The list is empty, but the pop_back method does not mind! */
@@ -544,12 +548,88 @@ TEST_SUITE(exception_tests,
 
 
 
+/*****************************************************
+ *
+ *  Tests for the scheduler trace
+ *
+ ******************************************************/
+
+static int trace_worker(int argl, void* args)
+{
+	return argl;
+}
+
+/* Each thread exits before the next one starts, so TCBs are reused */
+static int trace_boot_task(int argl, void* args)
+{
+	for(int i=0; i<argl; i++)
+		ThreadJoin(CreateThread(trace_worker, i, NULL), NULL);
+	return 0;
+}
+
+BARE_TEST(test_sched_trace,
+	"Test that a scheduler trace has a valid header and a distinct tid for each thread, although TCBs are reused."
+	)
+{
+	const int nworkers = 10;
+	char fname[] = "/tmp/tinyos_trace_XXXXXX";
+	int fd = mkstemp(fname);
+	assert(fd >= 0);
+	close(fd);
+
+	setenv("TINYOS_SCHED_TRACE", fname, 1);
+	boot(2, 0, trace_boot_task, nworkers, NULL);
+	unsetenv("TINYOS_SCHED_TRACE");
+
+	FILE* f = fopen(fname, "rb");
+	assert(f != NULL);
+	unlink(fname);
+
+	sched_trace_header hdr;
+	ASSERT(fread(&hdr, sizeof(hdr), 1, f) == 1);
+	ASSERT(memcmp(hdr.magic, SCHED_TRACE_MAGIC, sizeof(hdr.magic)) == 0);
+	ASSERT(hdr.version == SCHED_TRACE_VERSION);
+	ASSERT(hdr.ncores == 2);
+
+	/* Collect the threads that ran in the boot process, pid 1 */
+	uint64_t tids[64];
+	int ntids = 0;
+	for(uint32_t c=0; c<hdr.ncores; c++) {
+		uint64_t n;
+		ASSERT(fread(&n, sizeof(n), 1, f) == 1);
+		ASSERT(n > 0);
+
+		TimerDuration last = 0;
+		for(uint64_t i=0; i<n; i++) {
+			sched_trace_event ev;
+			assert(fread(&ev, sizeof(ev), 1, f) == 1);
+			ASSERT(ev.core == c);
+			ASSERT(ev.time >= last);
+			last = ev.time;
+
+			if(ev.type != SCHED_EV_SWITCH || ev.pid != 1) continue;
+			ASSERT(ev.tid != 0);
+			int k = 0;
+			while(k < ntids && tids[k] != ev.tid) k++;
+			if(k == ntids && ntids < 64) tids[ntids++] = ev.tid;
+		}
+	}
+	ASSERT(fgetc(f) == EOF);
+	fclose(f);
+
+	/* The main thread and the workers */
+	ASSERT(ntids == nworkers+1);
+}
+
+
+
 TEST_SUITE(all_tests,
 	"All tests")
 {
 	&rlist_tests,
 	&test_pack_unpack,
 	&exception_tests,	
+	&test_sched_trace,
 	NULL
 };
 
@@ -25,6 +25,10 @@
 
 /**
   @brief The type of a process ID.
+
+  PIDs are non-negative. The PID of a process that has been cleaned up
+  is not reused by the next processes; instead, PIDs grow with
+  each reuse of the same process slot, and eventually wrap around.
   */
 typedef int Pid_t;		/* The PID type  */
 
@@ -39,7 +43,7 @@ typedef unsigned long timeout_t;
 /** @brief The invalid PID */
 #define NOPROC (-1)
 
-/** @brief The maximum number of processes */
+/** @brief The maximum number of processes that can exist at the same time */
 #define MAX_PROC 65536
 
 /** @brief The type of a file ID. */
@@ -61,6 +65,39 @@ typedef uintptr_t Tid_t;
 /** @brief The invalid thread ID */
 #define NOTHREAD ((Tid_t)0)
 
+/**
+  @brief The type of a thread-local storage key.
+
+  @see TlsAlloc
+  */
+typedef unsigned int TlsKey_t;
+
+/** @brief The invalid TLS key */
+#define NOTLSKEY ((TlsKey_t)-1)
+
+/** @brief The maximum number of TLS keys */
+#define MAX_TLS_KEYS 32
+
+/**
+  @brief The type of a task ID.
+
+  @see SubmitTask
+  */
+typedef uintptr_t TaskId_t;
+
+/** @brief The invalid task ID */
+#define NOTASK ((TaskId_t)0)
+
+/**
+  @brief A set of cores, as a bitmask. 
+
+  Core @c c is in the set if bit @c c is set.
+  */
+typedef uint32_t cpu_mask_t;
+
+/** @brief The set of all cores */
+#define ALL_CORES ((cpu_mask_t)-1)
+
 
 /*******************************************
  *      Concurrency control
@@ -291,6 +328,23 @@ Pid_t GetPid(void);
  */
 Pid_t GetPPid(void);
 
+/** @brief The maximum number of exit handlers of a process. */
+#define MAX_EXIT_HANDLERS 8
+
+/** @brief Register a function to be called when the current process exits.
+
+  The handlers are called by @c Exit, in the reverse order of their 
+  registration, after the thread-local storage destructors of the exiting
+  thread and before the file ids of the process are closed. When the 
+  process ends by returning from its main task, its other threads have
+  exited by then.
+
+  @param handler the function to call
+  @returns 0 on success, or -1 if @c handler is NULL or the process has
+    @c MAX_EXIT_HANDLERS handlers already.
+  */
+int AtExit(void (*handler)(void));
+
 /*******************************************
  *
  * Threads
@@ -373,6 +427,153 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/**
+  @brief Set the cores a thread may run on.
+
+  The thread with the given tid will only be scheduled on the
+  cores in @c mask. If the thread is running on some other core,
+  it moves the next time it is scheduled (e.g., when its quantum
+  expires or it blocks).
+
+  If @c tid is @c NOTHREAD, the default mask of the current process
+  is set instead. The default mask is given to threads created 
+  later by the process, and is inherited by child processes 
+  created with @c Exec. The default mask of the init process
+  is @c ALL_CORES.
+
+  Bits of @c mask for cores that do not exist are ignored.
+
+  @param tid the thread, or @c NOTHREAD for the current process
+  @param mask the set of cores
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the mask contains no existing core.
+  */
+int SetAffinity(Tid_t tid, cpu_mask_t mask);
+
+
+/**
+  @brief Allocate a thread-local storage key.
+
+  Each thread has a value for each key, initially NULL, which is read
+  and written by @c TlsGet and @c TlsSet. The key is valid in all 
+  processes, since processes share the static data of programs.
+
+  The key is freed when the current process exits, if it has not been
+  freed before. Keys kept in static variables, which outlive the process,
+  should be allocated by @c TlsAllocGlobal.
+
+  When a thread with a non-NULL value for the key calls @c ThreadExit
+  (or returns from its task), the value is set to NULL and 
+  @c destructor(value) is called, if @c destructor is not NULL.
+  If the destructors set new values, this is repeated, up to 
+  @c TLS_DESTRUCTOR_ITERATIONS times.
+
+  @param destructor a function to call for the value at thread exit, or NULL
+  @returns a new key, or @c NOTLSKEY if all @c MAX_TLS_KEYS keys are in use.
+  */
+TlsKey_t TlsAlloc(void (*destructor)(void*));
+
+/**
+  @brief Allocate a thread-local storage key that belongs to no process.
+
+  This is like @c TlsAlloc, but the key is not freed when the current
+  process exits. It is meant for library code that keeps the key in a
+  static variable, for the threads of all processes.
+
+  @see TlsAlloc
+  */
+TlsKey_t TlsAllocGlobal(void (*destructor)(void*));
+
+/** @brief The number of times destructors are called at thread exit. */
+#define TLS_DESTRUCTOR_ITERATIONS 4
+
+/**
+  @brief Release a thread-local storage key.
+
+  The values of all threads for the key are discarded, without calling
+  the destructor. 
+
+  @returns 0 on success, or -1 if the key is not allocated.
+  */
+int TlsFree(TlsKey_t key);
+
+/**
+  @brief Return the value of the current thread for a key.
+
+  This call does not take any lock.
+
+  @returns the value, or NULL if the key is not allocated.
+  */
+void* TlsGet(TlsKey_t key);
+
+/**
+  @brief Set the value of the current thread for a key.
+
+  This call does not take any lock.
+
+  @returns 0 on success, or -1 if the key is not allocated.
+  */
+int TlsSet(TlsKey_t key, void* value);
+
+
+/**
+  @brief Submit a task to the task pool of the current process.
+
+  The task will be executed by one of a fixed set of worker threads
+  of the process, as @c task(argl,args). This is much cheaper than
+  creating a thread for each task. Like @c CreateThread, the 
+  arguments are not copied.
+
+  The worker threads are created by the first call, one per core.
+  Each worker has its own queue of tasks. A task submitted by a 
+  worker goes to its own queue, where it is likely to run soon, on
+  a warm cache; other tasks are spread over the workers. A worker with
+  an empty queue takes the oldest task of another worker's queue.
+
+  Tasks should not call @c ThreadExit. They may submit tasks and wait
+  for them; a worker waiting for a task executes other tasks in the
+  meantime.
+
+  When the main thread of the process exits, the queued tasks are
+  executed and the workers exit.
+
+  @param task the function to execute
+  @param argl the length of the argument
+  @param args the argument
+  @returns the id of the new task, or @c NOTASK if @c task is NULL.
+  @see WaitTask
+  @see WaitAll
+  */
+TaskId_t SubmitTask(Task task, int argl, void* args);
+
+/**
+  @brief Wait for a task to finish.
+
+  This call waits until the task has returned, and returns its return
+  value in @c *retval. After a successful call, the task id is no
+  longer valid.
+
+  @param task the id of a task submitted by this process
+  @param retval a location for the return value of the task, or NULL
+  @returns 0 on success and -1 on error. Possible errors are:
+    - the id is @c NOTASK, or it is not a task of this process.
+    - the task has already been waited for.
+  */
+int WaitTask(TaskId_t task, int* retval);
+
+/**
+  @brief Wait for all tasks of the process to finish.
+
+  This call waits until all tasks submitted so far (and any tasks
+  they submit) have finished. The ids of the finished tasks are released,
+  unless some thread is blocked in @c WaitTask for them.
+
+  @returns 0 on success and -1 on error. The only possible error is
+    that the caller is a task.
+  */
+int WaitAll();
+
 
 
 /*******************************************
@@ -398,6 +599,27 @@ unsigned int GetTerminalDevices();
  */
 Fid_t OpenTerminal(unsigned int termno);
 
+/** @brief Open a stream on the console.
+
+  The console is connected to the standard input and output of the 
+  host program, if they are open. Unlike terminals, a read from the 
+  console returns 0 at the end of input (e.g., when the standard input
+  of the host is a file).
+
+  @return On success, the file id for a new file for the console. 
+   On error, @c NOFILE. Possible errors are:
+   - The console is not connected.
+   - The maximum number of file descriptors has been reached.
+ */
+Fid_t OpenConsole();
+
+/** @brief Check if a stream is a terminal.
+
+  @param fid the file id to check
+  @return 1 if @c fid is a stream on a terminal device or the console, else 0.
+ */
+int IsTerminal(Fid_t fid);
+
 
 /** @brief Open a stream on the null device.
 
@@ -488,6 +710,49 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/** @brief Poll event: a @c Read on the stream would not block. */
+#define POLL_READ  1
+/** @brief Poll event: a @c Write on the stream would not block. */
+#define POLL_WRITE 2
+/** @brief Poll event: the file id is not open. It is always reported. */
+#define POLL_BADFID 4
+
+/** @brief A timeout for @c Poll, which means "wait for ever". */
+#define POLL_FOREVER ((timeout_t)-1)
+
+/**
+  @brief A file id and the events to poll it for.
+
+  @see Poll
+ */
+typedef struct poll_fid {
+  Fid_t fid;      /**< The file id to poll */
+  int events;     /**< The events of interest, a combination of @c POLL_READ and @c POLL_WRITE */
+  int revents;    /**< The events that have happened, filled in by @c Poll */
+} poll_fid;
+
+
+/** @brief Wait until some of a set of streams are ready for I/O.
+
+  For each element of array @c fids, this call fills in @c revents
+  with the events of @c events that have happened, i.e., whether a 
+  @c Read or @c Write on the file id would return at once, with data,
+  end of data or an error. If none has happened, the call blocks until
+  one does, or the timeout expires.
+
+  Pipes, sockets, channels and serial streams (terminals and the console)
+  report their readiness. Other streams never block, so they are always
+  ready for the events asked.
+
+  @param fids an array of @c n poll requests
+  @param n the size of @c fids
+  @param timeout the timeout in milliseconds, 0 to return at once, or @c POLL_FOREVER.
+  @return the number of elements with a non-zero @c revents, 0 if the timeout 
+    expired, or -1 if @c fids is NULL.
+ */
+int Poll(poll_fid* fids, unsigned int n, timeout_t timeout);
+
 /*******************************************
  *
  * Pipes
@@ -530,6 +795,173 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+
+/*******************************************
+ *
+ * Channels
+ *
+ *******************************************/
+
+/** @brief The maximum size of a channel message. */
+#define MAX_MSG_SIZE (64*1024)
+
+/**
+	@brief Construct a message channel.
+
+	A channel is a bounded queue of discrete messages of up to @c MAX_MSG_SIZE
+	bytes, accessed via two file ids, like a pipe. Any number of threads
+	and processes can send and receive through the same channel, by sharing
+	its file ids (e.g., by @c Dup2 or by inheritance).
+
+	Messages can be moved through the channel without copying: a message
+	allocated by @c MsgAlloc is passed to @c SendBatch, and then it belongs
+	to the channel, until some call to @c RecvBatch passes it to the receiver,
+	who must release it by @c MsgFree. 
+
+	Messages can also be copied in and out: a @c Write to the write end
+	sends its buffer as one message, and a @c Read from the read end receives 
+	one message. If the buffer of @c Read is too small for the next message,
+	it returns -1 and the message is left in the channel.
+
+	When the write end is closed and the channel is empty, the read end 
+	returns end of data. When the read end is closed, sending fails.
+
+	@param ends a pointer to a pipe_t structure for storing the file ids.
+	@param capacity the maximum number of messages in the channel, at least 1
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the capacity is 0.
+		- the available file ids for the process are exhausted.
+*/
+int Channel(pipe_t* ends, unsigned int capacity);
+
+/**
+	@brief Allocate a message for a channel.
+
+	@param size the size of the message, at most @c MAX_MSG_SIZE
+	@returns a message buffer of the given size, or NULL if the size is too large.
+*/
+void* MsgAlloc(unsigned int size);
+
+/** @brief Release a message returned by @c MsgAlloc or @c RecvBatch. 
+
+	A message that is sent and not yet received belongs to the channel,
+	and is not released.
+*/
+void MsgFree(void* msg);
+
+/** @brief Return the size of a message returned by @c MsgAlloc or @c RecvBatch. */
+unsigned int MsgSize(const void* msg);
+
+/**
+	@brief Send a batch of messages.
+
+	Messages are moved into the channel in order, as long as it has space.
+	If it is full, the call blocks until at least one message is sent.
+	The sent messages no longer belong to the caller.
+
+	@param fid the write end of a channel
+	@param msgs an array of @c n messages returned by @c MsgAlloc or @c RecvBatch
+	@param n the number of messages
+	@returns the number of messages sent, which are the first ones of @c msgs,
+		or -1 on error, when nothing is sent. Possible reasons for error:
+		- @c fid is not the write end of a channel.
+		- a message does not belong to the caller, or appears twice in @c msgs.
+		- the read end of the channel is closed.
+*/
+int SendBatch(Fid_t fid, void** msgs, unsigned int n);
+
+/**
+	@brief Receive a batch of messages.
+
+	Messages are moved out of the channel in order, up to @c n. If it is
+	empty, the call blocks until at least one message arrives. The received
+	messages must be released by @c MsgFree.
+
+	@param fid the read end of a channel
+	@param msgs an array for up to @c n messages
+	@param n the size of @c msgs
+	@returns the number of messages received, 0 if the write end is closed
+		and the channel is empty, or -1 on error. Possible reasons for error:
+		- @c fid is not the read end of a channel.
+*/
+int RecvBatch(Fid_t fid, void** msgs, unsigned int n);
+
+/*******************************************
+ *
+ * Shared memory
+ *
+ *******************************************/
+
+/** @brief The maximum length of the name of a shared memory segment. */
+#define MAX_SHM_NAME 31
+
+/**
+	@brief Open a named shared memory segment.
+
+	If no segment with the given name exists, a new segment of @c size
+	bytes is created, filled with zeros. Else, the existing segment is 
+	opened, and @c size may be 0.
+
+	A segment lives as long as some file id refers to it. The file ids 
+	can be shared by @c Dup2 or by inheritance, like any other stream, and 
+	they are closed when a process exits, so a segment is released after 
+	all processes using it have closed it or exited. Then, its name can be
+	used for a new segment.
+
+	@param name the name of the segment, of at most @c MAX_SHM_NAME characters
+	@param size the size of the segment in bytes
+	@returns a file id for the segment, or @c NOFILE on error. Possible 
+		reasons for error:
+		- the name is empty or too long.
+		- the segment does not exist and @c size is 0.
+		- the segment exists and is smaller than @c size.
+		- the available file ids for the process are exhausted.
+*/
+Fid_t ShmOpen(const char* name, unsigned int size);
+
+/**
+	@brief Return the address of a shared memory segment.
+
+	All processes that map the same segment get the same address. Since
+	@c ShmAlloc hands out memory from the start of the segment, a segment 
+	should be used either through @c ShmAlloc, or directly, but not both.
+
+	@param fid a file id returned by @c ShmOpen
+	@returns the address of the segment, or NULL if @c fid is not a shared 
+		memory segment.
+*/
+void* ShmMap(Fid_t fid);
+
+/** @brief Return the size of the segment at an address returned by @c ShmMap. */
+unsigned int ShmSize(void* shm);
+
+/**
+	@brief Close a shared memory segment.
+
+	This is the same as @c Close, except that it fails if @c fid is not a 
+	shared memory segment. The addresses returned by @c ShmMap and @c ShmAlloc 
+	remain valid while any file id refers to the segment.
+
+	@returns 0 on success, or -1 on error.
+*/
+int ShmClose(Fid_t fid);
+
+/**
+	@brief Allocate memory from a shared memory segment.
+
+	Memory is allocated by moving a pointer forward in the segment, 
+	without locks, so any thread of any process that has mapped the segment
+	can allocate concurrently. Memory is never returned to the segment.
+	The returned memory is aligned to 16 bytes, and is zero if the segment
+	is new.
+
+	@param shm the address returned by @c ShmMap
+	@param size the number of bytes
+	@returns the allocated memory, or NULL if the segment is exhausted.
+*/
+void* ShmAlloc(void* shm, unsigned int size);
+
+
 /*******************************************
  *
  * Sockets (local)
@@ -693,6 +1125,104 @@ typedef enum {
 int ShutDown(Fid_t sock, shutdown_mode how);
 
 
+/*******************************************
+ *
+ * Submission rings
+ *
+ *******************************************/
+
+/** @brief The maximum number of entries of a submission ring. */
+#define MAX_IORING_ENTRIES 4096
+
+/** @brief The operations of a submission ring. */
+typedef enum {
+	IO_NOP,       /**< @brief Do nothing; the result is 0. */
+	IO_READ,      /**< @brief @c Read(fid, buf, size) */
+	IO_WRITE,     /**< @brief @c Write(fid, buf, size) */
+	IO_CLOSE,     /**< @brief @c Close(fid) */
+	IO_ACCEPT,    /**< @brief @c Accept(fid) */
+	IO_CONNECT    /**< @brief @c Connect(fid, port, timeout) */
+} io_op;
+
+/** @brief A submission queue entry: an operation to execute. */
+typedef struct io_sqe {
+	io_op op;             /**< @brief The operation */
+	Fid_t fid;            /**< @brief The file id of the operation */
+	void* buf;            /**< @brief The buffer of @c IO_READ and @c IO_WRITE */
+	unsigned int size;    /**< @brief The size of @c buf */
+	port_t port;          /**< @brief The port of @c IO_CONNECT */
+	timeout_t timeout;    /**< @brief The timeout of @c IO_CONNECT */
+	uintptr_t user_data;  /**< @brief Copied to the completion */
+} io_sqe;
+
+/** @brief A completion queue entry: the result of an operation. */
+typedef struct io_cqe {
+	uintptr_t user_data;  /**< @brief The @c user_data of the operation */
+	int result;           /**< @brief The return value of the operation */
+} io_cqe;
+
+/**
+	@brief A submission ring.
+
+	The ring consists of two queues, in memory shared by the process and the 
+	kernel. The process adds operations at the tail of the submission queue
+	and the kernel takes them from its head. The kernel adds completions
+	at the tail of the completion queue, and the process takes them
+	from its head.
+
+	The counters run freely; entry @c i of a queue is at position 
+	@c i modulo the size of the queue. The process should only change 
+	@c sq_tail and @c cq_head, and the kernel changes the other two.
+	The helpers @ref IoRingGetSqe, @ref IoRingPeekCqe and @ref IoRingCqeSeen
+	of tinyoslib take care of this.
+  */
+typedef struct io_ring {
+	unsigned int entries;   /**< @brief The size of @c sq; @c cq has twice as many entries */
+	unsigned int sq_head;   /**< @brief The next submission to be taken by the kernel */
+	unsigned int sq_tail;   /**< @brief The next free submission entry */
+	unsigned int cq_head;   /**< @brief The next completion to be taken by the process */
+	unsigned int cq_tail;   /**< @brief The next free completion entry */
+	io_sqe* sq;             /**< @brief The submission queue */
+	io_cqe* cq;             /**< @brief The completion queue */
+} io_ring;
+
+/**
+	@brief Create the submission ring of the process.
+
+	Each process may have one ring, which is released when the process exits.
+
+	@param entries the minimum size of the submission queue, rounded up to a 
+		power of 2, at most @c MAX_IORING_ENTRIES
+	@returns the ring, or NULL on error. Possible reasons for error:
+		- @c entries is 0 or too large.
+		- the process already has a ring.
+*/
+io_ring* IoRingSetup(unsigned int entries);
+
+/**
+	@brief Submit operations and wait for completions.
+
+	All the operations queued in the submission queue are submitted, as 
+	long as there is room in the completion queue for their results.
+	Operations that would not block (according to @c Poll) are executed
+	at once, within this call. The others are executed by worker threads
+	of the kernel, which post their completions later. Thus, the operations 
+	may complete in any order.
+
+	Then, the call waits until at least @c min_complete completions are in the 
+	completion queue, or no operations are in progress, or the timeout expires.
+
+	Note that a process does not finish exiting while its workers execute
+	blocking operations, just as with its other threads.
+
+	@param min_complete the number of completions to wait for
+	@param timeout the timeout in milliseconds, or @c POLL_FOREVER
+	@returns the number of operations submitted, or -1 if the process has 
+		no ring.
+*/
+int IoRingEnter(unsigned int min_complete, timeout_t timeout);
+
+
 
 /*******************************************
  *
@@ -705,6 +1235,32 @@ int ShutDown(Fid_t sock, shutdown_mode how);
   */
 #define PROCINFO_MAX_ARGS_SIZE (128)
 
+/**
+  @brief The number of scheduler priority levels reported in a @c cpu_usage.
+  */
+#define PROCINFO_PRIORITY_LEVELS (15)
+
+/**
+	@brief CPU usage statistics of a process.
+
+	All times are in microseconds. The statistics of a process add up
+	those of all its threads, both live and exited.
+
+	@see procinfo
+  */
+typedef struct cpu_usage
+{
+	unsigned long run_time;   /**< @brief Time spent running on some core. */
+	unsigned long wait_time;  /**< @brief Time spent ready to run, waiting for a core. */
+
+	unsigned long voluntary_switches;   /**< @brief Times a thread left the core by blocking or yielding. */
+	unsigned long involuntary_switches; /**< @brief Times a thread was preempted by the scheduler. */
+
+	unsigned long level_time[PROCINFO_PRIORITY_LEVELS]; /**< @brief The part of @c run_time
+		spent at each priority level, from the highest (0) to the lowest. */
+} cpu_usage;
+
+
 /**
 	@brief A struct containing process-related information for a non-free
 	pid.
@@ -722,6 +1278,8 @@ typedef struct procinfo
   int alive;      /**< @brief Non-zero if process is alive, zero if process is zombie. */
 	
   unsigned long thread_count; /**< Current no of threads. */
+
+  cpu_usage usage; /**< @brief The CPU usage of the process. */
 	
   Task main_task;  /**< @brief The main task of the process. */
 	
@@ -748,9 +1306,14 @@ typedef struct procinfo
 	Each procinfo structure contains information pertaining to some
 	used PCB (active or zombie) during the time of the stream. 
 
-	There is no guarantee of the timeliness of the information.
-	A best-effort approach to return relevant system information is
-	made. 
+	The stream reports the processes that existed when it was opened,
+	in order of creation, except those that have been cleaned up by
+	the time they would be read. Processes created later are not reported.
+	Each structure is read from the process at the time of the @c Read.
+
+	A @c Read returns as many whole structures as fit into its buffer, 
+	so that many processes can be read with one call. It fails if the
+	buffer cannot hold one structure, and returns 0 at the end of the stream.
 
 	@returns a file id on success, or NOFILE on error. Possible reasons
 		for error are:
@@ -173,32 +173,41 @@ int SystemInfo(size_t argc, const char** argv)
 	Fid_t finfo = OpenInfo();
 	if(finfo!=NOFILE) {
 		/* Print per-process info */
-		procinfo info;
-		printf("%5s %5s %6s %8s %20s\n",
-			"PID", "PPID", "State", "Threads", "Main program"
+		procinfo infos[16];
+		int nread;
+		printf("%5s %5s %6s %8s %10s %10s %8s %8s %20s\n",
+			"PID", "PPID", "State", "Threads", "CPU(ms)", "Wait(ms)", "Vol.sw", "Invol.sw", "Main program"
 			);
-		/* Read in next piece of info */		
-		while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
-			Program prog=NULL;
-			const char* argv[10];
-			int argc = ParseProcInfo(&info, &prog, 10, argv);
-
-			const char* pname = "-";
-			if(argc>=1)  {
-				pname = argv[0];
-			} else if(argc==-1) {
-				/* Try to give some known names */
-				if(info.pid==1) pname = "init";
+		/* Read in the next batch of info */
+		while((nread = Read(finfo, (char*) infos, sizeof(infos))) > 0) {
+			for(int i=0; i < nread/sizeof(procinfo); i++) {
+				procinfo* info = &infos[i];
+				Program prog=NULL;
+				const char* argv[10];
+				int argc = ParseProcInfo(info, &prog, 10, argv);
+
+				const char* pname = "-";
+				if(argc>=1)  {
+					pname = argv[0];
+				} else if(argc==-1) {
+					/* Try to give some known names */
+					if(info->pid==1) pname = "init";
+				}
+
+				printf("%5d %5d %6s %8lu %10.1f %10.1f %8lu %8lu %20s\n",
+					info->pid,
+					info->ppid,
+					(info->alive?"ALIVE":"ZOMBIE"),
+					info->thread_count,
+					info->usage.run_time/1000.0,
+					info->usage.wait_time/1000.0,
+					info->usage.voluntary_switches,
+					info->usage.involuntary_switches,
+					pname
+					);
 			}
-
-			printf("%5d %5d %6s %8u %20s\n",
-				info.pid,
-				info.ppid,
-				(info.alive?"ALIVE":"ZOMBIE"),
-				info.thread_count,
-				pname
-				);
 		}
+		Close(finfo);
 	}
 	printf("\n");
 	return 0;
@@ -341,6 +350,7 @@ int More(size_t argc, const char** argv)
 			if(count % page == 0) {
 				/* Here, we have to use getline, unless we change terminal */
 				fprintf(fout, "press enter to continue:");
+				fflush(fout);
 				(void)getline(&_line, &_lno, fkbd);
 			}
 		}
@@ -906,6 +916,9 @@ int Shell(size_t argc, const char** argv)
 	fin = fidopen(0, "r");
 	fout = fidopen(1, "w");		
 
+	/* The commands read the rest of our input, so we must not read ahead */
+	setvbuf(fin, NULL, _IONBF, 0);
+
 	fprintf(fout,"Starting tinyos shell\nType 'help' for help, 'exit' to quit.\n");
 
 	const int ARGN = 128;
@@ -917,6 +930,7 @@ int Shell(size_t argc, const char** argv)
 
 		/* Read the command line */
 		fprintf(fout, "%% "); 
+		fflush(fout);
 		ssize_t rc;
 
 		again:
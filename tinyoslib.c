@@ -4,27 +4,130 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio_ext.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "util.h"
+#include "bios.h"
 #include "tinyos.h"
 #include "tinyoslib.h"
 
 
 
+/*
+	The cookie of a stream opened by fidopen. The streams that are not
+	closed are kept in a list per process, so that they are flushed when 
+	the process exits (see fid_streams_flush).
+ */
+typedef struct fid_cookie {
+	Fid_t fid;
+	FILE* file;
+	int flushing;     /* Set while fid_streams_flush uses the cookie */
+	int closed;       /* Closed while flushing, the flusher frees it */
+	struct fid_cookie *prev, *next;
+} fid_cookie;
+
+/* The streams of a process. The lists and cookies are protected by fid_streams_mx. */
+typedef struct fid_streams {
+	Pid_t pid;
+	fid_cookie head;
+	struct fid_streams* next;
+} fid_streams;
+
+static fid_streams* fid_streams_list = NULL;
+static Mutex fid_streams_mx = MUTEX_INIT;
+
+static void fid_unlink(fid_cookie* c)
+{
+	c->prev->next = c->next;
+	c->next->prev = c->prev;
+	c->prev = c->next = c;
+}
+
+/* The exit handler: flush the open streams of the exiting process */
+static void fid_streams_flush()
+{
+	Pid_t pid = GetPid();
+
+	Mutex_Lock(&fid_streams_mx);
+	fid_streams** pos = &fid_streams_list;
+	while(*pos != NULL && (*pos)->pid != pid) pos = &(*pos)->next;
+	fid_streams* streams = *pos;
+	if(streams == NULL) {
+		Mutex_Unlock(&fid_streams_mx);
+		return;
+	}
+	*pos = streams->next;
+
+	fid_cookie* head = &streams->head;
+	while(head->next != head) {
+		fid_cookie* c = head->next;
+		fid_unlink(c);
+		/* A flush may block, so do not hold the lock. The cookie is 
+		   kept, even if another thread closes the stream meanwhile. */
+		c->flushing = 1;
+		Mutex_Unlock(&fid_streams_mx);
+		fflush(c->file);
+		Mutex_Lock(&fid_streams_mx);
+		c->flushing = 0;
+		if(c->closed) free(c);
+	}
+	Mutex_Unlock(&fid_streams_mx);
+	free(streams);
+}
+
+/* Add a stream to the list of the current process */
+static void fid_register(fid_cookie* c)
+{
+	Pid_t pid = GetPid();
+	c->prev = c->next = c;
+
+	Mutex_Lock(&fid_streams_mx);
+	fid_streams* streams = fid_streams_list;
+	while(streams != NULL && streams->pid != pid) streams = streams->next;
+
+	if(streams == NULL) {
+		/* The first stream of the process */
+		if(AtExit(fid_streams_flush) == -1) {
+			Mutex_Unlock(&fid_streams_mx);
+			return;
+		}
+		streams = xmalloc(sizeof(fid_streams));
+		streams->pid = pid;
+		streams->head.prev = streams->head.next = &streams->head;
+		streams->next = fid_streams_list;
+		fid_streams_list = streams;
+	}
+
+	fid_cookie* head = &streams->head;
+	c->prev = head->prev;
+	c->next = head;
+	head->prev->next = c;
+	head->prev = c;
+	Mutex_Unlock(&fid_streams_mx);
+}
+
+
 static ssize_t tinyos_fid_read(void *cookie, char *buf, size_t size)
 {
-	return Read(*(Fid_t*)cookie, buf, size); 
+	return Read(((fid_cookie*)cookie)->fid, buf, size); 
 }
 
 static ssize_t tinyos_fid_write(void *cookie, const char *buf, size_t size)
 {
-	int ret = Write(*(Fid_t*)cookie, buf, size); 
+	int ret = Write(((fid_cookie*)cookie)->fid, buf, size); 
 	return (ret<0) ? 0 : ret;
 }
 
 static int tinyos_fid_close(void* cookie)
 {
-	free(cookie);
+	fid_cookie* c = cookie;
+	Mutex_Lock(&fid_streams_mx);
+	fid_unlink(c);
+	int flushing = c->flushing;
+	c->closed = 1;
+	Mutex_Unlock(&fid_streams_mx);
+	if(!flushing) free(c);
 	return 0;
 }
 
@@ -40,6 +143,9 @@ static FILE* get_std_stream(int fid, const char* mode)
 {
 	FILE* term = fidopen(fid, mode);
 	assert(term);
+	/* The standard streams are shared by all processes, and each call 
+	   goes to the fid of the calling process, so they cannot buffer */
+	CHECKRC(setvbuf(term, NULL, _IONBF, 0));
 	/* This is glibc-specific and tunrs off fstream locking */
 	__fsetlocking(term, FSETLOCKING_BYCALLER);	
 	return term;
@@ -48,12 +154,27 @@ static FILE* get_std_stream(int fid, const char* mode)
 
 FILE* fidopen(Fid_t fid, const char* mode)
 {
-
-	Fid_t* fidloc = (Fid_t *) malloc(sizeof(Fid_t));
-	* fidloc = fid;
-	FILE* f = fopencookie(fidloc, mode, tinyos_fid_functions);
-
-	CHECKRC(setvbuf(f, NULL, _IONBF, 0));
+	fid_cookie* cookie = (fid_cookie *) malloc(sizeof(fid_cookie));
+	cookie->fid = fid;
+	cookie->flushing = 0;
+	cookie->closed = 0;
+	FILE* f = fopencookie(cookie, mode, tinyos_fid_functions);
+	if(f == NULL) {
+		free(cookie);
+		return NULL;
+	}
+	cookie->file = f;
+
+	/* 
+		Terminals are line-buffered for output, and unbuffered for input,
+		so that a reader does not take input meant for other processes.
+		Other streams are fully buffered.
+	 */
+	int reading = (mode[0]=='r' && strchr(mode, '+')==NULL);
+	int bufmode = IsTerminal(fid) ? (reading ? _IONBF : _IOLBF) : _IOFBF;
+	CHECKRC(setvbuf(f, NULL, bufmode, BUFSIZ));
+
+	fid_register(cookie);
 	return f;
 }
 
@@ -80,6 +201,7 @@ void tinyos_restore_stdio()
 {
 	if(saved_out == NULL)  return;	
 
+	fflush(stdout);
 	fclose(stdin);
 	fclose(stdout);
 
@@ -166,3 +288,350 @@ int Execute(Program prog, size_t argc, const char** argv)
 	return Exec(exec_wrapper, argl, args);
 }
 
+
+
+
+/*
+ *
+ *   Coroutines
+ *
+ */
+
+
+typedef enum {
+	CO_READY,      /* In the ready queue, or yielding */
+	CO_RUNNING,    /* Running on some worker */
+	CO_WAITING,    /* Awaiting a stream */
+	CO_DONE        /* Returned, its stack can be reused */
+} co_state;
+
+struct co_group;
+
+/* A thread running coroutines */
+typedef struct co_worker {
+	cpu_context_t ctx;        /* Context of the worker loop */
+	struct co_group* group;
+} co_worker;
+
+/*
+	The coroutine struct is stored at the top of its stack segment, which is 
+	aligned to CO_STACK_SIZE. Thus, the running coroutine is found from the 
+	stack pointer, without a system call.
+ */
+struct coroutine {
+	cpu_context_t ctx;        /* Saved context, while not running */
+	struct co_group* group;   /* The group of the coroutine */
+	co_worker* worker;        /* The worker that runs the coroutine */
+	co_state state;
+
+	Task task;
+	int argl;
+	void* args;
+	int retval;
+
+	poll_fid await;           /* The stream awaited */
+	rlnode node;              /* Node for the ready, waiting or free list */
+};
+
+typedef struct co_group {
+	Mutex mx;                 /* Protects the group */
+	CondVar work;             /* Idle workers wait here */
+
+	rlnode ready;             /* Coroutines ready to run */
+	rlnode waiting;           /* Coroutines awaiting a stream */
+	rlnode free;              /* Finished coroutines, with reusable stacks */
+	unsigned int live;        /* Coroutines not finished */
+	unsigned int nwaiting;    /* Length of the waiting list */
+
+	int polling;              /* Set while a worker is in Poll */
+	int wake_pending;         /* Set when a byte has been written to wake */
+	pipe_t wake;              /* Interrupts the Poll, when the waiting list grows */
+	poll_fid* pfids;          /* Poll array of the polling worker */
+	Coroutine* pcos;          /* The coroutines of pfids[1..] */
+	unsigned int pcap;        /* Capacity of pfids and pcos */
+
+	Coroutine main;           /* The first coroutine */
+	int retval;               /* Its return value */
+} co_group;
+
+
+#define CO_STRUCT_OFFSET  ((CO_STACK_SIZE - sizeof(struct coroutine)) & ~(uintptr_t)15)
+
+static inline Coroutine co_current()
+{
+	char here;
+	return (Coroutine) (((uintptr_t)&here & ~(uintptr_t)(CO_STACK_SIZE-1)) + CO_STRUCT_OFFSET);
+}
+
+static inline char* co_stack(Coroutine co)
+{
+	return (char*)co - CO_STRUCT_OFFSET;
+}
+
+/* Allocate an aligned stack segment, with a guard page at the bottom */
+static Coroutine co_allocate()
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	char* ptr = mmap(NULL, 2*CO_STACK_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC, 
+		MAP_ANONYMOUS|MAP_PRIVATE|MAP_NORESERVE, -1, 0);
+	if(ptr == MAP_FAILED) return NULL;
+
+	/* Trim to an aligned segment */
+	char* base = (char*)(((uintptr_t)ptr + CO_STACK_SIZE-1) & ~(uintptr_t)(CO_STACK_SIZE-1));
+	if(base > ptr) 
+		CHECK(munmap(ptr, base-ptr));
+	if(base + CO_STACK_SIZE < ptr + 2*CO_STACK_SIZE)
+		CHECK(munmap(base+CO_STACK_SIZE, ptr + 2*CO_STACK_SIZE - (base+CO_STACK_SIZE)));
+
+	CHECK(mprotect(base, page, PROT_NONE));
+	return (Coroutine) (base + CO_STRUCT_OFFSET);
+}
+
+static void co_start()
+{
+	Coroutine co = co_current();
+	co->retval = co->task(co->argl, co->args);
+	co->state = CO_DONE;
+	cpu_swap_context(& co->ctx, & co->worker->ctx);
+	assert(0);  /* Never resumed */
+}
+
+/* Make a new ready coroutine. Called with the group locked. */
+static Coroutine co_create(co_group* g, Task task, int argl, void* args)
+{
+	Coroutine co;
+	if(! is_rlist_empty(& g->free))
+		co = rlist_pop_front(& g->free)->obj;
+	else if((co = co_allocate()) == NULL)
+		return NULL;
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	cpu_initialize_context(& co->ctx, co_stack(co)+page, CO_STRUCT_OFFSET-page, co_start);
+	co->group = g;
+	co->worker = NULL;
+	co->state = CO_READY;
+	co->task = task;
+	co->argl = argl;
+	co->args = args;
+	rlnode_init(& co->node, co);
+
+	g->live++;
+	rlist_push_back(& g->ready, & co->node);
+	Cond_Signal(& g->work);
+	return co;
+}
+
+/* Return to the worker; it will take care of the new state of co */
+static inline void co_switch_out(Coroutine co)
+{
+	cpu_swap_context(& co->ctx, & co->worker->ctx);
+}
+
+
+/* Wait for the awaited streams; called with the group locked, and unlocks it while polling */
+static void co_poll(co_group* g)
+{
+	unsigned int n = g->nwaiting + 1;
+	if(n > g->pcap) {
+		g->pcap = 2*n;
+		g->pfids = realloc(g->pfids, g->pcap * sizeof(poll_fid));
+		g->pcos = realloc(g->pcos, g->pcap * sizeof(Coroutine));
+		CHECK((g->pfids && g->pcos) ? 0 : -1);
+	}
+
+	g->pfids[0] = (poll_fid){ .fid = g->wake.read, .events = POLL_READ };
+	unsigned int i = 1;
+	for(rlnode* p = g->waiting.next; p != &g->waiting; p = p->next, i++) {
+		g->pcos[i] = p->obj;
+		g->pfids[i] = g->pcos[i]->await;
+	}
+
+	g->polling = 1;
+	Mutex_Unlock(& g->mx);
+	Poll(g->pfids, n, POLL_FOREVER);
+	Mutex_Lock(& g->mx);
+	g->polling = 0;
+
+	if(g->pfids[0].revents) {
+		char buf[16];
+		Read(g->wake.read, buf, sizeof(buf));
+		g->wake_pending = 0;
+	}
+
+	for(i=1; i<n; i++) 
+		if(g->pfids[i].revents) {
+			Coroutine co = g->pcos[i];
+			co->await.revents = g->pfids[i].revents;
+			co->state = CO_READY;
+			rlist_remove(& co->node);
+			g->nwaiting--;
+			rlist_push_back(& g->ready, & co->node);
+			Cond_Signal(& g->work);
+		}
+}
+
+static int co_worker_loop(int argl, void* args)
+{
+	co_group* g = args;
+	co_worker w = { .group = g };
+
+	Mutex_Lock(& g->mx);
+	for(;;) {
+		if(! is_rlist_empty(& g->ready)) {
+			Coroutine co = rlist_pop_front(& g->ready)->obj;
+			co->state = CO_RUNNING;
+			co->worker = &w;
+
+			Mutex_Unlock(& g->mx);
+			cpu_swap_context(& w.ctx, & co->ctx);
+			Mutex_Lock(& g->mx);
+
+			/* Now that its context is saved, the coroutine can be queued */
+			switch(co->state) {
+			case CO_READY:
+				rlist_push_back(& g->ready, & co->node);
+				break;
+			case CO_WAITING:
+				rlist_push_back(& g->waiting, & co->node);
+				g->nwaiting++;
+				/* The poller does not know about co */
+				if(g->polling && !g->wake_pending) {
+					g->wake_pending = 1;
+					Write(g->wake.write, "", 1);
+				}
+				break;
+			case CO_DONE:
+				if(co == g->main) { g->retval = co->retval; g->main = NULL; }
+				rlist_push_front(& g->free, & co->node);
+				if(--g->live == 0) 
+					Cond_Broadcast(& g->work);
+				break;
+			default:
+				assert(0);
+			}
+		}
+		else if(g->live == 0)
+			break;
+		else if(!g->polling && g->nwaiting > 0)
+			co_poll(g);
+		else
+			Cond_Wait(& g->mx, & g->work);
+	}
+	Mutex_Unlock(& g->mx);
+
+	return 0;
+}
+
+
+int CoRun(unsigned int nthreads, Task task, int argl, void* args)
+{
+	if(nthreads < 1 || task == NULL) return -1;
+
+	co_group* g = xmalloc(sizeof(co_group));
+	*g = (co_group){ .mx = MUTEX_INIT, .work = COND_INIT };
+	rlnode_init(& g->ready, NULL);
+	rlnode_init(& g->waiting, NULL);
+	rlnode_init(& g->free, NULL);
+
+	if(Pipe(& g->wake) != 0) { free(g); return -1; }
+
+	Mutex_Lock(& g->mx);
+	g->main = co_create(g, task, argl, args);
+	Mutex_Unlock(& g->mx);
+
+	int retval = -1;
+	if(g->main != NULL) {
+		Tid_t tids[nthreads];
+		for(unsigned int i=1; i<nthreads; i++)
+			tids[i] = CreateThread(co_worker_loop, 0, g);
+
+		co_worker_loop(0, g);
+
+		for(unsigned int i=1; i<nthreads; i++)
+			if(tids[i] != NOTHREAD) ThreadJoin(tids[i], NULL);
+		retval = g->retval;
+	}
+
+	/* Clean up */
+	Close(g->wake.read);
+	Close(g->wake.write);
+	while(! is_rlist_empty(& g->free))
+		CHECK(munmap(co_stack(rlist_pop_front(& g->free)->obj), CO_STACK_SIZE));
+	free(g->pfids);
+	free(g->pcos);
+	free(g);
+	return retval;
+}
+
+
+Coroutine CoSpawn(Task task, int argl, void* args)
+{
+	if(task == NULL) return NULL;
+
+	co_group* g = co_current()->group;
+	Mutex_Lock(& g->mx);
+	Coroutine co = co_create(g, task, argl, args);
+	Mutex_Unlock(& g->mx);
+	return co;
+}
+
+
+Coroutine CoSelf()
+{
+	return co_current();
+}
+
+
+void CoYield()
+{
+	Coroutine co = co_current();
+	co->state = CO_READY;
+	co_switch_out(co);
+}
+
+
+int CoAwait(Fid_t fid, int events)
+{
+	Coroutine co = co_current();
+	co->await = (poll_fid){ .fid = fid, .events = events };
+
+	/* Do not switch if the stream is ready already */
+	if(Poll(& co->await, 1, 0) > 0)
+		return co->await.revents;
+
+	co->state = CO_WAITING;
+	co_switch_out(co);
+	return co->await.revents;
+}
+
+
+/*
+	Submission ring helpers. The kernel changes sq_head and cq_tail
+	concurrently, so they are read atomically; the entries are
+	published by advancing sq_tail and released by advancing cq_head.
+ */
+
+io_sqe* IoRingGetSqe(io_ring* ring)
+{
+	unsigned int head = __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE);
+	if(ring->sq_tail - head == ring->entries)
+		return NULL;
+
+	io_sqe* sqe = &ring->sq[ring->sq_tail & (ring->entries-1)];
+	memset(sqe, 0, sizeof(io_sqe));
+	__atomic_store_n(&ring->sq_tail, ring->sq_tail+1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+io_cqe* IoRingPeekCqe(io_ring* ring)
+{
+	unsigned int tail = __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE);
+	if(ring->cq_head == tail)
+		return NULL;
+	return &ring->cq[ring->cq_head & (2*ring->entries-1)];
+}
+
+void IoRingCqeSeen(io_ring* ring)
+{
+	__atomic_store_n(&ring->cq_head, ring->cq_head+1, __ATOMIC_RELEASE);
+}
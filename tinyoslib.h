@@ -18,6 +18,14 @@
 
 	This call returns a new FILE pointer on success and NULL
 	on failure.
+
+	The stream is buffered: line-buffered for output to a terminal, 
+	unbuffered for input from a terminal, and fully buffered otherwise
+	(e.g., for pipes and sockets). The buffering can be changed by 
+	@c setvbuf before the first I/O on the stream. The buffer is flushed
+	by @c fflush and @c fclose, and when the thread that opened the stream
+	exits, by @c ThreadExit, @c Exit or by returning, if the stream is still open.
+	Note that a @c Close of the file id does not flush the stream.
 */
 FILE* fidopen(Fid_t fid, const char* mode);
 
@@ -73,4 +81,106 @@ int Execute(Program prog, size_t argc, const char** argv);
 int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv );
 
 
+/**
+	@brief A coroutine.
+
+	Coroutines are light-weight threads of control inside a process.
+	A group of coroutines, started by @ref CoRun, is multiplexed over a few 
+	threads of the process. Coroutines are switched cooperatively, in user space,
+	when they call @ref CoYield, @ref CoAwait or return; the kernel scheduler 
+	is not involved.
+
+	Each coroutine has a small stack (@c CO_STACK_SIZE bytes, of which only 
+	the pages actually touched take up memory), followed by a guard page,
+	so that a stack overflow causes a segmentation fault.
+
+	A coroutine should not call blocking system calls, since this would block 
+	the thread running it. Instead, it should wait for its streams to become 
+	ready with @ref CoAwait.
+  */
+typedef struct coroutine* Coroutine;
+
+/** @brief The size of the stack of a coroutine. It must be a power of 2. */
+#define CO_STACK_SIZE (64*1024)
+
+/**
+	@brief Run a group of coroutines.
+
+	This call creates a coroutine executing @c task(argl,args) and runs it, 
+	together with any coroutines spawned by it, on @c nthreads threads, 
+	the calling thread and @c nthreads-1 new ones. The call returns 
+	after all coroutines of the group have returned.
+
+	@param nthreads the number of threads to run the coroutines, at least 1
+	@param task the function of the first coroutine
+	@param argl the argument length
+	@param args the argument
+	@returns the return value of the first coroutine, or -1 on error.
+  */
+int CoRun(unsigned int nthreads, Task task, int argl, void* args);
+
+/**
+	@brief Create a new coroutine in the group of the caller.
+
+	The new coroutine executes @c task(argl,args). This must be called by a coroutine.
+
+	@returns the new coroutine, or NULL on error.
+  */
+Coroutine CoSpawn(Task task, int argl, void* args);
+
+/**
+	@brief Return the calling coroutine.
+
+	This must be called by a coroutine.
+  */
+Coroutine CoSelf();
+
+/**
+	@brief Let other coroutines run.
+
+	This must be called by a coroutine.
+  */
+void CoYield();
+
+/**
+	@brief Wait until a stream is ready for I/O.
+
+	The calling coroutine is suspended until a @c Read (for @c POLL_READ) 
+	or a @c Write (for @c POLL_WRITE) on @c fid would not block. 
+	Meanwhile, its thread runs other coroutines. This must be called 
+	by a coroutine.
+
+	@param fid the file id to wait for
+	@param events @c POLL_READ and/or @c POLL_WRITE
+	@returns the events that happened, as in @c Poll.
+  */
+int CoAwait(Fid_t fid, int events);
+
+
+/**
+	@brief Get a free entry of the submission queue of a ring.
+
+	The entry is added to the queue, and will be submitted by the next call
+	to @c IoRingEnter; the caller should fill it in before that.
+	These helpers should not be called by several threads at once.
+
+	@returns the entry, or NULL if the submission queue is full.
+  */
+io_sqe* IoRingGetSqe(io_ring* ring);
+
+/**
+	@brief Return the oldest completion of a ring.
+
+	@returns the completion, or NULL if the completion queue is empty.
+  */
+io_cqe* IoRingPeekCqe(io_ring* ring);
+
+/**
+	@brief Remove the oldest completion of a ring.
+
+	This releases the entry returned by @ref IoRingPeekCqe.
+  */
+void IoRingCqeSeen(io_ring* ring);
+
+
 #endif
@@ -118,6 +118,19 @@ static inline void * xmalloc (size_t size)
   return value;
 }
 
+/**
+	@brief A wrapper for realloc checking for out-of-memory.
+
+	@see xmalloc
+  */
+static inline void * xrealloc (void* ptr, size_t size)
+{
+  void *value = realloc (ptr, size);
+  if (value == 0)
+    FATAL("virtual memory exhausted");
+  return value;
+}
+
 
 /** @}   check_macros  */
 
@@ -289,6 +302,7 @@ typedef struct thread_control_block TCB;			/**< @brief Forward declaration */
 typedef struct core_control_block CCB;				/**< @brief Forward declaration */
 typedef struct device_control_block DCB;			/**< @brief Forward declaration */
 typedef struct file_control_block FCB;				/**< @brief Forward declaration */
+typedef struct file_id_table FIDT;				/**< @brief Forward declaration */
 typedef struct p_thread_control_block PTCB;			/**< @brief Forward declaration */
 typedef struct unbound Unbound;
 typedef struct socket_connection_request Conn_req;
@@ -452,7 +466,7 @@ static inline rlnode* rlist_pop_front(rlnode* list) { return rl_splice(list, lis
 	This function, applied on a non-empty list, will remove the tail of 
 	the list and return in.
 */
-static inline rlnode* rlist_pop_back(rlnode* list) { return rl_splice(list, list->prev); }
+static inline rlnode* rlist_pop_back(rlnode* list) { return rl_splice(list->prev->prev, list->prev); }
 
 /**
 	@brief Return the length of a list.
@@ -69,6 +69,31 @@ BARE_TEST(test_boot,
 }
 
 
+BARE_TEST(test_boot_pinned, 
+	"Test that the VM boots and runs processes with the cores pinned to host cpus.")
+{
+	int child(int argl, void* args) { return argl; }
+
+	int init(int argl, void* args) {
+		for(int i=0; i<10; i++)
+			ASSERT(Exec(child, i, NULL) != NOPROC);
+		int sum = 0, exitval;
+		while(WaitChild(NOPROC, &exitval) != NOPROC) 
+			sum += exitval;
+		ASSERT(sum == 45);
+		return 0;
+	}
+
+	for(uint cores=1; cores<=4; cores*=2) {
+		vm_config config = { .pin_cores = 1, .housekeeping_cpu = -1, 
+			.realtime = (sysconf(_SC_NPROCESSORS_ONLN) > cores) };
+		vm_configure(&config);
+		boot(cores, 0, init, 0, NULL);
+	}
+	vm_configure(NULL);
+}
+
+
 
 
 /*********************************************
@@ -195,6 +220,35 @@ BOOT_TEST(test_exec_getpid_wait,
 
 
 
+BOOT_TEST(test_pids_not_reused,
+	"Test that the PID of a cleaned-up process is not given to new processes,\n"
+	"and that many processes can exist at the same time."
+	)
+{
+	int child(int argl, void* args) { return 0; }
+
+	Pid_t first = Exec(child, 0, NULL);
+	ASSERT(first != NOPROC);
+	ASSERT(WaitChild(first, NULL) == first);
+
+	/* Enough processes to need more than one chunk of PCBs */
+	const int N = 600;
+	Pid_t pids[N];
+	for(int i=0; i<N; i++) {
+		pids[i] = Exec(child, 0, NULL);
+		ASSERT(pids[i] != NOPROC && pids[i] != first);
+		for(int j=0; j<i; j++) ASSERT(pids[j] != pids[i]);
+	}
+
+	/* A stale PID does not find a process */
+	ASSERT(WaitChild(first, NULL) == NOPROC);
+
+	for(int i=0; i<N; i++)
+		ASSERT(WaitChild(pids[i], NULL) == pids[i]);
+	return 0;
+}
+
+
 BOOT_TEST(test_exec_copies_arguments,
 	"Test that Exec creates of copy of the arguments of the new process."
 	)
@@ -341,6 +395,110 @@ BOOT_TEST(test_orphans_adopted_by_init,
 
 
 
+BOOT_TEST(test_info_cpu_usage,
+	"Test that OpenInfo reports the CPU usage of live and zombie processes."
+	)
+{
+	int busy_child(int argl, void* args)
+	{
+		/* Run for 50 msec, then block once */
+		TimerDuration t0 = bios_clock();
+		while(bios_clock()-t0 < 50000);
+		Mutex mx = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 1);
+		return 0;
+	}
+
+	Pid_t child = Exec(busy_child, 0, NULL);
+	ASSERT(child != NOPROC);
+
+	/* Let the child finish and become a zombie */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 200);
+
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo != NOFILE);
+
+	int seen_self = 0, seen_child = 0;
+	procinfo info;
+	while(Read(finfo, (char*) &info, sizeof(info)) == sizeof(info)) {
+		unsigned long level_sum = 0;
+		for(int i=0; i<PROCINFO_PRIORITY_LEVELS; i++)
+			level_sum += info.usage.level_time[i];
+		ASSERT(level_sum == info.usage.run_time);
+
+		if(info.pid == GetPid()) {
+			seen_self = 1;
+			ASSERT(info.alive);
+			ASSERT(info.usage.voluntary_switches >= 1);
+		}
+		if(info.pid == child) {
+			seen_child = 1;
+			ASSERT(! info.alive);
+			ASSERT(info.usage.run_time >= 25000);
+			ASSERT(info.usage.voluntary_switches >= 1);
+		}
+	}
+	ASSERT(Close(finfo) == 0);
+	ASSERT(seen_self && seen_child);
+
+	ASSERT(WaitChild(child, NULL) == child);
+	return 0;
+}
+
+
+BOOT_TEST(test_info_batch_read,
+	"Test that OpenInfo returns many records per Read, and reports exactly\n"
+	"the processes that existed when the stream was opened."
+	)
+{
+	int child(int argl, void* args) { return 0; }
+
+	const int N = 5;
+	Pid_t children[N];
+	for(int i=0; i<N; i++)
+		ASSERT((children[i] = Exec(child, 0, NULL)) != NOPROC);
+
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo != NOFILE);
+
+	/* Processes created after OpenInfo are not reported */
+	Pid_t late = Exec(child, 0, NULL);
+	ASSERT(late != NOPROC);
+
+	procinfo buf[3];
+	ASSERT(Read(finfo, (char*) buf, sizeof(procinfo)-1) == -1);
+
+	/* The scheduler, init and N children, in order of creation */
+	Pid_t seen[N+2];
+	int nseen = 0;
+	int rc;
+	while((rc = Read(finfo, (char*) buf, sizeof(buf))) > 0) {
+		ASSERT(rc % sizeof(procinfo) == 0);
+		for(int i=0; i < rc/sizeof(procinfo); i++) {
+			ASSERT(nseen < N+2);
+			seen[nseen++] = buf[i].pid;
+		}
+	}
+	ASSERT(rc == 0);
+	ASSERT(nseen == N+2);
+	ASSERT(seen[0] == 0 && seen[1] == GetPid());
+	for(int i=0; i<N; i++)
+		ASSERT(seen[i+2] == children[i]);
+
+	ASSERT(Close(finfo) == 0);
+
+	for(int i=0; i<N; i++)
+		ASSERT(WaitChild(children[i], NULL) == children[i]);
+	ASSERT(WaitChild(late, NULL) == late);
+	return 0;
+}
+
+
 /*********************************************
  *
  *
@@ -404,6 +562,42 @@ BOOT_TEST(test_cond_timedwait_timeout,
 }
 
 
+/*
+	Test that a timed wait on a condition variable has fine resolution.
+ */
+
+BOOT_TEST(test_cond_timedwait_short_timeout, 
+	"Test that timed waits on a condition variable, with timeouts of a few msec,\n"
+	"terminate close to the timeout, as measured by bios_clock()."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	Mutex_Lock(&mx);
+	for(timeout_t t=2; t <= 32; t*=2) {
+		/* Keep the best of a few tries, to filter out host scheduling noise */
+		long best = -1;
+		for(int i=0; i<3; i++) {
+			TimerDuration t1 = bios_clock();
+			Cond_TimedWait(&mx, &cv, t);
+			TimerDuration t2 = bios_clock();
+
+			ASSERT(t2 >= t1);
+			long Dt = (t2-t1)/1000;
+			ASSERT_MSG(Dt >= (long)t, "Timeout %lu msec returned after %ld msec\n", t, Dt);
+			if(best<0 || Dt < best) best = Dt;
+		}
+
+		/* Allow 20% error, plus 2 msec */
+		ASSERT_MSG((best-(long)t)*5 <= t+10, "Timeout %lu msec took %ld msec\n", t, best);
+	}
+	Mutex_Unlock(&mx);
+
+	return 0;
+}
+
+
 /*
 	Test that a timed wait on a condition variable terminates at a signal.
  */
@@ -629,6 +823,31 @@ BOOT_TEST(test_read_kbd_big,
 }
 
 
+BOOT_TEST(test_poll_terminal,
+	"Test that Poll reports the readiness of a terminal, and wakes up when input arrives.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	poll_fid pf = { .fid = fterm, .events = POLL_READ|POLL_WRITE };
+
+	/* Nothing to read yet */
+	ASSERT(Poll(&pf, 1, 0) == 1);
+	ASSERT(pf.revents == POLL_WRITE);
+
+	pf.events = POLL_READ;
+	sendme(0, "Hello");
+	ASSERT(Poll(&pf, 1, POLL_FOREVER) == 1);
+	ASSERT(pf.revents == POLL_READ);
+	checked_read(fterm, "Hello");
+
+	ASSERT(Poll(&pf, 1, 0) == 0);
+	return 0;
+}
+
+
 BOOT_TEST(test_dup2_copies_file,
 	"This test copies that Dup2 copies the file to another file descriptor.",
 	.minimum_terminals = 1
@@ -871,16 +1090,21 @@ TEST_SUITE(basic_tests,
 	)
 {
 	&test_boot,
+	&test_boot_pinned,
 	&test_pid_of_init_is_one,
 	&test_waitchild_error_on_nonchild,
 	&test_waitchild_error_on_invalid_pid,
 	&test_exec_getpid_wait,
+	&test_pids_not_reused,
 	&test_exec_copies_arguments,
 	&test_exit_returns_status,
 	&test_main_return_returns_status,
 	&test_wait_for_any_child,
 	&test_orphans_adopted_by_init,
+	&test_info_cpu_usage,
+	&test_info_batch_read,
 	&test_cond_timedwait_timeout,
+	&test_cond_timedwait_short_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
 	&test_null_device,
@@ -894,6 +1118,7 @@ TEST_SUITE(basic_tests,
 	&test_close_terminals,
 	&test_read_kbd,
 	&test_read_kbd_big,
+	&test_poll_terminal,
 	&test_read_error_on_bad_fid,
 	&test_read_from_many_terminals,
 	&test_write_con,
@@ -919,55 +1144,801 @@ TEST_SUITE(basic_tests,
 
 
 
-BOOT_TEST(test_create_join_thread,
-	"Test that a process thread can be created and joined. Also, that "
-	"the argument of the thread is passed correctly."
+BOOT_TEST(test_create_join_thread,
+	"Test that a process thread can be created and joined. Also, that "
+	"the argument of the thread is passed correctly."
+	)
+{
+	int flag = 0;
+
+	int task(int argl, void* args) {
+		ASSERT(args == &flag);
+		*(int*)args = 1;
+		return 2;
+	}
+
+	Tid_t t = CreateThread(task, sizeof(flag), &flag);
+	ASSERT(t!=NOTHREAD);
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(flag==1);
+	return 0;
+}
+
+
+BOOT_TEST(test_exit_many_threads,
+	"Test that a process thread calling Exit will clean up correctly.",
+	.timeout = 60
+	)
+{
+
+	int task(int argl, void* args) {
+		fibo(40);
+		return 2;
+	}
+
+	int mthread(int argl, void* args){
+		for(int i=0;i<5;i++)
+			ASSERT(CreateThread(task, 0, NULL) != NOTHREAD);
+
+		fibo(35);
+		return 0;
+	}
+
+	Exec(mthread, 0, NULL);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_join_detach_semantics,
+	"Test that ThreadJoin returns the exit value to all joiners once, and fails for\n"
+	"detached, joined, current and main threads."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	volatile int go = 0;
+
+	int task(int argl, void* args) {
+		Mutex_Lock(&mx);
+		while(!go) Cond_Wait(&mx, &cv);
+		Mutex_Unlock(&mx);
+		return argl;
+	}
+
+	Tid_t self_tid = NOTHREAD;
+	int self(int argl, void* args) {
+		self_tid = ThreadSelf();
+		return ThreadJoin(ThreadSelf(), NULL);
+	}
+
+	/* Threads know their tid */
+	int retval;
+	Tid_t t = CreateThread(self, 0, NULL);
+	ASSERT(ThreadJoin(t, &retval) == 0);
+	ASSERT(retval == -1);
+	ASSERT(self_tid == t);
+
+	/* A joined thread cannot be joined or detached again */
+	ASSERT(ThreadJoin(t, NULL) == -1);
+	ASSERT(ThreadDetach(t) == -1);
+	ASSERT(ThreadJoin(ThreadSelf(), NULL) == -1);
+
+	/* Two joiners get the same exit value */
+	t = CreateThread(task, 7, NULL);
+	int joiner(int argl, void* args) {
+		int exitval;
+		return ThreadJoin(t, &exitval) == 0 ? exitval : -1;
+	}
+	Tid_t j1 = CreateThread(joiner, 0, NULL);
+	Tid_t j2 = CreateThread(joiner, 0, NULL);
+
+	/* A detached thread cannot be joined, and its joiners fail */
+	Tid_t d = CreateThread(task, 3, NULL);
+	Tid_t j3 = CreateThread(joiner, 0, NULL);
+	int joiner_d(int argl, void* args) {
+		return ThreadJoin(d, NULL);
+	}
+	Tid_t j4 = CreateThread(joiner_d, 0, NULL);
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 20);
+	Mutex_Unlock(&mx);
+	ASSERT(ThreadDetach(d) == 0);
+	ASSERT(ThreadJoin(d, NULL) == -1);
+
+	Mutex_Lock(&mx);
+	go = 1;
+	Cond_Broadcast(&cv);
+	Mutex_Unlock(&mx);
+
+	ASSERT(ThreadJoin(j1, &retval) == 0 && retval == 7);
+	ASSERT(ThreadJoin(j2, &retval) == 0 && retval == 7);
+	ASSERT(ThreadJoin(j3, &retval) == 0 && retval == 7);
+	ASSERT(ThreadJoin(j4, &retval) == 0 && retval == -1);
+	ASSERT(ThreadJoin(t, NULL) == -1);
+	return 0;
+}
+
+
+BOOT_TEST(test_exit_thousands_of_threads,
+	"Test that a process exits promptly, with thousands of exited threads that were\n"
+	"never joined, and that these threads are released.",
+	.timeout = 20
+	)
+{
+	const int N = 3000;
+
+	int task(int argl, void* args) {
+		return argl;
+	}
+
+	int mthread(int argl, void* args) {
+		for(int i=0; i<N; i++) {
+			Tid_t t = CreateThread(task, i, NULL);
+			if(t == NOTHREAD) return -1;
+			if(i % 2) ThreadDetach(t);
+		}
+		return 0;
+	}
+
+	int exitval;
+	Pid_t pid = Exec(mthread, 0, NULL);
+	ASSERT(WaitChild(pid, &exitval) == pid);
+	ASSERT(exitval == 0);
+
+	/* The tid of a joined thread is stale, even if its PTCB is reused */
+	Tid_t t = CreateThread(task, 0, NULL);
+	ASSERT(ThreadJoin(t, NULL) == 0);
+	Tid_t t2 = CreateThread(task, 0, NULL);
+	ASSERT(t2 != t);
+	ASSERT(ThreadJoin(t, NULL) == -1);
+	ASSERT(ThreadDetach(t) == -1);
+	ASSERT(ThreadJoin(t2, NULL) == 0);
+	return 0;
+}
+
+
+
+
+BOOT_TEST(test_wakeup_latency,
+	"Test that a thread woken up while all cores are busy with lower-priority\n"
+	"threads is run promptly, and report the wakeup-to-run latency.",
+	.minimum_cores = 2, .timeout = 30
+	)
+{
+	const int N = 20;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	volatile int done = 0, asleep = 0, flag = 0, woken = 0;
+	volatile TimerDuration t_run = 0;
+
+	/* Keep the other cores busy, at a low priority */
+	int hog(int argl, void* args) {
+		while(!done);
+		return 0;
+	}
+
+	int waiter(int argl, void* args) {
+		Mutex_Lock(&mx);
+		for(int i=0; i<N; i++) {
+			while(!flag) {
+				asleep = 1;
+				Cond_Wait(&mx, &cv);
+			}
+			flag = 0;
+			t_run = bios_clock();
+			woken = 1;
+		}
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	Tid_t hogs[MAX_CORES];
+	for(uint c=1; c<cpu_cores(); c++)
+		ASSERT((hogs[c] = CreateThread(hog, 0, NULL)) != NOTHREAD);
+	Tid_t w = CreateThread(waiter, 0, NULL);
+	ASSERT(w != NOTHREAD);
+
+	TimerDuration total = 0, worst = 0;
+	for(int i=0; i<N; i++) {
+		while(!asleep);
+		Mutex_Lock(&mx);
+		asleep = 0;
+		flag = 1;
+		TimerDuration t_sig = bios_clock();
+		Cond_Signal(&cv);
+		Mutex_Unlock(&mx);
+
+		/* Keep this core busy too, until the waiter runs */
+		while(!woken);
+		woken = 0;
+
+		TimerDuration lat = t_run - t_sig;
+		total += lat;
+		if(lat > worst) worst = lat;
+	}
+	done = 1;
+	ASSERT(ThreadJoin(w, NULL)==0);
+	for(uint c=1; c<cpu_cores(); c++)
+		ASSERT(ThreadJoin(hogs[c], NULL)==0);
+
+	MSG("wakeup-to-run latency: mean %lu usec, max %lu usec\n", total/N, worst);
+
+	/* The busy cores compete for the host cpus, unless there are enough of them */
+	if(sysconf(_SC_NPROCESSORS_ONLN) < cpu_cores()) {
+		MSG("Not checking the latency, there are only %ld host cpus.\n", 
+			sysconf(_SC_NPROCESSORS_ONLN));
+		return 0;
+	}
+
+	/* Without preemption, the waiter would wait for a quantum (10 msec) to expire */
+	ASSERT_MSG(total/N < 10000, "Mean wakeup latency %lu usec\n", total/N);
+	return 0;
+}
+
+
+BOOT_TEST(test_boost_under_load,
+	"Test that a low-priority process still runs while all cores are busy with\n"
+	"higher-priority threads, because the scheduler boosts the queues.",
+	.minimum_cores = 2, .timeout = 30
+	)
+{
+	volatile int done = 0;
+
+	/* Runs for whole quanta, so it sinks to a low priority */
+	int victim(int argl, void* args) {
+		while(!done);
+		return 0;
+	}
+
+	/* Sleep often, so they stay at a high priority */
+	int loader(int argl, void* args) {
+		Mutex mx = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		Mutex_Lock(&mx);
+		while(!done) {
+			TimerDuration t0 = bios_clock();
+			while(bios_clock()-t0 < 5000);
+			Cond_TimedWait(&mx, &cv, 1);
+		}
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	/* The run time of a process so far */
+	unsigned long run_time(Pid_t pid) {
+		Fid_t finfo = OpenInfo();
+		procinfo info;
+		unsigned long t = 0;
+		while(Read(finfo, (char*) &info, sizeof(info)) == sizeof(info))
+			if(info.pid == pid) t = info.usage.run_time;
+		Close(finfo);
+		return t;
+	}
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+
+	Pid_t v = Exec(victim, 0, NULL);
+	ASSERT(v != NOPROC);
+	Cond_TimedWait(&mx, &cv, 300);
+
+	const int L = 8*cpu_cores();
+	Tid_t loaders[L];
+	for(int i=0; i<L; i++)
+		ASSERT((loaders[i] = CreateThread(loader, 0, NULL)) != NOTHREAD);
+
+	/* Give the loaders time to take over the cores */
+	Cond_TimedWait(&mx, &cv, 100);
+	unsigned long before = run_time(v);
+	Cond_TimedWait(&mx, &cv, 1000);
+	unsigned long after = run_time(v);
+
+	done = 1;
+	Mutex_Unlock(&mx);
+	for(int i=0; i<L; i++)
+		ASSERT(ThreadJoin(loaders[i], NULL)==0);
+	ASSERT(WaitChild(v, NULL)==v);
+
+	MSG("low-priority run time: %lu usec in 1 sec\n", after-before);
+
+	/* At least a quantum at the top level */
+	ASSERT_MSG(after-before >= 10000, "The low-priority process ran %lu usec in 1 sec\n", 
+		after-before);
+	return 0;
+}
+
+
+BOOT_TEST(test_tls_keys,
+	"Test that TLS keys give each thread its own values, and that freed keys discard them."
+	)
+{
+	TlsKey_t key = TlsAlloc(NULL);
+	ASSERT(key != NOTLSKEY);
+	ASSERT(TlsGet(key) == NULL);
+	ASSERT(TlsSet(key, &key) == 0);
+	ASSERT(TlsGet(key) == &key);
+
+	/* Bad keys */
+	ASSERT(TlsGet(NOTLSKEY) == NULL);
+	ASSERT(TlsSet(NOTLSKEY, &key) == -1);
+	ASSERT(TlsSet(MAX_TLS_KEYS, &key) == -1);
+
+	/* Each thread has its own value, which it can update without locking */
+	const int N = 10;
+	int counters[N];
+	int counter_task(int argl, void* args) {
+		if(TlsGet(key) != NULL) return -1;
+		TlsSet(key, &counters[argl]);
+		for(int i=0; i<1000; i++) {
+			int* c = TlsGet(key);
+			(*c)++;
+		}
+		return 0;
+	}
+	Tid_t t[N];
+	for(int i=0; i<N; i++) {
+		counters[i] = 0;
+		t[i] = CreateThread(counter_task, i, NULL);
+	}
+	for(int i=0; i<N; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(t[i], &exitval) == 0 && exitval == 0);
+		ASSERT(counters[i] == 1000);
+	}
+	ASSERT(TlsGet(key) == &key);
+
+	/* Freed keys discard all values, and can be reused */
+	ASSERT(TlsFree(key) == 0);
+	ASSERT(TlsFree(key) == -1);
+	ASSERT(TlsGet(key) == NULL);
+	ASSERT(TlsSet(key, &key) == -1);
+	TlsKey_t key2 = TlsAlloc(NULL);
+	ASSERT(key2 == key);
+	ASSERT(TlsGet(key2) == NULL);
+
+	/* Keys run out */
+	TlsKey_t keys[MAX_TLS_KEYS];
+	int n = 0;
+	while((keys[n] = TlsAlloc(NULL)) != NOTLSKEY) n++;
+	ASSERT(n > 0 && n < MAX_TLS_KEYS);
+	while(n > 0) ASSERT(TlsFree(keys[--n]) == 0);
+	ASSERT(TlsFree(key2) == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_tls_destructors,
+	"Test that TLS destructors are called at thread exit, for the main thread and\n"
+	"other threads, and again for values set by destructors."
+	)
+{
+	static int destroyed;
+	static TlsKey_t key, key2;
+	destroyed = 0;
+
+	void destroy(void* value) {
+		__atomic_add_fetch(&destroyed, (intptr_t) value, __ATOMIC_RELAXED);
+		/* The value is already cleared */
+		ASSERT(TlsGet(key) == NULL);
+	}
+	void destroy_and_set(void* value) {
+		TlsSet(key, (void*) 100);
+	}
+
+	key = TlsAlloc(destroy);
+	key2 = TlsAlloc(destroy_and_set);
+	ASSERT(key != NOTLSKEY && key2 != NOTLSKEY);
+
+	int task(int argl, void* args) {
+		TlsSet(key, (void*)(intptr_t) argl);
+		return 0;
+	}
+
+	/* Threads that are joined, detached, and never joined */
+	Tid_t t1 = CreateThread(task, 1, NULL);
+	Tid_t t2 = CreateThread(task, 2, NULL);
+	ThreadDetach(t2);
+	ASSERT(ThreadJoin(t1, NULL) == 0);
+
+	/* The main thread of a process, and a thread that exits without a value */
+	int proc(int argl, void* args) {
+		CreateThread(task, 4, NULL);
+		CreateThread(task, 0, NULL);
+		TlsSet(key, (void*) 8);
+		return 0;
+	}
+	Pid_t pid = Exec(proc, 0, NULL);
+	ASSERT(WaitChild(pid, NULL) == pid);
+
+	/* A destructor sets a new value, which is destroyed too */
+	int task2(int argl, void* args) {
+		TlsSet(key2, (void*) 1);
+		return 0;
+	}
+	ASSERT(ThreadJoin(CreateThread(task2, 0, NULL), NULL) == 0);
+
+	/* t2 is detached, wait for it */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	for(int i=0; i<1000 && destroyed != 115; i++)
+		Cond_TimedWait(&mx, &cv, 1);
+	Mutex_Unlock(&mx);
+	ASSERT_MSG(destroyed == 115, "destroyed=%d\n", destroyed);
+
+	ASSERT(TlsFree(key) == 0);
+	ASSERT(TlsFree(key2) == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_tls_keys_freed_at_exit,
+	"Test that the TLS keys of a process are freed when it exits, except for global keys."
+	)
+{
+	/* Allocate a key and never free it */
+	int leaker(int argl, void* args) {
+		TlsKey_t key = argl ? TlsAllocGlobal(NULL) : TlsAlloc(NULL);
+		return (key == NOTLSKEY) ? -1 : (int) key;
+	}
+
+	for(int i=0; i<2*MAX_TLS_KEYS; i++) {
+		int status;
+		Pid_t pid = Exec(leaker, 0, NULL);
+		ASSERT(pid != NOPROC);
+		ASSERT(WaitChild(pid, &status) == pid);
+		ASSERT_MSG(status >= 0, "TlsAlloc failed in child %d\n", i);
+	}
+
+	TlsKey_t key = TlsAlloc(NULL);
+	ASSERT(key != NOTLSKEY);
+	ASSERT(TlsFree(key) == 0);
+
+	/* A global key stays allocated */
+	int status;
+	Pid_t pid = Exec(leaker, 1, NULL);
+	ASSERT(WaitChild(pid, &status) == pid);
+	ASSERT(status >= 0);
+	ASSERT(TlsSet((TlsKey_t) status, &key) == 0);
+	ASSERT(TlsFree((TlsKey_t) status) == 0);
+	return 0;
+}
+
+
+/* Not inlined, so that every call reads the core of the caller anew */
+static uint __attribute__((noinline)) current_core()
+{
+	return cpu_core_id;
+}
+
+BOOT_TEST(test_set_affinity,
+	"Test that threads and child processes run only on the cores of their affinity,\n"
+	"and that SetAffinity rejects bad arguments.",
+	.minimum_cores = 2
+	)
+{
+	const cpu_mask_t last = 1u << (cpu_cores()-1);
+
+	/* Spin for a while, checking the core we are on */
+	int stay_on_last(int argl, void* args) {
+		int strays = 0;
+		TimerDuration t0 = bios_clock();
+		while(bios_clock()-t0 < 50000)
+			if(current_core() != cpu_cores()-1) strays++;
+		return strays;
+	}
+
+	ASSERT(SetAffinity(NOTHREAD, 0) == -1);
+	if(cpu_cores() < 32)
+		ASSERT(SetAffinity(NOTHREAD, ~((1u << cpu_cores())-1)) == -1);
+
+	/* New threads and children get the default affinity */
+	ASSERT(SetAffinity(NOTHREAD, last) == 0);
+
+	Tid_t t = CreateThread(stay_on_last, 0, NULL);
+	ASSERT(t != NOTHREAD);
+	Pid_t child = Exec(stay_on_last, 0, NULL);
+	ASSERT(child != NOPROC);
+
+	int strays;
+	ASSERT(ThreadJoin(t, &strays) == 0);
+	ASSERT_MSG(strays == 0, "Thread ran off its core %d times\n", strays);
+	ASSERT(WaitChild(child, &strays) == child);
+	ASSERT_MSG(strays == 0, "Child ran off its core %d times\n", strays);
+
+	/* The affinity of a running thread applies when it is next scheduled */
+	ASSERT(SetAffinity(ThreadSelf(), 1) == 0);
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 1);
+	Mutex_Unlock(&mx);
+
+	strays = 0;
+	TimerDuration t0 = bios_clock();
+	while(bios_clock()-t0 < 50000)
+		if(current_core() != 0) strays++;
+	ASSERT_MSG(strays == 0, "Thread ran off core 0 %d times\n", strays);
+
+	ASSERT(SetAffinity(ThreadSelf(), ALL_CORES) == 0);
+	ASSERT(SetAffinity(NOTHREAD, ALL_CORES) == 0);
+	return 0;
+}
+
+
+static int square_task(int argl, void* args)
+{
+	return argl*argl;
+}
+
+BOOT_TEST(test_submit_wait_task,
+	"Test that SubmitTask runs tasks on the task pool and WaitTask returns their results."
+	)
+{
+	const int N = 100;
+	TaskId_t tasks[N];
+
+	for(int i=0; i<N; i++) {
+		tasks[i] = SubmitTask(square_task, i, NULL);
+		ASSERT(tasks[i] != NOTASK);
+	}
+
+	for(int i=0; i<N; i++) {
+		int retval;
+		ASSERT(WaitTask(tasks[i], &retval) == 0);
+		ASSERT(retval == i*i);
+	}
+
+	ASSERT(WaitAll() == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_wait_all_tasks,
+	"Test that WaitAll returns after all submitted tasks are done."
+	)
+{
+	const int N = 200;
+	int done[N];
+
+	int mark(int argl, void* args) {
+		done[argl] = 1;
+		return 0;
+	}
+
+	/* Nothing submitted yet */
+	ASSERT(WaitAll() == 0);
+
+	for(int i=0; i<N; i++) done[i] = 0;
+	for(int i=0; i<N; i++)
+		ASSERT(SubmitTask(mark, i, NULL) != NOTASK);
+
+	ASSERT(WaitAll() == 0);
+	for(int i=0; i<N; i++)
+		ASSERT(done[i] == 1);
+
+	/* The pool can be used again */
+	TaskId_t t = SubmitTask(square_task, 7, NULL);
+	int retval;
+	ASSERT(WaitTask(t, &retval) == 0);
+	ASSERT(retval == 49);
+	return 0;
+}
+
+
+static int fib_task(int n, void* args)
+{
+	if(n < 2) return n;
+
+	/* Submit one half and compute the other, as a fork-join program would */
+	TaskId_t t = SubmitTask(fib_task, n-1, NULL);
+	int f2 = fib_task(n-2, NULL);
+	int f1;
+	if(WaitTask(t, &f1) != 0) return -1;
+	return f1 + f2;
+}
+
+BOOT_TEST(test_nested_tasks,
+	"Test that tasks can submit and wait for other tasks, without running out of workers."
+	)
+{
+	int retval;
+	TaskId_t t = SubmitTask(fib_task, 15, NULL);
+	ASSERT(t != NOTASK);
+	ASSERT(WaitTask(t, &retval) == 0);
+	ASSERT(retval == 610);
+
+	/* Several roots, each with many more tasks than workers */
+	TaskId_t roots[4];
+	for(int i=0; i<4; i++)
+		roots[i] = SubmitTask(fib_task, 12+i, NULL);
+	const int expected[4] = { 144, 233, 377, 610 };
+	for(int i=0; i<4; i++) {
+		ASSERT(WaitTask(roots[i], &retval) == 0);
+		ASSERT(retval == expected[i]);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_exit_with_task_pool,
+	"Test that a process that calls Exit stops its task pool, and runs its queued tasks."
 	)
 {
-	int flag = 0;
+	static int ran;
+	int count(int argl, void* args) {
+		__atomic_add_fetch(&ran, 1, __ATOMIC_RELAXED);
+		return argl;
+	}
+	int waits(int argl, void* args) {
+		int retval;
+		if(WaitTask(SubmitTask(square_task, argl, NULL), &retval) != 0) return -1;
+		Exit(retval);
+		return -1;
+	}
+	int leaves(int argl, void* args) {
+		for(int i=0; i<argl; i++) SubmitTask(count, i, NULL);
+		Exit(0);
+		return -1;
+	}
 
-	int task(int argl, void* args) {
-		ASSERT(args == &flag);
-		*(int*)args = 1;
-		return 2;
+	const int N = 50;
+	int status;
+	for(int i=0; i<N; i++)
+		ASSERT(Exec(waits, i, NULL) != NOPROC);
+	for(int i=0; i<N; i++) {
+		Pid_t pid = WaitChild(NOPROC, &status);
+		ASSERT(pid != NOPROC);
+		ASSERT(status >= 0 && status < N*N);
 	}
 
-	Tid_t t = CreateThread(task, sizeof(flag), &flag);
-	ASSERT(t!=NOTHREAD);
-	int exitval;
-	ASSERT(ThreadJoin(t, &exitval)==0);
-	ASSERT(flag==1);
+	/* Queued tasks still run */
+	ran = 0;
+	ASSERT(Exec(leaves, 20, NULL) != NOPROC);
+	ASSERT(WaitChild(NOPROC, &status) != NOPROC && status == 0);
+	ASSERT(ran == 20);
 	return 0;
 }
 
 
-BOOT_TEST(test_exit_many_threads,
-	"Test that a process thread calling Exit will clean up correctly.",
-	.timeout = 60
+BOOT_TEST(test_task_errors,
+	"Test that the task pool calls reject bad arguments."
 	)
 {
+	int wait_all_in_task(int argl, void* args) {
+		return WaitAll();
+	}
 
-	int task(int argl, void* args) {
-		fibo(40);
-		return 2;
+	int retval;
+	ASSERT(SubmitTask(NULL, 0, NULL) == NOTASK);
+	ASSERT(WaitTask(NOTASK, NULL) == -1);
+
+	/* A task can be waited for once, even after its TaskCB is reused */
+	TaskId_t t = SubmitTask(square_task, 3, NULL);
+	ASSERT(WaitTask(t, NULL) == 0);
+	ASSERT(WaitTask(t, NULL) == -1);
+	TaskId_t t2 = SubmitTask(square_task, 4, NULL);
+	ASSERT(t2 != t);
+	ASSERT(WaitTask(t, NULL) == -1);
+	ASSERT(WaitTask(t2, &retval) == 0 && retval == 16);
+
+	/* Ids that were never returned */
+	ASSERT(WaitTask(t2 + 1000, NULL) == -1);
+	ASSERT(WaitTask(t2 ^ ((TaskId_t)1 << 40), NULL) == -1);
+
+	/* A task cannot wait for all tasks, including itself */
+	t = SubmitTask(wait_all_in_task, 0, NULL);
+	ASSERT(WaitTask(t, &retval) == 0);
+	ASSERT(retval == -1);
+	return 0;
+}
+
+
+
+static int co_counter;
+
+static int co_yielder(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		__atomic_add_fetch(&co_counter, 1, __ATOMIC_RELAXED);
+		CoYield();
 	}
+	return 0;
+}
 
-	int mthread(int argl, void* args){
-		for(int i=0;i<5;i++)
-			ASSERT(CreateThread(task, 0, NULL) != NOTHREAD);
+static int co_spawner(int argl, void* args)
+{
+	for(int i=0; i<argl; i++)
+		if(CoSpawn(co_yielder, 10, NULL) == NULL) return -1;
+	return 42;
+}
 
-		fibo(35);
-		return 0;
+BOOT_TEST(test_coroutines_yield,
+	"Test that CoRun runs many coroutines on a few threads, until they all return."
+	)
+{
+	ASSERT(CoRun(0, co_spawner, 1, NULL) == -1);
+	ASSERT(CoRun(1, NULL, 0, NULL) == -1);
+
+	for(unsigned int nthreads=1; nthreads<=3; nthreads++) {
+		co_counter = 0;
+		ASSERT(CoRun(nthreads, co_spawner, 1000, NULL) == 42);
+		ASSERT(co_counter == 10000);
 	}
+	return 0;
+}
 
-	Exec(mthread, 0, NULL);
-	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
 
+/* Read ints from a pipe and send them back doubled, until end of data */
+static int co_echo(int argl, void* args)
+{
+	pipe_t* p = args;
+	int x, n;
+
+	while(CoAwait(p[0].read, POLL_READ) == POLL_READ 
+		&& (n = Read(p[0].read, (char*)&x, sizeof(x))) == sizeof(x)) {
+		x *= 2;
+		if(CoAwait(p[1].write, POLL_WRITE) != POLL_WRITE) return -1;
+		if(Write(p[1].write, (char*)&x, sizeof(x)) != sizeof(x)) return -1;
+	}
+
+	Close(p[0].read);
+	Close(p[1].write);
 	return 0;
 }
 
+/* Send rounds of requests to N echo coroutines, and add up the replies */
+static int co_echo_main(int N, void* args)
+{
+	const int rounds = 100;
+	pipe_t pipes[N][2];
+	int sum = 0, x;
+
+	for(int i=0; i<N; i++) {
+		if(Pipe(&pipes[i][0]) || Pipe(&pipes[i][1])) return -1;
+		CoSpawn(co_echo, 0, pipes[i]);
+	}
+
+	/* Let the echo coroutines block first */
+	CoYield();
+
+	for(int r=0; r<rounds; r++) {
+		for(int i=0; i<N; i++) {
+			x = r+i;
+			if(Write(pipes[i][0].write, (char*)&x, sizeof(x)) != sizeof(x)) return -1;
+		}
+		for(int i=N-1; i>=0; i--) {
+			CoAwait(pipes[i][1].read, POLL_READ);
+			if(Read(pipes[i][1].read, (char*)&x, sizeof(x)) != sizeof(x)) return -1;
+			sum += x;
+		}
+	}
 
+	/* The echo coroutines get end of data, and so do we */
+	for(int i=0; i<N; i++) {
+		Close(pipes[i][0].write);
+		CoAwait(pipes[i][1].read, POLL_READ);
+		if(Read(pipes[i][1].read, (char*)&x, sizeof(x)) != 0) return -1;
+		Close(pipes[i][1].read);
+	}
+	return sum;
+}
 
+BOOT_TEST(test_coroutines_await,
+	"Test that coroutines awaiting streams are resumed when the streams become ready."
+	)
+{
+	/* Each process has few fids: 4 per echo coroutine, and 2 for CoRun */
+	const int N = 3;
+	const int expected = 2*(N*99*100/2 + 100*N*(N-1)/2);
+	ASSERT(CoRun(1, co_echo_main, N, NULL) == expected);
+	ASSERT(CoRun(2, co_echo_main, N, NULL) == expected);
+	return 0;
+}
 
 
 
@@ -977,6 +1948,21 @@ TEST_SUITE(thread_tests,
 {
 	&test_create_join_thread,
 	&test_exit_many_threads,
+	&test_join_detach_semantics,
+	&test_exit_thousands_of_threads,
+	&test_tls_keys,
+	&test_tls_destructors,
+	&test_tls_keys_freed_at_exit,
+	&test_wakeup_latency,
+	&test_boost_under_load,
+	&test_set_affinity,
+	&test_submit_wait_task,
+	&test_wait_all_tasks,
+	&test_nested_tasks,
+	&test_exit_with_task_pool,
+	&test_task_errors,
+	&test_coroutines_yield,
+	&test_coroutines_await,
 	NULL
 };
 
@@ -1194,6 +2180,585 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
+BOOT_TEST(test_poll_pipe,
+	"Test that Poll reports the readiness of the ends of a pipe, and blocks until one is ready."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	poll_fid pf[3] = {
+		{ .fid = pipe.read, .events = POLL_READ },
+		{ .fid = pipe.write, .events = POLL_WRITE },
+		{ .fid = MAX_FILEID-1, .events = POLL_READ }
+	};
+
+	ASSERT(Poll(NULL, 1, 0) == -1);
+
+	/* An empty pipe can be written, a closed fid is reported */
+	ASSERT(Poll(pf, 3, 0) == 2);
+	ASSERT(pf[0].revents == 0);
+	ASSERT(pf[1].revents == POLL_WRITE);
+	ASSERT(pf[2].revents == POLL_BADFID);
+
+	/* The timeout expires */
+	TimerDuration t0 = bios_clock();
+	ASSERT(Poll(pf, 1, 20) == 0);
+	ASSERT(bios_clock() - t0 >= 20000);
+
+	/* A writer makes the reader ready */
+	int writer(int argl, void* args) {
+		Mutex mx = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 20);
+		Mutex_Unlock(&mx);
+		ASSERT(Write(pipe.write, "x", 1) == 1);
+		return 0;
+	}
+	Tid_t t = CreateThread(writer, 0, NULL);
+	ASSERT(Poll(pf, 1, POLL_FOREVER) == 1);
+	ASSERT(pf[0].revents == POLL_READ);
+	ASSERT(ThreadJoin(t, NULL) == 0);
+
+	char c;
+	ASSERT(Read(pipe.read, &c, 1) == 1);
+	ASSERT(Poll(pf, 1, 0) == 0);
+
+	/* End of data is reported as readiness */
+	ASSERT(Close(pipe.write) == 0);
+	ASSERT(Poll(pf, 1, 0) == 1);
+	ASSERT(Read(pipe.read, &c, 1) == 0);
+
+	ASSERT(Close(pipe.read) == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_channel_batch,
+	"Test that messages are moved through a channel in batches, in order and without copying."
+	)
+{
+	pipe_t ch;
+	ASSERT(Channel(&ch, 0) == -1);
+	ASSERT(Channel(&ch, 4) == 0);
+
+	ASSERT(MsgAlloc(MAX_MSG_SIZE+1) == NULL);
+
+	void* msgs[6];
+	for(int i=0; i<6; i++) {
+		msgs[i] = MsgAlloc(i*100);
+		ASSERT(msgs[i] != NULL);
+		ASSERT(MsgSize(msgs[i]) == i*100);
+		memset(msgs[i], i, i*100);
+	}
+
+	/* Only the wrong ends and allocated messages are accepted */
+	ASSERT(SendBatch(ch.read, msgs, 1) == -1);
+	ASSERT(RecvBatch(ch.write, msgs, 1) == -1);
+	void* bad = msgs[0];
+	int x;
+	msgs[0] = &x;
+	ASSERT(SendBatch(ch.write, msgs, 1) == -1);
+	msgs[0] = bad;
+
+	/* A repeated message fails the whole batch, and nothing is sent */
+	void* twice[3] = { msgs[1], msgs[2], msgs[1] };
+	ASSERT(SendBatch(ch.write, twice, 3) == -1);
+	ASSERT(Poll(&(poll_fid){ .fid = ch.read, .events = POLL_READ }, 1, 0) == 0);
+	ASSERT(MsgSize(msgs[1]) == 100 && MsgSize(msgs[2]) == 200);
+
+	/* A full channel takes as many as fit */
+	void* sent[6];
+	memcpy(sent, msgs, sizeof(msgs));
+	ASSERT(SendBatch(ch.write, msgs, 6) == 4);
+	ASSERT(Poll(&(poll_fid){ .fid = ch.write, .events = POLL_WRITE }, 1, 0) == 0);
+
+	void* recvd[6];
+	/* Queued messages belong to the channel: they cannot be sent again, 
+	   or freed, but the ones that did not fit still belong to the caller */
+	ASSERT(MsgSize(sent[1]) == 0);
+	ASSERT(SendBatch(ch.write, msgs+1, 1) == -1);
+	MsgFree(sent[1]);
+	ASSERT(MsgSize(sent[4]) == 400);
+
+	ASSERT(RecvBatch(ch.read, recvd, 3) == 3);
+	ASSERT(SendBatch(ch.write, msgs+4, 2) == 2);
+	ASSERT(RecvBatch(ch.read, recvd+3, 6) == 3);
+
+	/* The receiver gets the same buffers */
+	for(int i=0; i<6; i++) {
+		ASSERT(recvd[i] == sent[i]);
+		ASSERT(MsgSize(recvd[i]) == i*100);
+		for(int j=0; j<i*100; j++)
+			ASSERT(((char*)recvd[i])[j] == i);
+		MsgFree(recvd[i]);
+	}
+
+	/* A closed reader fails the sender, a closed writer ends the data */
+	msgs[0] = MsgAlloc(1);
+	ASSERT(SendBatch(ch.write, msgs, 1) == 1);
+	ASSERT(Close(ch.write) == 0);
+	ASSERT(RecvBatch(ch.read, recvd, 6) == 1);
+	MsgFree(recvd[0]);
+	ASSERT(RecvBatch(ch.read, recvd, 6) == 0);
+	ASSERT(Close(ch.read) == 0);
+
+	ASSERT(Channel(&ch, 1) == 0);
+	ASSERT(Close(ch.read) == 0);
+	msgs[0] = MsgAlloc(1);
+	ASSERT(SendBatch(ch.write, msgs, 1) == -1);
+	MsgFree(msgs[0]);
+	ASSERT(Close(ch.write) == 0);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_channel_read_write,
+	"Test that Read and Write on a channel copy one message at a time."
+	)
+{
+	pipe_t ch;
+	ASSERT(Channel(&ch, 2) == 0);
+
+	ASSERT(Write(ch.write, "hello", 5) == 5);
+	ASSERT(Write(ch.write, "", 0) == 0);
+
+	/* Messages are not merged, or split */
+	char buf[16];
+	ASSERT(Read(ch.read, buf, 4) == -1);
+	ASSERT(Read(ch.read, buf, sizeof(buf)) == 5);
+	ASSERT(memcmp(buf, "hello", 5) == 0);
+	ASSERT(Read(ch.read, buf, sizeof(buf)) == 0);
+
+	/* Writing to a full channel blocks */
+	ASSERT(Write(ch.write, "a", 1) == 1);
+	ASSERT(Write(ch.write, "b", 1) == 1);
+	int reader(int argl, void* args) {
+		Mutex mx = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 20);
+		Mutex_Unlock(&mx);
+		char c;
+		ASSERT(Read(ch.read, &c, 1) == 1);
+		ASSERT(c == 'a');
+		return 0;
+	}
+	Tid_t t = CreateThread(reader, 0, NULL);
+	TimerDuration t0 = bios_clock();
+	ASSERT(Write(ch.write, "c", 1) == 1);
+	ASSERT(bios_clock() - t0 >= 20000);
+	ASSERT(ThreadJoin(t, NULL) == 0);
+
+	/* Queued messages remain readable after the writer closes */
+	ASSERT(Close(ch.write) == 0);
+	ASSERT(Read(ch.read, buf, 1) == 1 && buf[0] == 'b');
+	ASSERT(Read(ch.read, buf, 1) == 1 && buf[0] == 'c');
+	ASSERT(Read(ch.read, buf, 1) == 0);
+	ASSERT(Close(ch.read) == 0);
+
+	/* Closing the reader frees the queued messages */
+	ASSERT(Channel(&ch, 2) == 0);
+	ASSERT(Write(ch.write, "x", 1) == 1);
+	ASSERT(Close(ch.read) == 0);
+	ASSERT(Write(ch.write, "x", 1) == -1);
+	ASSERT(Close(ch.write) == 0);
+
+	return 0;
+}
+
+
+static int channel_producer(int argl, void* args)
+{
+	Fid_t fid = ((Fid_t*)args)[0];
+	int N = ((Fid_t*)args)[1];
+
+	void* msgs[8];
+	for(int i=0; i<N; ) {
+		int n = 0;
+		for(; n<8 && i+n<N; n++) {
+			msgs[n] = MsgAlloc(sizeof(int));
+			*(int*)msgs[n] = i+n;
+		}
+		int sent = 0;
+		while(sent < n) {
+			int rc = SendBatch(fid, msgs+sent, n-sent);
+			ASSERT(rc > 0);
+			sent += rc;
+		}
+		i += n;
+	}
+	return 0;
+}
+
+static int channel_consumer(int argl, void* args)
+{
+	Fid_t fid = ((Fid_t*)args)[0];
+
+	int sum = 0;
+	void* msgs[8];
+	int n;
+	while((n = RecvBatch(fid, msgs, 8)) > 0) {
+		for(int i=0; i<n; i++) {
+			ASSERT(MsgSize(msgs[i]) == sizeof(int));
+			sum += *(int*)msgs[i];
+			MsgFree(msgs[i]);
+		}
+	}
+	ASSERT(n == 0);
+	return sum;
+}
+
+BOOT_TEST(test_channel_mpmc,
+	"Test a channel shared by 4 producer and 4 consumer threads."
+	)
+{
+	pipe_t ch;
+	ASSERT(Channel(&ch, 16) == 0);
+
+	const int N = 5000;
+	Fid_t pargs[2] = { ch.write, N };
+	Fid_t cargs[2] = { ch.read, 0 };
+
+	Tid_t prod[4], cons[4];
+	for(int i=0; i<4; i++) {
+		cons[i] = CreateThread(channel_consumer, sizeof(cargs), cargs);
+		prod[i] = CreateThread(channel_producer, sizeof(pargs), pargs);
+	}
+
+	for(int i=0; i<4; i++)
+		ASSERT(ThreadJoin(prod[i], NULL) == 0);
+	ASSERT(Close(ch.write) == 0);
+
+	int total = 0;
+	for(int i=0; i<4; i++) {
+		int sum;
+		ASSERT(ThreadJoin(cons[i], &sum) == 0);
+		total += sum;
+	}
+	ASSERT(total == 4 * (N*(N-1)/2));
+
+	ASSERT(Close(ch.read) == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_shm_open,
+	"Test that shared memory segments are found by name, and released when the last file id closes."
+	)
+{
+	ASSERT(ShmOpen(NULL, 64) == NOFILE);
+	ASSERT(ShmOpen("", 64) == NOFILE);
+	ASSERT(ShmOpen("a_name_that_is_longer_than_allowed", 64) == NOFILE);
+	ASSERT(ShmOpen("seg", 0) == NOFILE);
+
+	Fid_t f1 = ShmOpen("seg", 100);
+	ASSERT(f1 != NOFILE);
+	char* p = ShmMap(f1);
+	ASSERT(p != NULL);
+	ASSERT(ShmSize(p) == 100);
+	for(int i=0; i<100; i++) ASSERT(p[i] == 0);
+	strcpy(p, "shared");
+
+	/* Opening by name gives the same memory */
+	ASSERT(ShmOpen("seg", 101) == NOFILE);
+	Fid_t f2 = ShmOpen("seg", 0);
+	ASSERT(f2 != NOFILE && f2 != f1);
+	ASSERT(ShmMap(f2) == p);
+
+	/* Other streams are not segments */
+	Fid_t null = OpenNull();
+	ASSERT(ShmMap(null) == NULL);
+	ASSERT(ShmClose(null) == -1);
+	ASSERT(Close(null) == 0);
+	ASSERT(ShmMap(NOFILE) == NULL);
+
+	/* A child process can open it by name */
+	int child(int argl, void* args) {
+		Fid_t f = ShmOpen("seg", 0);
+		ASSERT(f != NOFILE);
+		char* q = ShmMap(f);
+		ASSERT(strcmp(q, "shared") == 0);
+		strcpy(q, "changed");
+		return 0;
+	}
+	ASSERT(Exec(child, 0, NULL) != NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL) != NOPROC);
+	ASSERT(strcmp(p, "changed") == 0);
+
+	/* After the last close, the name refers to a new segment */
+	ASSERT(ShmClose(f1) == 0);
+	ASSERT(strcmp(ShmMap(f2), "changed") == 0);
+	ASSERT(ShmClose(f2) == 0);
+	ASSERT(ShmOpen("seg", 0) == NOFILE);
+
+	f1 = ShmOpen("seg", 10);
+	ASSERT(f1 != NOFILE);
+	ASSERT(ShmSize(ShmMap(f1)) == 10);
+	ASSERT(((char*)ShmMap(f1))[0] == 0);
+	ASSERT(ShmClose(f1) == 0);
+
+	return 0;
+}
+
+
+static int shm_allocator(int argl, void* args)
+{
+	Fid_t fid = ShmOpen("alloc", 0);
+	ASSERT(fid != NOFILE);
+	void* shm = ShmMap(fid);
+
+	/* Fill every block with our id, until the segment is exhausted */
+	int count = 0;
+	int* block;
+	while((block = ShmAlloc(shm, 4*sizeof(int))) != NULL) {
+		ASSERT(((uintptr_t)block) % 16 == 0);
+		for(int i=0; i<4; i++) {
+			ASSERT(block[i] == 0);
+			block[i] = argl;
+		}
+		count++;
+	}
+	ASSERT(ShmClose(fid) == 0);
+	return count;
+}
+
+BOOT_TEST(test_shm_alloc,
+	"Test that processes allocate disjoint memory from a shared segment concurrently."
+	)
+{
+	const int blocks = 4000;
+	Fid_t fid = ShmOpen("alloc", blocks*16);
+	ASSERT(fid != NOFILE);
+	int* mem = ShmMap(fid);
+
+	for(int p=1; p<=4; p++)
+		ASSERT(Exec(shm_allocator, p, NULL) != NOPROC);
+
+	int total = 0;
+	for(int p=1; p<=4; p++) {
+		int count;
+		ASSERT(WaitChild(NOPROC, &count) != NOPROC);
+		total += count;
+	}
+	ASSERT(total == blocks);
+	ASSERT(ShmAlloc(mem, 1) == NULL);
+	ASSERT(ShmAlloc(mem, 0) != NULL);
+
+	/* No block was written by two processes */
+	int per_proc[5] = {0};
+	for(int b=0; b<blocks; b++) {
+		int p = mem[4*b];
+		ASSERT(p >= 1 && p <= 4);
+		for(int i=1; i<4; i++) ASSERT(mem[4*b+i] == p);
+		per_proc[p]++;
+	}
+	ASSERT(per_proc[1]+per_proc[2]+per_proc[3]+per_proc[4] == blocks);
+
+	ASSERT(ShmClose(fid) == 0);
+	return 0;
+}
+
+
+/* Take all completions of a ring, storing each result at index user_data */
+static int ioring_drain(io_ring* ring, int* results)
+{
+	int n = 0;
+	io_cqe* cqe;
+	while((cqe = IoRingPeekCqe(ring)) != NULL) {
+		results[cqe->user_data] = cqe->result;
+		IoRingCqeSeen(ring);
+		n++;
+	}
+	return n;
+}
+
+BOOT_TEST(test_ioring_pipe,
+	"Test that a submission ring executes batches of reads and writes on a pipe."
+	)
+{
+	ASSERT(IoRingEnter(0, 0) == -1);
+	ASSERT(IoRingSetup(0) == NULL);
+	ASSERT(IoRingSetup(MAX_IORING_ENTRIES+1) == NULL);
+	io_ring* ring = IoRingSetup(3);
+	ASSERT(ring != NULL);
+	ASSERT(ring->entries == 4);
+	ASSERT(IoRingSetup(4) == NULL);
+
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe) == 0);
+
+	/* Ready operations complete within the call, in order */
+	char msg[] = "hello";
+	io_sqe* sqe = IoRingGetSqe(ring);
+	sqe->op = IO_WRITE; sqe->fid = pipe.write; sqe->buf = msg; sqe->size = 5; sqe->user_data = 1;
+	sqe = IoRingGetSqe(ring);
+	sqe->op = IO_NOP; sqe->user_data = 2;
+	sqe = IoRingGetSqe(ring);
+	sqe->op = IO_READ; sqe->fid = MAX_FILEID-1; sqe->user_data = 3;
+	ASSERT(IoRingEnter(0, 0) == 3);
+
+	io_cqe* cqe;
+	for(int i=1; i<=3; i++) {
+		ASSERT((cqe = IoRingPeekCqe(ring)) != NULL);
+		ASSERT(cqe->user_data == i);
+		ASSERT(cqe->result == (i==1 ? 5 : i==2 ? 0 : -1));
+		IoRingCqeSeen(ring);
+	}
+	ASSERT(IoRingPeekCqe(ring) == NULL);
+
+	char buf[16];
+	int results[32];
+	sqe = IoRingGetSqe(ring);
+	sqe->op = IO_READ; sqe->fid = pipe.read; sqe->buf = buf; sqe->size = sizeof(buf); sqe->user_data = 4;
+	ASSERT(IoRingEnter(1, POLL_FOREVER) == 1);
+	ASSERT(ioring_drain(ring, results) == 1 && results[4] == 5);
+	ASSERT(memcmp(buf, "hello", 5) == 0);
+
+	/* A read of an empty pipe is completed by a worker, after the write */
+	sqe = IoRingGetSqe(ring);
+	sqe->op = IO_READ; sqe->fid = pipe.read; sqe->buf = buf; sqe->size = sizeof(buf); sqe->user_data = 5;
+	ASSERT(IoRingEnter(0, 0) == 1);
+	ASSERT(IoRingEnter(1, 20) == 0);
+	ASSERT(IoRingPeekCqe(ring) == NULL);
+
+	sqe = IoRingGetSqe(ring);
+	sqe->op = IO_WRITE; sqe->fid = pipe.write; sqe->buf = "abc"; sqe->size = 3; sqe->user_data = 6;
+	ASSERT(IoRingEnter(2, POLL_FOREVER) == 1);
+	ASSERT(ioring_drain(ring, results) == 2);
+	ASSERT(results[5] == 3 && results[6] == 3);
+	ASSERT(memcmp(buf, "abc", 3) == 0);
+
+	/* Submission stops when the completion queue would overflow */
+	for(int round=0; round<2; round++) {
+		for(int i=0; i<4; i++) {
+			ASSERT((sqe = IoRingGetSqe(ring)) != NULL);
+			sqe->op = IO_NOP; sqe->user_data = 10+4*round+i;
+		}
+		ASSERT(IoRingGetSqe(ring) == NULL);
+		ASSERT(IoRingEnter(0, 0) == 4);
+	}
+	ASSERT((sqe = IoRingGetSqe(ring)) != NULL);
+	sqe->op = IO_NOP; sqe->user_data = 18;
+	ASSERT(IoRingEnter(0, 0) == 0);
+	ASSERT(ioring_drain(ring, results) == 8);
+	ASSERT(IoRingEnter(1, 0) == 1);
+	ASSERT(ioring_drain(ring, results) == 1);
+
+	/* Close through the ring */
+	sqe = IoRingGetSqe(ring);
+	sqe->op = IO_CLOSE; sqe->fid = pipe.write; sqe->user_data = 19;
+	sqe = IoRingGetSqe(ring);
+	sqe->op = IO_READ; sqe->fid = pipe.read; sqe->buf = buf; sqe->size = sizeof(buf); sqe->user_data = 20;
+	ASSERT(IoRingEnter(2, POLL_FOREVER) == 2);
+	ASSERT(ioring_drain(ring, results) == 2);
+	ASSERT(results[19] == 0 && results[20] == 0);
+	ASSERT(Close(pipe.read) == 0);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_fidopen_buffering,
+	"Test that fidopen streams on pipes are buffered, and flushed by fflush, fclose and process exit."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe) == 0);
+	ASSERT(IsTerminal(pipe.read) == 0);
+	ASSERT(IsTerminal(MAX_FILEID-1) == 0);
+
+	poll_fid pf = { .fid = pipe.read, .events = POLL_READ };
+	char buf[64];
+
+	/* Nothing is written until a flush */
+	FILE* fout = fidopen(pipe.write, "w");
+	ASSERT(fout != NULL);
+	for(int i=0; i<10; i++) fputc('a'+i, fout);
+	fprintf(fout, "\n");
+	ASSERT(Poll(&pf, 1, 0) == 0);
+	ASSERT(fflush(fout) == 0);
+	ASSERT(Read(pipe.read, buf, sizeof(buf)) == 11);
+	ASSERT(memcmp(buf, "abcdefghij\n", 11) == 0);
+
+	fputs("closed", fout);
+	ASSERT(Poll(&pf, 1, 0) == 0);
+	ASSERT(fclose(fout) == 0);
+	ASSERT(Read(pipe.read, buf, sizeof(buf)) == 6);
+
+	/* A process that exits flushes the streams its threads left open,
+	   including streams used after the thread that opened them exited */
+	static FILE* handed;
+	int opener(int argl, void* args) {
+		handed = fidopen(pipe.write, "w");
+		fputs("handed", handed);
+		return 0;
+	}
+	int user(int argl, void* args) {
+		fputs(" over", handed);
+		return 0;
+	}
+	int process(int argl, void* args) {
+		ASSERT(ThreadJoin(CreateThread(opener, 0, NULL), NULL) == 0);
+		ASSERT(Poll(&pf, 1, 0) == 0);
+		ASSERT(ThreadJoin(CreateThread(user, 0, NULL), NULL) == 0);
+		ASSERT(Poll(&pf, 1, 0) == 0);
+		return 0;
+	}
+	int status;
+	ASSERT(Exec(process, 0, NULL) != NOPROC);
+	ASSERT(WaitChild(NOPROC, &status) != NOPROC && status == 0);
+	ASSERT(Read(pipe.read, buf, sizeof(buf)) == 11);
+	ASSERT(memcmp(buf, "handed over", 11) == 0);
+
+	/* So does a process that calls Exit */
+	int child(int argl, void* args) {
+		FILE* f = fidopen(pipe.write, "w");
+		fputs("exited", f);
+		Exit(0);
+		return 1;
+	}
+	ASSERT(Exec(child, 0, NULL) != NOPROC);
+	ASSERT(WaitChild(NOPROC, &status) != NOPROC && status == 0);
+	ASSERT(Read(pipe.read, buf, sizeof(buf)) == 6);
+
+	/* Exit handlers run in reverse order, and are limited */
+	static char order[MAX_EXIT_HANDLERS+1];
+	static int norder;
+	void first() { order[norder++] = '1'; }
+	void second() { order[norder++] = '2'; }
+	int registrar(int argl, void* args) {
+		if(AtExit(NULL) != -1) return 1;
+		for(int i=0; i<MAX_EXIT_HANDLERS; i++)
+			if(AtExit(i==0 ? first : second) != 0) return 2;
+		if(AtExit(second) != -1) return 3;
+		return 0;
+	}
+	norder = 0;
+	ASSERT(Exec(registrar, 0, NULL) != NOPROC);
+	ASSERT(WaitChild(NOPROC, &status) != NOPROC && status == 0);
+	ASSERT(norder == MAX_EXIT_HANDLERS);
+	ASSERT(order[0] == '2' && order[MAX_EXIT_HANDLERS-1] == '1');
+
+	/* Reads are buffered too */
+	ASSERT(Write(pipe.write, "xyz", 3) == 3);
+	ASSERT(Close(pipe.write) == 0);
+	FILE* fin = fidopen(pipe.read, "r");
+	ASSERT(fgetc(fin) == 'x');
+	ASSERT(Poll(&pf, 1, 0) == 1);	/* End of data */
+	ASSERT(fgetc(fin) == 'y');
+	ASSERT(fgetc(fin) == 'z');
+	ASSERT(fgetc(fin) == EOF);
+	fclose(fin);
+
+	ASSERT(Close(pipe.read) == 0);
+	return 0;
+}
+
+
+
 TEST_SUITE(pipe_tests,
 	"A suite of tests for pipes. We are focusing on correctness, not performance."
 	)
@@ -1204,6 +2769,14 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_close_writer,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
+	&test_poll_pipe,
+	&test_channel_batch,
+	&test_channel_read_write,
+	&test_channel_mpmc,
+	&test_shm_open,
+	&test_shm_alloc,
+	&test_ioring_pipe,
+	&test_fidopen_buffering,
 	NULL
 };
 
@@ -1734,6 +3307,122 @@ BOOT_TEST(test_shutdown_write,
 
 
 
+BOOT_TEST(test_ioring_socket,
+	"Test that a submission ring accepts, connects and transfers data on sockets."
+	)
+{
+	io_ring* ring = IoRingSetup(8);
+	ASSERT(ring != NULL);
+
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock) == 0);
+	Fid_t cli = Socket(NOPORT);
+
+	/* Both block, so they are executed by workers */
+	io_sqe* sqe = IoRingGetSqe(ring);
+	sqe->op = IO_ACCEPT; sqe->fid = lsock; sqe->user_data = 1;
+	sqe = IoRingGetSqe(ring);
+	sqe->op = IO_CONNECT; sqe->fid = cli; sqe->port = 100; sqe->timeout = 1000; sqe->user_data = 2;
+	ASSERT(IoRingEnter(2, POLL_FOREVER) == 2);
+
+	int results[3];
+	ASSERT(ioring_drain(ring, results) == 2);
+	Fid_t srv = results[1];
+	ASSERT(srv != NOFILE);
+	ASSERT(results[2] == 0);
+
+	/* Many writes, then many reads, in one call each */
+	char out[4][8] = { "one", "two", "three", "four" };
+	char in[32];
+	for(int i=0; i<4; i++) {
+		sqe = IoRingGetSqe(ring);
+		sqe->op = IO_WRITE; sqe->fid = cli; sqe->buf = out[i]; sqe->size = strlen(out[i]); sqe->user_data = 10+i;
+	}
+	ASSERT(IoRingEnter(4, POLL_FOREVER) == 4);
+	for(int i=0; i<4; i++) {
+		io_cqe* cqe = IoRingPeekCqe(ring);
+		ASSERT(cqe != NULL && cqe->user_data == 10+i && cqe->result == strlen(out[i]));
+		IoRingCqeSeen(ring);
+	}
+
+	sqe = IoRingGetSqe(ring);
+	sqe->op = IO_READ; sqe->fid = srv; sqe->buf = in; sqe->size = sizeof(in); sqe->user_data = 20;
+	ASSERT(IoRingEnter(1, POLL_FOREVER) == 1);
+	io_cqe* cqe = IoRingPeekCqe(ring);
+	ASSERT(cqe != NULL && cqe->user_data == 20 && cqe->result == 15);
+	ASSERT(memcmp(in, "onetwothreefour", 15) == 0);
+	IoRingCqeSeen(ring);
+
+	Close(cli);
+	Close(srv);
+	Close(lsock);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_ioring_exit_cancels,
+	"Test that a process exits while its ring has an Accept and a Read in flight, and that they fail."
+	)
+{
+	/* Submit an Accept and a Read that never become ready */
+	static int results[3];
+	void submit(io_ring* ring, Fid_t lsock, Fid_t rfid, char* buf) {
+		io_sqe* sqe = IoRingGetSqe(ring);
+		sqe->op = IO_ACCEPT; sqe->fid = lsock; sqe->user_data = 1;
+		sqe = IoRingGetSqe(ring);
+		sqe->op = IO_READ; sqe->fid = rfid; sqe->buf = buf; sqe->size = 8; sqe->user_data = 2;
+		ASSERT(IoRingEnter(0, 0) == 2);
+		ASSERT(IoRingEnter(1, 20) == 0);
+	}
+
+	/* A thread that waits for the completions, posted as the main thread exits */
+	int waiter(int argl, void* args) {
+		io_ring* ring = args;
+		ASSERT(IoRingEnter(2, POLL_FOREVER) == 0);
+		ASSERT(ioring_drain(ring, results) == 2);
+		return 0;
+	}
+	int returns(int argl, void* args) {
+		char buf[8];
+		pipe_t pipe;
+		io_ring* ring = IoRingSetup(4);
+		Fid_t lsock = Socket(101);
+		ASSERT(Listen(lsock) == 0);
+		ASSERT(Pipe(&pipe) == 0);
+		submit(ring, lsock, pipe.read, buf);
+		CreateThread(waiter, 0, ring);
+		return 5;
+	}
+	int exits(int argl, void* args) {
+		char buf[8];
+		pipe_t pipe;
+		io_ring* ring = IoRingSetup(4);
+		Fid_t lsock = Socket(102);
+		ASSERT(Listen(lsock) == 0);
+		ASSERT(Pipe(&pipe) == 0);
+		submit(ring, lsock, pipe.read, buf);
+		Exit(6);
+		return 0;
+	}
+
+	int status;
+	results[1] = results[2] = 0;
+	ASSERT(Exec(returns, 0, NULL) != NOPROC);
+	ASSERT(WaitChild(NOPROC, &status) != NOPROC && status == 5);
+	ASSERT(results[1] == -1 && results[2] == -1);
+
+	ASSERT(Exec(exits, 0, NULL) != NOPROC);
+	ASSERT(WaitChild(NOPROC, &status) != NOPROC && status == 6);
+
+	/* The ports are free again */
+	Fid_t lsock = Socket(102);
+	ASSERT(Listen(lsock) == 0);
+	Close(lsock);
+	return 0;
+}
+
+
 
 TEST_SUITE(socket_tests,
 	"A suite of tests for sockets."
@@ -1770,6 +3459,8 @@ TEST_SUITE(socket_tests,
 	&test_shutdown_read,
 	&test_shutdown_write,
 
+	&test_ioring_socket,
+	&test_ioring_exit_cancels,
 	NULL
 };
 
@@ -1908,6 +3599,9 @@ BARE_TEST(test_parallelism,
 
 	double run_times(uint ntimes, uint ncores)
 	{
+		/* Pinning the cores reduces the variance of the runtimes */
+		vm_configure(&(vm_config){ .pin_cores = 1, .housekeeping_cpu = -1 });
+
 		double minTrun=0.0;
 		for(int I=0;I<ntimes; I++) {
 			boot(ncores, 0, run_twice, 0, NULL);
@@ -1916,6 +3610,7 @@ BARE_TEST(test_parallelism,
 			else 
 				if(Trun < minTrun) minTrun = Trun;
 		}
+		vm_configure(NULL);
 		return minTrun;
 	}
 